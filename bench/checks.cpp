@@ -0,0 +1,216 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// checks for the parts that decide things without running ffmpeg or
+// MediaInfo: splitting MediaInfo's inform report into streams, the CRF
+// search's bisection and --crf-target parsing, and turning cropdetect logs
+// into a crop. run by ctest, or by hand, and exits non-zero if anything is
+// off.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <unistd.h>
+
+#include "util.h"
+
+static size_t failures = 0;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+static void check_crf_steps() {
+  // the candidates split the range evenly, without repeats
+  CHECK(crf_search_steps(0, 30, 1) == std::vector<long>({15}));
+  CHECK(crf_search_steps(0, 30, 3) == std::vector<long>({7, 15, 22}));
+  CHECK(crf_search_steps(5, 5, 4) == std::vector<long>({5}));
+  CHECK(crf_search_steps(3, 4, 4) == std::vector<long>({3}));
+
+  long lo = 0, hi = 30, best = -1;
+  narrow_crf_search({7, 15, 22}, {true, true, false}, lo, hi, best);
+  CHECK(lo == 16 && hi == 21 && best == 15);
+
+  lo = 0, hi = 30, best = -1;
+  narrow_crf_search({7, 15, 22}, {true, true, true}, lo, hi, best);
+  CHECK(lo == 23 && hi == 30 && best == 22);
+
+  lo = 0, hi = 30, best = -1;
+  narrow_crf_search({7, 15, 22}, {false, true, true}, lo, hi, best);
+  CHECK(lo == 0 && hi == 6 && best == -1);
+}
+
+// whatever the last passing step is and however many candidates a round
+// tries, the search has to land on it, and in fewer rounds with more
+static void check_crf_bisection() {
+  for (size_t per_round = 1; per_round <= 6; per_round++) {
+    size_t worst = 0;
+    for (long last = -1; last <= 30; last++) {
+      long lo = 0, hi = 30, best = -1;
+      size_t rounds = 0;
+      while (lo <= hi && rounds < 31) {
+        std::vector<long> steps = crf_search_steps(lo, hi, per_round);
+        std::vector<bool> passed;
+        for (long x : steps) {
+          CHECK(x >= lo && x <= hi);
+          passed.push_back(x <= last);
+        }
+        narrow_crf_search(steps, passed, lo, hi, best);
+        rounds++;
+      }
+      CHECK(best == last);
+      worst = std::max(worst, rounds);
+    }
+    // a plain bisection of 31 steps never needs more than 5 rounds
+    CHECK(per_round > 1 || worst <= 5);
+    CHECK(per_round < 3 || worst <= 4);
+  }
+}
+
+static void check_crf_target() {
+  crf_target t;
+  CHECK(parse_crf_target("ssim:0.98", t));
+  CHECK(t.metric == "ssim" && t.value == 0.98);
+  CHECK(parse_crf_target("vmaf:93", t));
+  CHECK(t.metric == "vmaf" && t.value == 93);
+  CHECK(parse_crf_target("size:12.5", t));
+  CHECK(t.metric == "size" && t.value == 12.5);
+
+  CHECK(!parse_crf_target("ssim", t));
+  CHECK(!parse_crf_target("ssim:", t));
+  CHECK(!parse_crf_target("ssim:0.9x", t));
+  CHECK(!parse_crf_target("psnr:-40", t));
+  CHECK(!parse_crf_target("size:0", t));
+  CHECK(!parse_crf_target("bitrate:3000", t));
+}
+
+static void write_log(const std::string &path, const char *text) {
+  std::ofstream out(path);
+  out << text;
+}
+
+static void check_crop_union(const std::string &dir) {
+  std::string wide = dir + "/wide.log";
+  std::string shifted = dir + "/shifted.log";
+  std::string odd = dir + "/odd.log";
+  std::string black = dir + "/black.log";
+  std::string none = dir + "/none.log";
+
+  // cropdetect's box only ever grows, the last line is the one that counts
+  write_log(wide, "[Parsed_cropdetect_0 @ 0x1] x1:300 x2:1619 y1:0 y2:1079 "
+                  "w:1312 h:1072 x:304 y:4 t:0.04 crop=1312:1072:304:4\n"
+                  "[Parsed_cropdetect_0 @ 0x1] x1:240 x2:1679 y1:0 y2:1079 "
+                  "w:1440 h:1080 x:240 y:0 t:0.08 crop=1440:1080:240:0\n");
+  write_log(shifted, "[Parsed_cropdetect_0 @ 0x1] crop=1436:1076:244:2\n");
+  write_log(odd, "[Parsed_cropdetect_0 @ 0x1] crop=1436:1076:241:3\n");
+  write_log(black, "[Parsed_cropdetect_0 @ 0x1] crop=-1920:-1088:1928:1088\n");
+  write_log(none, "Stream #0:0: Video: h264, yuv420p, 1920x1080\n");
+
+  long w = 0, h = 0, x = 0, y = 0;
+  CHECK(union_crops({wide}, w, h, x, y));
+  CHECK(w == 1440 && h == 1080 && x == 240 && y == 0);
+
+  // the union of both boxes, and black or empty logs don't count
+  CHECK(union_crops({black, shifted, none, wide}, w, h, x, y));
+  CHECK(w == 1440 && h == 1080 && x == 240 && y == 0);
+
+  // odd edges are evened out for 4:2:0
+  CHECK(union_crops({odd}, w, h, x, y));
+  CHECK(x == 240 && y == 2 && w == 1436 && h == 1076);
+
+  CHECK(!union_crops({black, none}, w, h, x, y));
+  CHECK(!union_crops({dir + "/missing.log"}, w, h, x, y));
+  CHECK(!union_crops({}, w, h, x, y));
+}
+
+// one record the way the inform template lays them out
+static std::string inform_record(const char *tag,
+                                 const std::vector<std::string> &fields) {
+  std::string record = tag;
+  for (auto &field : fields) {
+    record += "\x1f" + field;
+  }
+  return record + "\x1e\r\n";
+}
+
+static void check_inform_report() {
+  std::string report =
+      inform_record("V", {"AVC", "1920", "1080", "Blu-ray", "1420.5", "8000"}) +
+      inform_record("A", {"FLAC", "ja", "2", "", "1420.5", "1536000"}) +
+      inform_record("A", {"AC-3", "en", "6", "", "1420.5", "448000"}) +
+      inform_record("T", {"Signs", "ASS", "en", "No", ""});
+
+  mi_records records;
+  CHECK(parse_inform_report(report, records));
+  CHECK(records.video.size() == 1);
+  CHECK(records.audio.size() == 2);
+  CHECK(records.text.size() == 1);
+  if (records.video.size() == 1 && records.audio.size() == 2 &&
+      records.text.size() == 1) {
+    CHECK(records.video[0][VF_WIDTH] == "1920");
+    CHECK(records.video[0][VF_SOURCE] == "Blu-ray");
+    CHECK(records.audio[1][AF_FORMAT] == "AC-3");
+    CHECK(records.audio[1][AF_CHANNELS] == "6");
+    CHECK(records.audio[0][AF_SOURCE].empty());
+    CHECK(records.text[0][TF_TITLE] == "Signs");
+    CHECK(records.text[0][TF_DEFAULT] == "No");
+  }
+
+  CHECK(parse_inform_report("", records));
+  CHECK(records.video.empty() && records.audio.empty() &&
+        records.text.empty());
+
+  // a record with the wrong number of fields means the template and the
+  // enums have drifted apart
+  CHECK(!parse_inform_report(inform_record("V", {"AVC", "1920"}), records));
+  CHECK(!parse_inform_report(inform_record("X", {"?"}), records));
+}
+
+int main() {
+  const char *tmp = getenv("TMPDIR");
+  std::string tmpl = std::string(tmp && *tmp ? tmp : "/tmp") +
+                     "/animachine-checks-XXXXXX";
+  std::vector<char> buf(tmpl.begin(), tmpl.end());
+  buf.push_back('\0');
+  if (!mkdtemp(buf.data())) {
+    ERROR("Failed to make a directory for the checks");
+    return 1;
+  }
+  std::string dir = buf.data();
+
+  check_inform_report();
+  check_crf_steps();
+  check_crf_bisection();
+  check_crf_target();
+  check_crop_union(dir);
+  rm(dir);
+
+  if (failures) {
+    ERROR("%lu checks failed", failures);
+    return 1;
+  }
+  INFO("All checks passed");
+  return 0;
+}
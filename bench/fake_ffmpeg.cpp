@@ -0,0 +1,224 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// a stand-in for ffmpeg that does no work but talks like it: a banner and
+// a stats line per update on stderr, -progress blocks on the pipe it's
+// given, and an output file at the end. everything is driven by the
+// environment, so bench_orchestration can set it up for the whole batch:
+//
+//   FAKE_FFMPEG_UPDATES      progress updates per encode (20)
+//   FAKE_FFMPEG_INTERVAL_MS  time between updates (5)
+//   FAKE_FFMPEG_DURATION     content seconds it pretends to encode (1420)
+//   FAKE_FFMPEG_LOG_LINES    extra x265 chatter per update (2)
+//   FAKE_FFMPEG_PAWE_EVERY   one output in N exits 176 after finishing (0)
+//   FAKE_FFMPEG_FLAKY_EVERY  one output in N fails its first attempt (0)
+//
+// the output file holds the steady clock time the child finished at, so
+// the benchmark can tell how long it took to notice.
+
+#include <cerrno>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+unsigned long env_or(const char *name, unsigned long fallback) {
+  const char *value = getenv(name);
+  return value && *value ? strtoul(value, nullptr, 10) : fallback;
+}
+
+// FNV-1a, so the same outputs misbehave on every run
+unsigned long long name_hash(const std::string &name) {
+  unsigned long long h = 1469598103934665603ULL;
+  for (char c : name) {
+    h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+  }
+  return h;
+}
+
+void write_all(int fd, const char *buf, size_t len) {
+  while (fd != -1 && len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n <= 0) {
+      return;
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+void say(int fd, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void say(int fd, const char *fmt, ...) {
+  char buf[1024];
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  if (n > 0) {
+    write_all(fd, buf, static_cast<size_t>(n) < sizeof(buf) ? n : sizeof(buf));
+  }
+}
+
+void banner(const char *input, const char *output) {
+  say(2, "ffmpeg version 7.0.1 Copyright (c) 2000-2024 the FFmpeg "
+         "developers\n"
+         "  built with gcc 13.2.0 (GCC)\n"
+         "  configuration: --enable-gpl --enable-version3 --enable-libx265 "
+         "--enable-libopus --enable-libass --enable-libfreetype "
+         "--enable-libfribidi --enable-libharfbuzz --enable-shared\n"
+         "  libavutil      59.  8.100 / 59.  8.100\n"
+         "  libavcodec     61.  3.100 / 61.  3.100\n"
+         "  libavformat    61.  1.100 / 61.  1.100\n"
+         "  libavfilter    10.  1.100 / 10.  1.100\n"
+         "  libswscale      8.  1.100 /  8.  1.100\n"
+         "  libswresample   5.  1.100 /  5.  1.100\n");
+  say(2, "Input #0, matroska,webm, from '%s':\n"
+         "  Metadata:\n"
+         "    encoder         : libebml v1.4.2 + libmatroska v1.6.4\n"
+         "  Duration: 00:23:40.04, start: 0.000000, bitrate: 31201 kb/s\n"
+         "  Stream #0:0: Video: h264 (High), yuv420p(progressive), "
+         "1920x1080 [SAR 1:1 DAR 16:9], 23.98 fps, 23.98 tbr, 1k tbn "
+         "(default)\n"
+         "  Stream #0:1(jpn): Audio: flac, 48000 Hz, stereo, s16 (default)\n"
+         "  Stream #0:2(eng): Subtitle: ass (default)\n",
+      input);
+  say(2, "Stream mapping:\n"
+         "  Stream #0:0 -> #0:0 (h264 (native) -> hevc (libx265))\n"
+         "  Stream #0:1 -> #0:1 (flac (native) -> opus (libopus))\n"
+         "x265 [info]: HEVC encoder version 3.6\n"
+         "x265 [info]: build info [Linux][GCC 13.2.0][64 bit] 10bit\n"
+         "x265 [info]: using cpu capabilities: MMX2 SSE2Fast LZCNT SSSE3 "
+         "SSE4.2 AVX FMA3 BMI2 AVX2\n"
+         "x265 [info]: Main 10 profile, Level-4 (Main tier)\n"
+         "Output #0, mp4, to '%s':\n",
+      output);
+}
+
+int main(int argc, char **argv) {
+  int progress_fd = -1;
+  const char *input = "";
+  const char *output = nullptr;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-progress") && i + 1 < argc &&
+        !strncmp(argv[i + 1], "pipe:", 5)) {
+      progress_fd = atoi(argv[++i] + 5);
+    } else if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+      input = argv[++i];
+    }
+  }
+  if (argc > 1) {
+    output = argv[argc - 1];
+  }
+  if (!output) {
+    say(2, "At least one output file must be specified\n");
+    return 1;
+  }
+
+  unsigned long updates = env_or("FAKE_FFMPEG_UPDATES", 20);
+  unsigned long interval = env_or("FAKE_FFMPEG_INTERVAL_MS", 5);
+  unsigned long duration = env_or("FAKE_FFMPEG_DURATION", 1420);
+  unsigned long chatter = env_or("FAKE_FFMPEG_LOG_LINES", 2);
+  unsigned long pawe = env_or("FAKE_FFMPEG_PAWE_EVERY", 0);
+  unsigned long flaky = env_or("FAKE_FFMPEG_FLAKY_EVERY", 0);
+  unsigned long long hash = name_hash(output);
+
+  banner(input, output);
+
+  // fail the first attempt, but leave a note so the retry goes through
+  std::string marker = std::string(output) + ".flaky";
+  struct stat st;
+  if (flaky && hash % flaky == 0 && stat(marker.c_str(), &st) != 0) {
+    FILE *f = fopen(marker.c_str(), "w");
+    if (f) {
+      fclose(f);
+    }
+    say(2, "[matroska @ 0x55d0c0a3e540] Read error at pos. 1048576\n"
+           "Error while decoding stream #0:0: Invalid data found when "
+           "processing input\n");
+    return 1;
+  }
+
+  double fps = 96.5;
+  for (unsigned long i = 1; i <= updates; i++) {
+    usleep(interval * 1000);
+
+    unsigned long frame = i * duration * 24 / updates;
+    double out_time = static_cast<double>(i) * duration / updates;
+    unsigned long long size = frame * 2600ULL;
+    double speed = fps / 23.976;
+
+    for (unsigned long j = 0; j < chatter; j++) {
+      say(2, "x265 [info]: frame %6lu: QP %.2f, Bits %llu, SSIM 0.9843\n",
+          frame, 21.5 + j * 0.25, size * 8 / (frame ? frame : 1));
+    }
+    say(2, "frame=%6lu fps=%4.1f q=28.0 size=%8llukB time=%02lu:%02lu:%05.2f "
+           "bitrate=%6.1fkbits/s speed=%.3gx    \r",
+        frame, fps, size / 1024, static_cast<unsigned long>(out_time) / 3600,
+        static_cast<unsigned long>(out_time) / 60 % 60,
+        out_time - static_cast<unsigned long>(out_time) / 60 * 60,
+        size * 8 / 1000.0 / out_time, speed);
+
+    say(progress_fd,
+        "frame=%lu\nfps=%.2f\nstream_0_0_q=28.0\nbitrate=%.1fkbits/s\n"
+        "total_size=%llu\nout_time_us=%llu\nout_time_ms=%llu\n"
+        "out_time=%02lu:%02lu:%09.6f\ndup_frames=0\ndrop_frames=0\n"
+        "speed=%.3gx\nprogress=%s\n",
+        frame, fps, size * 8 / 1000.0 / out_time, size,
+        static_cast<unsigned long long>(out_time * 1e6),
+        static_cast<unsigned long long>(out_time * 1e6),
+        static_cast<unsigned long>(out_time) / 3600,
+        static_cast<unsigned long>(out_time) / 60 % 60,
+        out_time - static_cast<unsigned long>(out_time) / 60 * 60, speed,
+        i == updates ? "end" : "continue");
+  }
+
+  say(2, "\nx265 [info]: frame I:    142, Avg QP:19.84  kb/s: 11833.27\n"
+         "x265 [info]: frame P:   8211, Avg QP:22.12  kb/s: 3122.63\n"
+         "x265 [info]: frame B:  25702, Avg QP:25.77  kb/s: 1051.39\n"
+         "x265 [info]: consecutive B-frames: 3.1%% 5.9%% 14.2%% 38.5%% "
+         "38.3%%\n"
+         "encoded 34055 frames in %.2fs (%.2f fps), 1847.12 kb/s, Avg QP:24.85\n",
+      updates * interval / 1000.0, fps);
+
+  FILE *out = fopen(output, "w");
+  if (!out) {
+    say(2, "%s: %s\n", output, strerror(errno));
+    return 1;
+  }
+  fprintf(out, "%lld\n",
+          static_cast<long long>(
+              std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now().time_since_epoch())
+                  .count()));
+  fclose(out);
+
+  // what a blu-ray with broken timestamps ends in, see --ignore-pawe
+  if (pawe && hash % pawe == 0) {
+    say(2, "[mp4 @ 0x55d0c0a41280] Application provided invalid, non "
+           "monotonically increasing dts to muxer\n");
+    return 176;
+  }
+  return 0;
+}
@@ -0,0 +1,181 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// microbenchmarks for the things that run once per file (or per stream)
+// when a big library is scanned and planned: escaping paths for filter
+// graphs, finding ffmpeg on PATH, listing a directory and turning
+// MediaInfo's report into stream records. sizes are well past anything a
+// real season has, so per-entry costs stand out.
+
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+// a scratch directory that lives for the whole run
+std::string scratch_dir() {
+  static std::string dir;
+  if (dir.empty()) {
+    char tmpl[] = "/tmp/animachine-micro.XXXXXX";
+    if (!mkdtemp(tmpl)) {
+      perror("mkdtemp");
+      exit(1);
+    }
+    dir = tmpl;
+  }
+  return dir;
+}
+
+static void BM_escape(benchmark::State &state) {
+  // the worst case: every other character needs escaping
+  std::string path = "/mnt/media/";
+  while (path.size() < static_cast<size_t>(state.range(0))) {
+    path += "[Group] Show's (2024) \"Title\", Ep 01 ";
+  }
+  path.resize(state.range(0));
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(escape(path));
+  }
+  state.SetBytesProcessed(state.iterations() * path.size());
+}
+BENCHMARK(BM_escape)->Arg(64)->Arg(1024)->Arg(16384);
+
+static void BM_which(benchmark::State &state) {
+  // ffmpeg only turns up in the last of range(0) PATH entries
+  std::string bin = scratch_dir() + "/bin";
+  make_directory(bin);
+  std::string exe = bin + "/ffmpeg";
+  std::ofstream(exe) << "#!/bin/sh\n";
+  chmod(exe.c_str(), 0755);
+
+  std::string path;
+  for (int i = 1; i < state.range(0); i++) {
+    path += scratch_dir() + "/missing" + std::to_string(i) + ":";
+  }
+  path += bin;
+
+  const char *old = getenv("PATH");
+  std::string saved = old ? old : "";
+  setenv("PATH", path.c_str(), 1);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(which("ffmpeg"));
+  }
+
+  setenv("PATH", saved.c_str(), 1);
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_which)->Arg(8)->Arg(64)->Arg(512);
+
+// a directory of range(0) episodes, plus some files that aren't
+std::string library_dir(size_t entries) {
+  std::string dir = scratch_dir() + "/lib" + std::to_string(entries);
+  if (directory_exists(dir)) {
+    return dir;
+  }
+  make_directory(dir);
+  for (size_t i = 0; i < entries; i++) {
+    char name[96];
+    snprintf(name, sizeof(name), "/[Group] Show - %06lu [1080p].%s", i,
+             i % 10 == 9 ? "ass" : "mkv");
+    std::ofstream(dir + name);
+  }
+  return dir;
+}
+
+static void BM_build_file_list(benchmark::State &state) {
+  std::string dir = library_dir(state.range(0));
+  size_t offset = state.range(1);
+
+  for (auto _ : state) {
+    std::vector<std::string> list;
+    if (!build_file_list(list, dir, offset)) {
+      state.SkipWithError("build_file_list failed");
+      break;
+    }
+    benchmark::DoNotOptimize(list.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_build_file_list)
+    ->Args({1000, 0})
+    ->Args({100000, 0})
+    ->Args({100000, 1000})
+    ->Args({10000, 5000})
+    ->Unit(benchmark::kMillisecond);
+
+// what MediaInfo's Inform() gives back for a remux with one video track and
+// range(0) audio and subtitle tracks each. the separators are the ones
+// MI_TEMPLATE asks for.
+std::string inform_report(size_t tracks) {
+  const std::string fs = "\x1f";
+  const std::string rs = "\x1e";
+  std::string report = "V" + fs + "HEVC" + fs + "3840" + fs + "2160" + fs +
+                       "Blu-ray" + fs + "1420043" + fs + "48210000" + rs +
+                       "\r\n";
+  for (size_t i = 0; i < tracks; i++) {
+    report += "A" + fs + (i % 2 ? "AC-3" : "FLAC") + fs +
+              (i % 3 ? "en" : "ja") + fs + "6" + fs + "Blu-ray" + fs +
+              "1420043" + fs + "1509000" + rs;
+  }
+  report += "\r\n";
+  for (size_t i = 0; i < tracks; i++) {
+    report += "T" + fs + "Signs & Songs [" + std::to_string(i) + "]" + fs +
+              (i % 2 ? "PGS" : "ASS") + fs + "en" + fs +
+              (i ? "No" : "Yes") + fs + "Blu-ray" + rs;
+  }
+  return report + "\r\n";
+}
+
+static void BM_parse_streams(benchmark::State &state) {
+  std::string report = inform_report(state.range(0));
+
+  for (auto _ : state) {
+    mi_records records;
+    streams inf;
+    if (!parse_inform_report(report, records) ||
+        !populate_streams(records, inf, false)) {
+      state.SkipWithError("parsing failed");
+      break;
+    }
+    benchmark::DoNotOptimize(inf.audio.data());
+  }
+  state.SetItemsProcessed(state.iterations() * (2 * state.range(0) + 1));
+}
+BENCHMARK(BM_parse_streams)->Arg(2)->Arg(25)->Arg(50);
+
+int main(int argc, char **argv) {
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+
+  if (!scratch_dir().empty()) {
+    rm(scratch_dir());
+  }
+  return 0;
+}
@@ -0,0 +1,296 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// measure what the orchestrator itself costs, with fake_ffmpeg standing in
+// for the encoder: a library of empty episodes is listed with
+// build_file_list(), turned into jobs with make_job() (which builds the real
+// ffmpeg arguments) and run through run_jobs(), exactly like a batch would
+// be. the numbers that come out are all ours: how long a free slot waits
+// for its next child, what starting one costs, how much CPU we burn
+// pumping logs and progress, and how much memory each job needs.
+//
+//   bench_orchestration [--episodes N] [--jobs N] [--updates N]
+//                       [--interval-ms N] [--pawe-every N] [--flaky-every N]
+//                       [--ffmpeg PATH] [--keep]
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#ifndef FAKE_FFMPEG
+#define FAKE_FFMPEG "fake_ffmpeg"
+#endif
+
+struct bench_opts {
+  size_t episodes = 2000;
+  size_t jobs = 4;
+  size_t updates = 20;
+  size_t interval_ms = 5;
+  size_t pawe_every = 10;
+  size_t flaky_every = 50;
+  std::string ffmpeg = FAKE_FFMPEG;
+  bool keep = false;
+};
+
+double seconds_since(std::chrono::steady_clock::time_point t) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t)
+      .count();
+}
+
+double cpu_seconds(const struct rusage &ru) {
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec +
+         ru.ru_stime.tv_usec / 1e6;
+}
+
+long max_rss_kb(const struct rusage &ru) {
+#ifdef __APPLE__
+  return ru.ru_maxrss / 1024;
+#else
+  return ru.ru_maxrss;
+#endif
+}
+
+// print mean, median, p99 and max of a sample, scaled for display
+void print_stats(const char *name, std::vector<double> v, double scale,
+                 const char *unit) {
+  if (v.empty()) {
+    printf("  %-24s no samples\n", name);
+    return;
+  }
+  std::sort(v.begin(), v.end());
+  double sum = 0;
+  for (double x : v) {
+    sum += x;
+  }
+  printf("  %-24s mean %9.3f  p50 %9.3f  p99 %9.3f  max %9.3f %s  (n=%lu)\n",
+         name, sum / v.size() * scale, v[v.size() / 2] * scale,
+         v[std::min(v.size() - 1, v.size() * 99 / 100)] * scale,
+         v.back() * scale, unit, v.size());
+}
+
+bool parse_args(int argc, char **argv, bench_opts &opts) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--keep") {
+      opts.keep = true;
+      continue;
+    }
+    if (i == argc - 1) {
+      ERROR("%s: argument not supplied", argv[i]);
+      return false;
+    }
+    const char *value = argv[++i];
+    if (arg == "--ffmpeg") {
+      opts.ffmpeg = value;
+      continue;
+    }
+
+    size_t *n = nullptr;
+    if (arg == "--episodes") {
+      n = &opts.episodes;
+    } else if (arg == "--jobs") {
+      n = &opts.jobs;
+    } else if (arg == "--updates") {
+      n = &opts.updates;
+    } else if (arg == "--interval-ms") {
+      n = &opts.interval_ms;
+    } else if (arg == "--pawe-every") {
+      n = &opts.pawe_every;
+    } else if (arg == "--flaky-every") {
+      n = &opts.flaky_every;
+    } else {
+      ERROR("Unknown option %s", arg.c_str());
+      return false;
+    }
+
+    // unlike size_from_argv(), 0 is fine: it turns pawe and flaky runs off
+    char *endptr;
+    errno = 0;
+    *n = strtoul(value, &endptr, 10);
+    if (endptr == value || *endptr != '\0' || *value == '-' ||
+        *value == '+' || errno == ERANGE) {
+      ERROR("%s: \"%s\" is not a number", arg.c_str(), value);
+      return false;
+    }
+  }
+  if (opts.episodes == 0 || opts.jobs == 0) {
+    ERROR("Need at least one episode and one job");
+    return false;
+  }
+  return true;
+}
+
+void set_env(const char *name, size_t value) {
+  setenv(name, std::to_string(value).c_str(), 1);
+}
+
+bool run_bench(const bench_opts &opts, const std::string &root) {
+  std::string input = root + "/in";
+  std::string output = root + "/out";
+  if (!make_directory(input) || !make_directory(output)) {
+    return false;
+  }
+
+  // the files only have to exist, nothing ever reads them
+  for (size_t i = 0; i < opts.episodes; i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "/[Group] Show - %05lu [1080p].mkv", i + 1);
+    std::ofstream(input + name);
+  }
+
+  set_env("FAKE_FFMPEG_UPDATES", opts.updates);
+  set_env("FAKE_FFMPEG_INTERVAL_MS", opts.interval_ms);
+  set_env("FAKE_FFMPEG_PAWE_EVERY", opts.pawe_every);
+  set_env("FAKE_FFMPEG_FLAKY_EVERY", opts.flaky_every);
+
+  job_context ctx;
+  ctx.program = opts.ffmpeg;
+  ctx.ignore_pawe = true;
+  ctx.max_retries = opts.flaky_every ? 2 : 0;
+
+  ffmpeg_opts ff_opts = ffmpeg_opts();
+  ff_opts.audio.codec = "libopus";
+  ff_opts.video.crf = 20;
+  ff_opts.video.preset = "slow";
+  ff_opts.video.h265_opts = gpresets[2];
+
+  struct rusage ru_start;
+  getrusage(RUSAGE_SELF, &ru_start);
+
+  auto t = std::chrono::steady_clock::now();
+  std::vector<std::string> files;
+  if (!build_file_list(files, input, 0)) {
+    ERROR("Failed to build the file list");
+    return false;
+  }
+  double list_time = seconds_since(t);
+
+  t = std::chrono::steady_clock::now();
+  std::vector<ff_job> jobs(files.size());
+  for (size_t i = 0; i < files.size(); i++) {
+    std::string out = output + "/S01E" +
+                      format_episode(i + 1, files.size()) + ".mp4";
+    if (!make_job(ctx, input + "/" + files[i], out, ff_opts, jobs[i])) {
+      return false;
+    }
+    jobs[i].duration = 1420;
+  }
+  double plan_time = seconds_since(t);
+
+  struct rusage ru_planned;
+  getrusage(RUSAGE_SELF, &ru_planned);
+
+  t = std::chrono::steady_clock::now();
+  bool ok = run_jobs(ctx, jobs, opts.jobs);
+  double run_time = seconds_since(t);
+
+  struct rusage ru_end;
+  getrusage(RUSAGE_SELF, &ru_end);
+
+  // each output holds the time its child finished, so for every slot the
+  // gap between one child exiting and the next one starting is known
+  std::vector<std::vector<const ff_job *>> slots(opts.jobs);
+  for (auto &job : jobs) {
+    if (job.state == JobState::Done) {
+      slots[job.slot].push_back(&job);
+    }
+  }
+
+  std::vector<double> latency;
+  for (auto &slot : slots) {
+    std::sort(slot.begin(), slot.end(),
+              [](const ff_job *a, const ff_job *b) {
+                return a->started < b->started;
+              });
+    for (size_t i = 1; i < slot.size(); i++) {
+      long long exited = 0;
+      std::ifstream(slot[i - 1]->output) >> exited;
+      if (exited == 0 || slot[i]->attempts > 1) {
+        continue;
+      }
+      long long started = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              slot[i]->started.time_since_epoch())
+                              .count();
+      latency.push_back((started - exited) / 1e9);
+    }
+  }
+
+  std::vector<double> spawn;
+  std::vector<double> child_rss;
+  size_t done = 0;
+  size_t retried = 0;
+  size_t pawe = 0;
+  for (auto &job : jobs) {
+    spawn.push_back(job.usage.spawn / (job.attempts ? job.attempts : 1));
+    child_rss.push_back(job.usage.max_rss_kb);
+    done += job.state == JobState::Done;
+    retried += job.attempts > 1;
+    pawe += job.exit_code == 176;
+  }
+
+  double ours = cpu_seconds(ru_end) - cpu_seconds(ru_planned);
+  double n = static_cast<double>(jobs.size());
+
+  log_flush();
+  printf("\n%lu episodes, %lu at a time, %lu updates %lums apart: %s\n",
+         jobs.size(), opts.jobs, opts.updates, opts.interval_ms,
+         ok ? "ok" : "FAILED");
+  printf("  %lu done, %lu retried, %lu exited 176\n", done, retried, pawe);
+  printf("  build_file_list          %9.3f us/entry\n", list_time / n * 1e6);
+  printf("  make_job                 %9.3f us/job\n", plan_time / n * 1e6);
+  printf("  run_jobs                 %9.3f s (%.1f jobs/s)\n", run_time,
+         n / run_time);
+  print_stats("scheduling latency", latency, 1e3, "ms");
+  print_stats("spawn cost", spawn, 1e6, "us");
+  printf("  orchestrator CPU         %9.3f ms/job (%.1f%% of one core)\n",
+         ours / n * 1e3, ours / run_time * 100);
+  printf("  orchestrator RSS         %9.3f KiB/job (%ld KiB peak)\n",
+         (max_rss_kb(ru_end) - max_rss_kb(ru_start)) / n, max_rss_kb(ru_end));
+  print_stats("child max RSS", child_rss, 1, "KiB");
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  bench_opts opts;
+  if (!parse_args(argc, argv, opts)) {
+    return 1;
+  }
+
+  char tmpl[] = "/tmp/animachine-bench.XXXXXX";
+  if (!mkdtemp(tmpl)) {
+    ERROR("mkdtemp failed: %s", strerror(errno));
+    return 1;
+  }
+
+  bool ok = run_bench(opts, tmpl);
+
+  if (opts.keep) {
+    INFO("Left the synthetic library in %s", tmpl);
+  } else {
+    rm(tmpl);
+  }
+  return ok ? 0 : 1;
+}
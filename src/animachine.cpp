@@ -19,18 +19,23 @@
 // SOFTWARE.
 
 #include <MediaInfo/MediaInfo.h>
+#include <algorithm>
 #include <cctype>
 #include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <stdlib.h>
 #include <string>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <vector>
 
-#include "inquirer.h"
 #include "util.h"
 
-using namespace alx;
+// more workers than this is a typo rather than a machine
+#define MAX_WORKERS 1024
+// and so is a staging budget of more than a PiB
+#define MAX_STAGE_GIB (1UL << 20)
 
 int main(int argc, char **argv) {
   clear_tty();
@@ -38,16 +43,191 @@ int main(int argc, char **argv) {
 
   std::string input = "";
   std::string output = "";
+  job_context ctx;
+  bool no_probe_cache = false;
+  bool clear_probe_cache = false;
+  bool preset_bench = false;
+  preset_bench_opts bench;
+  std::vector<std::string> watch_specs;
+  std::string enqueue_path;
+  std::string drain_path;
+  std::string queue_status_path;
+  long priority = 0;
+  std::string output_stage_dir;
+  unsigned long long output_stage_budget = 32ULL << 30;
+
+  ctx.preset_results = default_preset_results();
 
   for(int i = 1; i < argc; i++){
     if (!strncmp(argv[i], "--ignore-pawe", strlen("--ignore-pawe")))
-      FF_IGNORE_PAWE = 1;
+      ctx.ignore_pawe = 1;
     if (!strncmp(argv[i], "--crop", strlen("--crop")))
-      FF_CROP = 1;
+      ctx.crop = 1;
+    if (!strncmp(argv[i], "--progress-file", strlen("--progress-file"))) {
+      if (i == argc - 1) {
+        ERROR("argument not supplied");
+        return 1;
+      }
+      ctx.progress_path = argv[++i];
+    }
+    if (!strncmp(argv[i], "--report", strlen("--report"))) {
+      if (i == argc - 1) {
+        ERROR("argument not supplied");
+        return 1;
+      }
+      ctx.report.reset(new run_report(argv[++i]));
+    }
+    if (!strncmp(argv[i], "--fast-probe", strlen("--fast-probe")))
+      ctx.fast_probe = true;
+    if (!strncmp(argv[i], "--dashboard", strlen("--dashboard")))
+      ctx.dashboard = true;
+    if (!strncmp(argv[i], "--preset-bench", strlen("--preset-bench")))
+      preset_bench = true;
+    if (!strncmp(argv[i], "--spec", strlen("--spec")) ||
+        !strncmp(argv[i], "--record-spec", strlen("--record-spec"))) {
+      if (i == argc - 1) {
+        ERROR("argument not supplied");
+        return 1;
+      }
+      bool recording = argv[i][2] == 'r';
+      ctx.spec.reset(new job_spec(argv[++i], recording));
+      if (!recording && !ctx.spec->load()) {
+        return 1;
+      }
+    }
+    if (!strncmp(argv[i], "--watch", strlen("--watch"))) {
+      if (i == argc - 1) {
+        ERROR("argument not supplied");
+        return 1;
+      }
+      watch_specs.push_back(argv[++i]);
+    }
+    if (!strncmp(argv[i], "--enqueue", strlen("--enqueue")) ||
+        !strncmp(argv[i], "--drain", strlen("--drain")) ||
+        !strncmp(argv[i], "--queue-status", strlen("--queue-status"))) {
+      if (i == argc - 1) {
+        ERROR("argument not supplied");
+        return 1;
+      }
+      std::string &dest = argv[i][2] == 'e'   ? enqueue_path
+                          : argv[i][2] == 'd' ? drain_path
+                                              : queue_status_path;
+      dest = argv[++i];
+    }
+    if (!strncmp(argv[i], "--crf-target", strlen("--crf-target"))) {
+      if (i == argc - 1) {
+        ERROR("argument not supplied");
+        return 1;
+      }
+      if (!parse_crf_target(argv[++i], ctx.crf_search)) {
+        return 1;
+      }
+    }
+    if (!strncmp(argv[i], "--priority", strlen("--priority"))) {
+      if (i == argc - 1) {
+        ERROR("argument not supplied");
+        return 1;
+      }
+      if (!long_from_argv(i, argv, priority)) {
+        return 1;
+      }
+      i++;
+    }
+    if (!strncmp(argv[i], "--stage", strlen("--stage"))) {
+      if (i == argc - 1) {
+        ERROR("argument not supplied");
+        return 1;
+      }
+      std::string flag = argv[i];
+      if (flag == "--stage") {
+        ctx.stage_dir = argv[++i];
+      } else if (flag == "--stage-budget") {
+        size_t gib;
+        if (!size_from_argv(i, argv, MAX_STAGE_GIB, gib)) {
+          return 1;
+        }
+        i++;
+        ctx.stage_budget = static_cast<unsigned long long>(gib) << 30;
+      } else if (flag == "--stage-ahead") {
+        if (!size_from_argv(i, argv, MAX_WORKERS, ctx.stage_ahead)) {
+          return 1;
+        }
+        i++;
+      } else if (flag == "--stage-output") {
+        output_stage_dir = argv[++i];
+      } else if (flag == "--stage-output-budget") {
+        size_t gib;
+        if (!size_from_argv(i, argv, MAX_STAGE_GIB, gib)) {
+          return 1;
+        }
+        i++;
+        output_stage_budget = static_cast<unsigned long long>(gib) << 30;
+      } else {
+        ERROR("unknown option %s", flag.c_str());
+        return 1;
+      }
+    }
+    if (!strncmp(argv[i], "--bench-", strlen("--bench-"))) {
+      if (i == argc - 1) {
+        ERROR("argument not supplied");
+        return 1;
+      }
+      std::string flag = argv[i];
+      std::vector<std::string> list = split_list(argv[++i]);
+      if (flag == "--bench-results") {
+        ctx.preset_results = argv[i];
+      } else if (flag == "--bench-seconds") {
+        bench.seconds = strtoul(argv[i], nullptr, 10);
+      } else if (flag == "--bench-presets") {
+        bench.enc_presets = list;
+      } else if (flag == "--bench-heights" || flag == "--bench-crfs") {
+        std::vector<size_t> &dest =
+            flag == "--bench-heights" ? bench.heights : bench.crfs;
+        dest.clear();
+        for (auto &item : list) {
+          dest.push_back(strtoul(item.c_str(), nullptr, 10));
+        }
+      } else {
+        ERROR("unknown option %s", flag.c_str());
+        return 1;
+      }
+    }
+    if (!strncmp(argv[i], "--no-probe-cache", strlen("--no-probe-cache")))
+      no_probe_cache = true;
+    if (!strncmp(argv[i], "--clear-probe-cache",
+                 strlen("--clear-probe-cache")))
+      clear_probe_cache = true;
     if (!strncmp(argv[i], "--max-retries", strlen("--max-retries"))){
-      if ((MAX_RETRIES = get_from_argv(i, argv)) == 0)
+      if ((ctx.max_retries = get_from_argv(i, argv)) == 0)
         ERROR("failed to set arg 'max-retries'");
     }
+    if (!strncmp(argv[i], "--jobs", strlen("--jobs"))) {
+      if (i == argc - 1) {
+        ERROR("argument not supplied");
+        return 1;
+      }
+      if (!size_from_argv(i, argv, MAX_WORKERS, ctx.max_jobs)) {
+        return 1;
+      }
+    }
+    if (!strncmp(argv[i], "--probe-threads", strlen("--probe-threads"))) {
+      if (i == argc - 1) {
+        ERROR("argument not supplied");
+        return 1;
+      }
+      if (!size_from_argv(i, argv, MAX_WORKERS, ctx.probe_threads)) {
+        return 1;
+      }
+    }
+    if (!strncmp(argv[i], "--chunks", strlen("--chunks"))) {
+      if (i == argc - 1) {
+        ERROR("argument not supplied");
+        return 1;
+      }
+      if (!size_from_argv(i, argv, MAX_WORKERS, ctx.chunks)) {
+        return 1;
+      }
+    }
     // if (!strncmp(argv[i], "--pre-check", strlen("--pre-check"))) 
     //   FF_IGNORE_PAWE = 1;
     if (!strncmp(argv[i], "--entry-offset", strlen("--entry-offset"))) {
@@ -55,21 +235,75 @@ int main(int argc, char **argv) {
         ERROR("argument not supplied");
         return 1;
       }
-      if((ENTRY_OFFSET = get_from_argv(i, argv)) == 0) {
+      if((ctx.entry_offset = get_from_argv(i, argv)) == 0) {
         ERROR("failed to set arg 'entry-offset");
         return 1;
       }
     }
   }
   #ifdef DEBUG
-  if(MAX_RETRIES)
-    DEBUG_INFO("Using max retries of: %hu", MAX_RETRIES);
-  if (ENTRY_OFFSET)
-    DEBUG_INFO("Using entry offset of %hu", ENTRY_OFFSET);
-  if (FF_IGNORE_PAWE)
+  if(ctx.max_retries)
+    DEBUG_INFO("Using max retries of: %lu", ctx.max_retries);
+  if (ctx.entry_offset)
+    DEBUG_INFO("Using entry offset of %lu", ctx.entry_offset);
+  if (ctx.ignore_pawe)
     DEBUG_INFO("Using FF_IGNORE_PAWE");
+  if (ctx.max_jobs > 1)
+    DEBUG_INFO("Using up to %lu concurrent jobs", ctx.max_jobs);
+  if (ctx.chunks > 1)
+    DEBUG_INFO("Splitting each title into %lu chunks", ctx.chunks);
   #endif // debug
 
+  if (!no_probe_cache) {
+    std::string dir = default_cache_dir();
+    if (!dir.empty()) {
+      if (clear_probe_cache) {
+        unlink((dir + "/probe-cache").c_str());
+        unlink((dir + "/crop-cache").c_str());
+      }
+      ctx.cache.reset(new probe_cache(dir + "/probe-cache"));
+    }
+  }
+
+  if (preset_bench) {
+    bench.results = ctx.preset_results;
+    for (auto &preset : bench.enc_presets) {
+      if (std::find(g_enc_presets.begin(), g_enc_presets.end(), preset) ==
+          g_enc_presets.end()) {
+        ERROR("unknown encoder preset \"%s\"", preset.c_str());
+        return 1;
+      }
+    }
+    if (bench.seconds == 0 || bench.heights.empty() || bench.crfs.empty()) {
+      ERROR("nothing to benchmark");
+      return 1;
+    }
+    return run_preset_bench(ctx, bench) ? 0 : 1;
+  }
+
+  if (!output_stage_dir.empty()) {
+    ctx.outputs.reset(new output_stager(output_stage_dir, output_stage_budget));
+  }
+
+  if (!queue_status_path.empty()) {
+    return print_queue(queue_status_path) ? 0 : 1;
+  }
+  if (!drain_path.empty()) {
+    return drain_queue(ctx, drain_path) ? 0 : 1;
+  }
+
+  // the drain takes its options from the answers given now
+  if (!enqueue_path.empty() && !ctx.spec) {
+    std::string spec = new_queue_spec(enqueue_path);
+    if (spec.empty()) {
+      return 1;
+    }
+    ctx.spec.reset(new job_spec(spec, true));
+  }
+
+  if (!watch_specs.empty()) {
+    return watch_folders(ctx, watch_specs) ? 0 : 1;
+  }
 
   bool batch_m = false;
 
@@ -104,12 +338,6 @@ int main(int argc, char **argv) {
 
     INFO("Working in single file mode using \"%s\" -> \"%s\"", argv[1],
          argv[2]);
-
-    gMi.Open(input);
-    if (mi_get_string(Stream_Video, 0, "ID").empty()) {
-      ERROR("File appears to have no video stream");
-      return 1;
-    }
   }
 
   // TODO: tidy
@@ -117,7 +345,9 @@ int main(int argc, char **argv) {
   size_t text;
   size_t season_c;
   std::vector<std::string> file_list;
+  std::vector<file_probe> library;
   String answer;
+  String test_file = input;
   ffmpeg_opts *ff_opts = new ffmpeg_opts();
 
   if (batch_m) {
@@ -131,43 +361,52 @@ int main(int argc, char **argv) {
               << "if this is not the case exit the script now." << std::endl
               << std::endl;
 
-    answer = Question{"batch_check", "Is this acceptable?", Type::yesNo}.ask();
-
-    if (answer == "no") {
+    if (!ask_yes_no(ctx, "batch_check", "Is this acceptable?", answer) ||
+        answer == "no") {
       exit(1);
     }
 
-    if (!build_file_list(file_list, input)) {
+    if (!build_file_list(file_list, input, ctx.entry_offset)) {
       ERROR("Failed to build the file list");
       return 1;
     }
 
-    cast_to_size(
-        Question{"season_c",
-                 "What season is this? Please enter a number:", Type::integer}
-            .ask()
-            .c_str(),
-        season_c);
+    if (ctx.probe_threads) {
+      std::vector<std::string> paths;
+      for (auto &file : file_list) {
+        paths.push_back(input + "/" + file);
+      }
+      if (!probe_library(ctx, paths, ctx.probe_threads, library)) {
+        ERROR("None of the files in \"%s\" could be probed", input.c_str());
+        return 1;
+      }
+    }
 
-    answer = Question{"should_start_at",
-                      "Do you want to start from a specific episode?",
-                      Type::yesNo}
-                 .ask();;
+    if (!ask_number(ctx, "season_c",
+                    "What season is this? Please enter a number:", 0,
+                    UINT16_MAX, answer)) {
+      return 1;
+    }
+    cast_to_size(answer, season_c);
+
+    if (!ask_yes_no(ctx, "should_start_at",
+                    "Do you want to start from a specific episode?",
+                    answer)) {
+      return 1;
+    }
     if (answer == "yes") {
-      if (!cast_to_size(
-              (Question{"opts", "Please enter a starting point:", Type::integer}
-                   .ask()),
-              ff_opts->should_start_at)) {
+      if (!ask_number(ctx, "start_at", "Please enter a starting point:", 1,
+                      UINT16_MAX, answer) ||
+          !cast_to_size(answer, ff_opts->should_start_at)) {
         return 1;
       };
     }
     DEBUG_INFO("file list [0]: %s", file_list[0].c_str());
 
-    String test_file = input + "/" + file_list[0];
-    gMi.Open(test_file);
+    test_file = input + "/" + file_list[0];
   }
 
-  if (!build_options(*ff_opts)) {
+  if (!build_options(ctx, test_file, *ff_opts)) {
     return 1;
   }
 
@@ -182,10 +421,11 @@ int main(int argc, char **argv) {
                 << "If you need them remove them now or exit." << std::endl
                 << std::endl;
 
-      answer = Question{"should_remove",
-                        "The directory already exists, should we clean it?",
-                        Type::yesNo}
-                   .ask();
+      if (!ask_yes_no(ctx, "should_remove",
+                      "The directory already exists, should we clean it?",
+                      answer)) {
+        return 1;
+      }
 
       if (answer == "yes") {
         rm(output);
@@ -197,7 +437,8 @@ int main(int argc, char **argv) {
     }
 
     size_t end = file_list.size();
-    if (ff_opts->should_test) {
+    // a queued batch is left to the drain, which never test encodes
+    if (ff_opts->should_test && enqueue_path.empty()) {
 
       String fullpath = output + "/S0" + std::to_string(season_c) + "E" +
                         format_episode(ff_opts->should_start_at, end) + ".mp4";
@@ -206,16 +447,16 @@ int main(int argc, char **argv) {
 
       String testfile = input + "/" + file_list[0];
 
-      if (!prep_and_call_ffmpeg(testfile, fullpath, *ff_opts)) {
+      if (!prep_and_call_ffmpeg(ctx, testfile, fullpath, *ff_opts)) {
         return 1;
       }
 
-      answer =
-          Question{
-              "should_continue",
+      if (!ask_yes_no(
+              ctx, "should_continue",
               "Processing has finished. Should we continue with the batch?",
-              Type::yesNo}
-              .ask();
+              answer)) {
+        return 1;
+      }
 
       if (answer == "no") {
         return 0;
@@ -230,24 +471,105 @@ int main(int argc, char **argv) {
       DEBUG_INFO("  %s", f.c_str());
     }
 
-    for (auto &file : file_list) {
+    if (!resolve_ffmpeg(ctx)) {
+      return 1;
+    }
+
+    std::vector<ff_job> jobs(file_list.size());
+    for (size_t j = 0; j < file_list.size(); j++) {
 
       String outpath = output + "/S0" + std::to_string(season_c) + "E" +
                        format_episode(i, end) + ".mp4";
 
-      String inpath = input + "/" + file;
+      String inpath = input + "/" + file_list[j];
 
-      DEBUG_INFO("now transcoding %s -> %s", inpath.c_str(), outpath.c_str());
+      DEBUG_INFO("now queueing %s -> %s", inpath.c_str(), outpath.c_str());
 
-      if (!prep_and_call_ffmpeg(inpath, outpath, *ff_opts)) {
+      if (!make_job(ctx, inpath, outpath, *ff_opts, jobs[j])) {
         return 1;
       }
       i++;
     }
+
+    if (!enqueue_path.empty()) {
+      return enqueue_jobs(ctx, enqueue_path, priority, jobs) ? 0 : 1;
+    }
+
+    // copy upcoming episodes off slow storage while earlier ones encode
+    std::unique_ptr<input_stager> stager;
+    if (!ctx.stage_dir.empty()) {
+      std::vector<std::string> paths;
+      for (auto &job : jobs) {
+        paths.push_back(job.input);
+      }
+      stager.reset(new input_stager(
+          ctx.stage_dir, ctx.stage_budget, paths,
+          ctx.stage_ahead ? ctx.stage_ahead : ctx.max_jobs));
+    }
+
+    // chunked titles already fill the pool on their own, so take the
+    // episodes one at a time
+    if (ctx.chunks > 1) {
+      for (size_t j = 0; j < jobs.size(); j++) {
+        std::string source = jobs[j].input;
+        if (stager) {
+          // taken before the stager is let past it, so the first one is
+          // read in place rather than copied only to be abandoned, and each
+          // later one was staged while the one before it encoded
+          std::string staged = stager->take(j);
+          if (!staged.empty()) {
+            source = staged;
+          }
+          stager->advance(j + 1);
+        }
+        if (!prep_and_call_ffmpeg(ctx, source, jobs[j].output, *ff_opts)) {
+          return 1;
+        }
+        if (stager) {
+          stager->release(j);
+        }
+      }
+      goto done;
+    }
+
+    // check each episode against the options, either from the up-front
+    // probe or in the background while the previous ones encode
+    std::unique_ptr<probe_ahead> probes;
+    if (!library.empty()) {
+      std::vector<probe_summary> done(library.size());
+      for (size_t j = 0; j < library.size(); j++) {
+        done[j].path = library[j].path;
+        if (library[j].ok) {
+          summarise_probe(library[j].inf, *ff_opts, done[j]);
+        } else {
+          done[j].problem = "MediaInfo could not parse the file";
+        }
+      }
+      probes.reset(new probe_ahead(done));
+    } else {
+      std::vector<std::string> paths;
+      for (auto &job : jobs) {
+        paths.push_back(job.input);
+      }
+      probes.reset(new probe_ahead(ctx, *ff_opts, paths, ctx.max_jobs));
+    }
+
+    if (!run_jobs(ctx, jobs, ctx.max_jobs, probes.get(), nullptr,
+                  stager.get())) {
+      ERROR("One or more episodes failed to transcode");
+      return 1;
+    }
     goto done;
   }
 
-  if (!prep_and_call_ffmpeg(input, output, *ff_opts)) {
+  if (!enqueue_path.empty()) {
+    std::vector<ff_job> jobs(1);
+    jobs[0].input = input;
+    jobs[0].output = output;
+    return enqueue_jobs(ctx, enqueue_path, priority, jobs) ? 0 : 1;
+  }
+
+  if (!prep_and_call_ffmpeg(ctx, input, output, *ff_opts)) {
     ERROR("Failed to complete transcode");
     return 1;
   }
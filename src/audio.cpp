@@ -20,30 +20,24 @@
 
 #include "util.h"
 
-bool populate_audio_data(audio_info &audio, size_t index) {
-  char *endptr;
-  char *cstring;
-
-  String t_format = mi_get_string(Stream_Audio, index, "Format");
-  String t_lang = mi_get_string(Stream_Audio, index, "Language");
+bool populate_audio_data(const mi_fields &fields, audio_info &audio,
+                         size_t index) {
+  const String &t_format = fields[AF_FORMAT];
+  const String &t_lang = fields[AF_LANGUAGE];
 
   audio.index = index;
-  if (!cast_to_size(mi_get_string(Stream_Audio, index, "Channel(s)").c_str(),
-                    audio.channel_count)) {
+  if (!cast_to_size(fields[AF_CHANNELS], audio.channel_count)) {
     return false;
   }
 
   audio.format = !t_format.empty() ? t_format : "-";
   audio.lang = !t_lang.empty() ? t_lang : "-";
-  audio.is_bluray =
-      mi_get_string(Stream_Audio, index, "OriginalSourceMedium") == "Blu-ray"
-          ? 1
-          : 0;
+  audio.is_bluray = fields[AF_SOURCE] == "Blu-ray" ? 1 : 0;
 
-  if (!handle_duration(mi_get_string(Stream_Audio, index, "Duration"), audio)) {
+  if (!handle_duration(fields[AF_DURATION], audio)) {
     return false;
   };
-  if (!handle_bitrate(mi_get_string(Stream_Audio, index, "BitRate"), audio)) {
+  if (!handle_bitrate(fields[AF_BITRATE], audio)) {
     return false;
   };
 
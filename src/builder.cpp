@@ -0,0 +1,122 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "util.h"
+
+// a feed can't work out a title's options from inside its refill: crop
+// detection and the CRF search both run ffmpeg jobs of their own, and a
+// run_jobs nested in another one's refill stops the outer one reaping its
+// children and draining their pipes until it returns, and pins its own to
+// cores that are already taken. instead the feed hands the title to the
+// builder, which works it out on a thread of its own with as many slots as
+// were free at the time, and leaves those slots empty until it's done. its
+// run_jobs is a background one (see job_context), so the terminal, the
+// environment and the cores are left to the run_jobs in front.
+
+options_builder::~options_builder() {
+  {
+    std::lock_guard<std::mutex> lock(m);
+    stop = true;
+  }
+  cv.notify_all();
+  if (worker.joinable()) {
+    worker.join();
+  }
+}
+
+bool options_builder::start(size_t key, const job_context &ctx,
+                            const std::string &sample, size_t slots) {
+  {
+    std::lock_guard<std::mutex> lock(m);
+    if (this->slots || done) {
+      return false;
+    }
+
+    // nothing it runs is kept, so it stays out of everything that is
+    job_context *local = new job_context(ctx);
+    local->background = true;
+    local->max_jobs = slots ? slots : 1;
+    local->progress_path.clear();
+    local->report.reset();
+    local->outputs.reset();
+
+    this->ctx.reset(local);
+    this->sample = sample;
+    this->key = key;
+    this->slots = local->max_jobs;
+  }
+
+  if (!worker.joinable()) {
+    worker = std::thread(&options_builder::run, this);
+  }
+  cv.notify_all();
+  return true;
+}
+
+size_t options_builder::held() {
+  std::lock_guard<std::mutex> lock(m);
+  return slots;
+}
+
+bool options_builder::take(size_t key, ffmpeg_opts &opts, bool &failed) {
+  std::lock_guard<std::mutex> lock(m);
+  if (!done || this->key != key) {
+    return false;
+  }
+  opts = this->opts;
+  failed = !ok;
+  done = false;
+  return true;
+}
+
+void options_builder::wait(int ms) {
+  std::unique_lock<std::mutex> lock(m);
+  cv.wait_for(lock, std::chrono::milliseconds(ms),
+              [&] { return slots == 0; });
+}
+
+void options_builder::run() {
+  for (;;) {
+    std::unique_ptr<job_context> local;
+    std::string path;
+    {
+      std::unique_lock<std::mutex> lock(m);
+      cv.wait(lock, [&] { return stop || ctx; });
+      if (!ctx) {
+        return;
+      }
+      local = std::move(ctx);
+      path = sample;
+    }
+
+    // the slow part happens without the lock held
+    ffmpeg_opts built = ffmpeg_opts();
+    bool built_ok = build_options(*local, path, built);
+
+    {
+      std::lock_guard<std::mutex> lock(m);
+      opts = built;
+      ok = built_ok;
+      done = true;
+      slots = 0;
+    }
+    cv.notify_all();
+  }
+}
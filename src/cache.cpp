@@ -0,0 +1,365 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <cstdio>
+#include <fstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+// the probe cache keeps the parsed stream records of every file we've seen,
+// keyed by device + inode and only trusted while the size and mtime still
+// match. records from a --fast-probe are marked, since it can miss fields
+// a full parse finds: they only answer other fast probes, and a full probe
+// of the same file replaces them. it's a plain text file of tab separated
+// records:
+//
+//   F dev ino size mtime_s mtime_ns fast path
+//   V ... one line per video stream
+//   A ... one line per audio stream
+//   T ... one line per text stream
+//
+// bump the version whenever the records change shape; a file with any
+// other version is thrown away on load.
+#define PROBE_CACHE_VERSION "animachine-probe-cache 2"
+
+bool stat_key(const std::string &path, file_key &key) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return false;
+  }
+
+  key.dev = static_cast<unsigned long long>(st.st_dev);
+  key.ino = static_cast<unsigned long long>(st.st_ino);
+  key.size = static_cast<unsigned long long>(st.st_size);
+  key.mtime = static_cast<long long>(st.st_mtime);
+#ifdef __APPLE__
+  key.mtime_ns = st.st_mtimespec.tv_nsec;
+#else
+  key.mtime_ns = st.st_mtim.tv_nsec;
+#endif
+  return true;
+}
+
+std::string default_cache_dir() {
+  const char *xdg = std::getenv("XDG_CACHE_HOME");
+  if (xdg && *xdg) {
+    return std::string(xdg) + "/animachine";
+  }
+  const char *home = std::getenv("HOME");
+  if (home && *home) {
+    return std::string(home) + "/.cache/animachine";
+  }
+  return "";
+}
+
+// tabs and newlines separate fields and records, so they can't appear raw
+std::string cache_escape(const std::string &in) {
+  std::string out;
+  out.reserve(in.size());
+  for (char c : in) {
+    switch (c) {
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    default:
+      out += c;
+    }
+  }
+  return out;
+}
+
+std::vector<std::string> cache_split(const std::string &line) {
+  std::vector<std::string> fields(1);
+  for (size_t i = 0; i < line.size(); i++) {
+    char c = line[i];
+    if (c == '\t') {
+      fields.push_back("");
+    } else if (c == '\\' && i + 1 < line.size()) {
+      c = line[++i];
+      fields.back() += c == 't' ? '\t' : c == 'n' ? '\n' : c;
+    } else {
+      fields.back() += c;
+    }
+  }
+  return fields;
+}
+
+static unsigned long long to_ull(const std::string &s) {
+  return strtoull(s.c_str(), nullptr, 10);
+}
+
+static void write_streams(std::ostream &out, const streams &inf) {
+  for (auto &v : inf.video) {
+    out << "V\t" << cache_escape(v.format) << '\t'
+        << cache_escape(v.br.bitrate_str) << '\t' << v.br.kbps << '\t'
+        << v.ds.width << '\t' << v.ds.height << '\t' << cache_escape(v.info)
+        << '\t' << v.is_bluray << '\t' << v.is_default << '\t'
+        << cache_escape(v.dr.duration_str) << '\t' << v.dr.duration << '\n';
+  }
+  for (auto &a : inf.audio) {
+    out << "A\t" << a.index << '\t' << cache_escape(a.format) << '\t'
+        << cache_escape(a.br.bitrate_str) << '\t' << a.br.kbps << '\t'
+        << a.channel_count << '\t' << cache_escape(a.lang) << '\t'
+        << cache_escape(a.info) << '\t' << cache_escape(a.service_kind)
+        << '\t' << a.is_bluray << '\t' << cache_escape(a.dr.duration_str)
+        << '\t' << a.dr.duration << '\n';
+  }
+  for (auto &t : inf.text) {
+    out << "T\t" << t.index << '\t' << cache_escape(t.format) << '\t'
+        << cache_escape(t.info) << '\t' << cache_escape(t.lang) << '\t'
+        << cache_escape(t.is_default) << '\t' << t.is_bluray << '\n';
+  }
+}
+
+static bool read_streams(const std::string &record, streams &inf) {
+  std::istringstream in(record);
+  std::string line;
+
+  inf.clear();
+
+  while (std::getline(in, line)) {
+    std::vector<std::string> f = cache_split(line);
+
+    if (f[0] == "V" && f.size() == 11) {
+      inf.video.push_back(video_info());
+      video_info &v = inf.video.back();
+      v.format = f[1];
+      v.br.bitrate_str = f[2];
+      v.br.kbps = to_ull(f[3]);
+      v.ds.width = to_ull(f[4]);
+      v.ds.height = to_ull(f[5]);
+      v.info = f[6];
+      v.is_bluray = f[7] == "1";
+      v.is_default = f[8] == "1";
+      v.dr.duration_str = f[9];
+      v.dr.duration = to_ull(f[10]);
+    } else if (f[0] == "A" && f.size() == 12) {
+      inf.audio.push_back(audio_info());
+      audio_info &a = inf.audio.back();
+      a.index = to_ull(f[1]);
+      a.format = f[2];
+      a.br.bitrate_str = f[3];
+      a.br.kbps = to_ull(f[4]);
+      a.channel_count = to_ull(f[5]);
+      a.lang = f[6];
+      a.info = f[7];
+      a.service_kind = f[8];
+      a.is_bluray = f[9] == "1";
+      a.dr.duration_str = f[10];
+      a.dr.duration = to_ull(f[11]);
+    } else if (f[0] == "T" && f.size() == 7) {
+      inf.text.push_back(text_info());
+      text_info &t = inf.text.back();
+      t.index = to_ull(f[1]);
+      t.format = f[2];
+      t.info = f[3];
+      t.lang = f[4];
+      t.is_default = f[5];
+      t.is_bluray = f[6] == "1";
+    } else {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+probe_cache::probe_cache(const std::string &path) : path(path) { load(); }
+
+probe_cache::~probe_cache() {
+  if (dirty) {
+    save();
+  }
+}
+
+void probe_cache::load() {
+  if (!read(entries)) {
+    WARNING("Ignoring probe cache \"%s\" from another version", path.c_str());
+    dirty = true;
+  }
+  DEBUG_INFO("Loaded %lu entries from %s", entries.size(), path.c_str());
+}
+
+// what's in the file now, false if it's from another version
+bool probe_cache::read(std::map<std::string, entry> &into) const {
+  std::ifstream in(path);
+  if (!in) {
+    return true;
+  }
+
+  std::string line;
+  if (!std::getline(in, line) || line != PROBE_CACHE_VERSION) {
+    return false;
+  }
+
+  std::string ident;
+  entry current;
+  auto flush = [&]() {
+    if (!ident.empty()) {
+      into[ident] = current;
+    }
+  };
+
+  while (std::getline(in, line)) {
+    if (line.compare(0, 2, "F\t") != 0) {
+      current.record += line + "\n";
+      continue;
+    }
+
+    flush();
+    current = entry();
+    ident.clear();
+
+    std::vector<std::string> f = cache_split(line);
+    if (f.size() != 8) {
+      continue;
+    }
+    current.key.dev = to_ull(f[1]);
+    current.key.ino = to_ull(f[2]);
+    current.key.size = to_ull(f[3]);
+    current.key.mtime = strtoll(f[4].c_str(), nullptr, 10);
+    current.key.mtime_ns = strtol(f[5].c_str(), nullptr, 10);
+    current.fast = f[6] == "1";
+    current.path = f[7];
+    ident = f[1] + ":" + f[2];
+  }
+  flush();
+  return true;
+}
+
+bool probe_cache::lookup(const file_key &key, streams &inf, bool fast) {
+  std::lock_guard<std::mutex> lock(m);
+
+  auto it = entries.find(std::to_string(key.dev) + ":" +
+                         std::to_string(key.ino));
+  if (it == entries.end()) {
+    return false;
+  }
+
+  // same inode, but the file has been rewritten since
+  if (it->second.key.size != key.size || it->second.key.mtime != key.mtime ||
+      it->second.key.mtime_ns != key.mtime_ns) {
+    entries.erase(it);
+    dirty = true;
+    return false;
+  }
+  if (it->second.fast && !fast) {
+    return false;
+  }
+
+  return read_streams(it->second.record, inf);
+}
+
+void probe_cache::store(const file_key &key, const std::string &file,
+                        const streams &inf, bool fast) {
+  std::ostringstream record;
+  write_streams(record, inf);
+
+  std::lock_guard<std::mutex> lock(m);
+  entry &e = entries[std::to_string(key.dev) + ":" + std::to_string(key.ino)];
+  e.key = key;
+  e.path = file;
+  e.fast = fast;
+  e.fresh = true;
+  e.record = record.str();
+  dirty = true;
+}
+
+static bool same_key(const file_key &a, const file_key &b) {
+  return a.dev == b.dev && a.ino == b.ino && a.size == b.size &&
+         a.mtime == b.mtime && a.mtime_ns == b.mtime_ns;
+}
+
+// other runs may have saved since this one loaded, so what's on disk is
+// read again under the lock and merged with what this run stored before
+// it's replaced. nothing is stat'd here: a library that's unmounted right
+// now shouldn't empty the cache, and a big one shouldn't cost a stat a file.
+bool probe_cache::save() {
+  std::lock_guard<std::mutex> lock(m);
+
+  size_t slash = path.rfind('/');
+  if (slash != std::string::npos && !make_directory(path.substr(0, slash))) {
+    return false;
+  }
+
+  file_lock held(path);
+  if (!held.held()) {
+    return false;
+  }
+
+  std::map<std::string, entry> merged;
+  read(merged);
+  std::map<std::string, std::string> stored; // path -> "dev:ino"
+  for (auto &it : entries) {
+    if (!it.second.fresh) {
+      continue;
+    }
+    stored[it.second.path] = it.first;
+    auto theirs = merged.find(it.first);
+    // ours, unless theirs is a full probe of the same file where ours was
+    // only a fast one
+    if (theirs != merged.end() && same_key(theirs->second.key, it.second.key) &&
+        it.second.fast && !theirs->second.fast) {
+      continue;
+    }
+    merged[it.first] = it.second;
+  }
+
+  // a path we stored under another device and inode has been replaced, so
+  // whatever was kept for it before is gone for good
+  for (auto it = merged.begin(); it != merged.end();) {
+    auto ours = stored.find(it->second.path);
+    if (ours != stored.end() && ours->second != it->first) {
+      it = merged.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  bool ok = replace_file(path, [&](std::ostream &out) {
+    out << PROBE_CACHE_VERSION << '\n';
+    for (auto &it : merged) {
+      const entry &e = it.second;
+      out << "F\t" << e.key.dev << '\t' << e.key.ino << '\t' << e.key.size
+          << '\t' << e.key.mtime << '\t' << e.key.mtime_ns << '\t' << e.fast
+          << '\t' << cache_escape(e.path) << '\n'
+          << e.record;
+    }
+    return static_cast<bool>(out);
+  });
+
+  if (!ok) {
+    ERROR("Failed to save probe cache \"%s\"", path.c_str());
+    return false;
+  }
+
+  DEBUG_INFO("Saved %lu entries to %s", merged.size(), path.c_str());
+  entries.swap(merged);
+  dirty = false;
+  return true;
+}
@@ -0,0 +1,410 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <unistd.h>
+
+#include "util.h"
+
+// chunked mode cuts a long title into pieces that get encoded as separate
+// libx265 processes. every piece is opened with an input-side -ss, so the
+// cut is frame accurate and each piece starts on its own IDR frame, i.e. the
+// joins are closed-GOP boundaries and the pieces can be concatenated with
+// -c copy. audio is never chunked: it is encoded (or copied) in one go from
+// the source while the pieces are stitched back together, so there are no
+// gaps or priming artefacts at the joins.
+//
+// test encodes use the same pieces: a handful of short samples spread over
+// the title, each seeked to on the input side (so nothing before it gets
+// decoded), encoded at the same time with their own audio and joined into
+// one preview.
+
+// anything shorter than this isn't worth the extra processes
+#define MIN_CHUNK_SECONDS 60
+
+// a test encode is this many samples of this many seconds
+#define TEST_SAMPLES 6
+#define TEST_SAMPLE_SECONDS 10
+
+// bitmap subs that started just before a cut would be lost, because the
+// demuxer only hands us packets after the seek point. open the input a bit
+// earlier and trim the extra frames off after the overlay.
+#define SUBTITLE_PREROLL 30
+
+std::string format_seconds(double seconds) {
+  std::ostringstream oss;
+  oss << std::fixed << std::setprecision(3) << seconds;
+  return oss.str();
+}
+
+bool probe_duration(job_context &ctx, const std::string &path,
+                    size_t &seconds) {
+  streams inf;
+  if (!probe_streams(ctx, path, inf) || inf.video.empty() ||
+      inf.video[0].dr.duration == 0) {
+    ERROR("Could not work out the duration of \"%s\"", path.c_str());
+    return false;
+  }
+
+  seconds = inf.video[0].dr.duration;
+  return true;
+}
+
+// where to open the source for a segment, and how much of what's decoded
+// from there to throw away before the segment really starts
+void segment_seek(const ffmpeg_opts &opts, const segment &seg, double &seek,
+                  double &trim) {
+  seek = seg.start;
+  trim = 0;
+
+  bool bitmap_subs = opts.text.should_encode_subs &&
+                     (opts.text.codec == TextCodec::PGS ||
+                      opts.text.codec == TextCodec::VobSub);
+  if (bitmap_subs && seg.start > 0) {
+    seek = seg.start > SUBTITLE_PREROLL ? seg.start - SUBTITLE_PREROLL : 0;
+    trim = seg.start - seek;
+  }
+}
+
+// an encode of one segment of the source, video only unless asked
+bool make_segment_job(const job_context &ctx, const std::string &input,
+                      const ffmpeg_opts &opts, const segment &seg,
+                      ff_job &job, bool with_audio) {
+  double seek, trim;
+  segment_seek(opts, seg, seek, trim);
+
+  job.input = input;
+  job.output = seg.path;
+  job.log_path = seg.path + ".log";
+  job.max_attempts = ctx.max_retries ? ctx.max_retries : 1;
+  job.ignore_pawe = ctx.ignore_pawe;
+  // it's only ever read back by us, from where it was written
+  job.unstaged = true;
+  job.args = {"-y"};
+
+  if (seek > 0) {
+    job.args.insert(job.args.end(), {"-ss", format_seconds(seek)});
+  }
+  if (seg.length > 0) {
+    job.args.insert(job.args.end(), {"-t", format_seconds(trim + seg.length)});
+  }
+  job.args.insert(job.args.end(), {"-i", input});
+
+  std::string graph;
+  if (!build_video_filter(input, opts, seek, trim, graph)) {
+    return false;
+  }
+
+  if (!graph.empty()) {
+    job.args.insert(job.args.end(), {"-filter_complex", graph, "-map", "[v]"});
+  } else {
+    job.args.insert(job.args.end(), {"-map", "0:v:0"});
+  }
+
+  append_codec_args(opts, job.args, with_audio);
+  if (with_audio) {
+    job.args.insert(job.args.end(),
+                    {"-map", "0:a:" + std::to_string(opts.audio.index)});
+  } else {
+    job.args.insert(job.args.end(), {"-an"});
+  }
+  job.args.insert(job.args.end(), {"-sn", seg.path});
+  return true;
+}
+
+// where the pieces of output are kept until they're joined. they're only
+// ever read back by the join, so they go on the output stager's local
+// scratch if there is one, and next to the output if not.
+std::string work_dir(const job_context &ctx, const std::string &output,
+                     const char *suffix) {
+  std::string local = ctx.outputs ? ctx.outputs->scratch_path(output) : "";
+  return (local.empty() ? output : local) + suffix;
+}
+
+bool write_concat_list(const std::string &path,
+                       const std::vector<segment> &segs) {
+  std::ofstream list(path);
+  if (!list) {
+    ERROR("Failed to write \"%s\"", path.c_str());
+    return false;
+  }
+
+  for (auto &seg : segs) {
+    // the concat demuxer wants single quotes escaped as '\''
+    std::string quoted;
+    for (char c : seg.path) {
+      quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+    }
+    list << "file '" << quoted << "'" << std::endl;
+  }
+  list.close();
+  return static_cast<bool>(list);
+}
+
+// losslessly join the encoded video segments, and pull the selected audio
+// track across from the source in the same pass. the list of segments is
+// written to dir alongside them.
+bool make_concat_job(const std::string &target, const std::string &output,
+                     const ffmpeg_opts &opts,
+                     const std::vector<segment> &segs, const std::string &dir,
+                     ff_job &job) {
+  std::string list_path = dir + "/concat.txt";
+  if (!write_concat_list(list_path, segs)) {
+    return false;
+  }
+
+  job.input = target;
+  job.output = output;
+  job.log_path = output + ".log";
+  job.args = {"-y", "-f", "concat", "-safe", "0", "-i", list_path,
+              "-i", target, "-map", "0:v:0"};
+
+  append_audio_args(opts, job.args);
+  job.args.insert(job.args.end(),
+                  {"-map", "1:a:" + std::to_string(opts.audio.index),
+                   "-c:v", "copy", output});
+  return true;
+}
+
+bool concat_segments(const job_context &ctx, const std::string &target,
+                     const std::string &output, const ffmpeg_opts &opts,
+                     const std::vector<segment> &segs,
+                     const std::string &dir, ff_job &job) {
+  std::vector<ff_job> mux(1);
+  if (!make_concat_job(target, output, opts, segs, dir, mux[0])) {
+    return false;
+  }
+
+  INFO("Joining %lu segments into %s", segs.size(), output.c_str());
+  bool ok = run_jobs(ctx, mux, 1);
+  job = std::move(mux[0]);
+  return ok;
+}
+
+static void add_usage(job_usage &total, const job_usage &usage) {
+  total.spawn += usage.spawn;
+  total.user += usage.user;
+  total.sys += usage.sys;
+  total.max_rss_kb = std::max(total.max_rss_kb, usage.max_rss_kb);
+  total.nvcsw += usage.nvcsw;
+  total.nivcsw += usage.nivcsw;
+  total.inblock += usage.inblock;
+  total.oublock += usage.oublock;
+}
+
+// the pieces of a title and the join that made it go into the run report as
+// the one job, so a title is only counted once. the usage adds up across
+// them, the wall time is how long the whole title took.
+static void record_title(const job_context &ctx,
+                         const std::vector<ff_job> &pieces, ff_job title,
+                         size_t duration,
+                         std::chrono::steady_clock::time_point started) {
+  if (!ctx.report || pieces.empty()) {
+    return;
+  }
+
+  job_usage total;
+  for (auto &piece : pieces) {
+    if (title.state == JobState::Pending && piece.state != JobState::Done) {
+      // the join never ran, the title went the way of the piece that stopped
+      // it
+      title.state = piece.state;
+      title.exit_code = piece.exit_code;
+    }
+    title.attempts = std::max(title.attempts, piece.attempts);
+    add_usage(total, piece.usage);
+  }
+  if (title.state == JobState::Pending) {
+    title.state = JobState::Failed;
+  }
+  add_usage(total, title.usage);
+  total.wall = std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - started)
+                   .count();
+
+  title.input = pieces.front().input;
+  title.usage = total;
+  title.duration = duration;
+  // the pieces carry the encoder settings, the join only copies
+  title.args = pieces.front().args;
+  ctx.report->record(title);
+  ctx.report->write();
+}
+
+size_t chunk_count(size_t chunks, size_t duration) {
+  if (chunks == 0 || duration / chunks < MIN_CHUNK_SECONDS) {
+    chunks = duration / MIN_CHUNK_SECONDS;
+  }
+  return chunks > 1 ? chunks : 1;
+}
+
+// cut a title of duration seconds into count pieces encoded into dir, the
+// last running to the end so rounding never drops frames
+bool make_chunk_jobs(const job_context &ctx, const std::string &target,
+                     const ffmpeg_opts &opts, size_t duration, size_t count,
+                     const std::string &dir, std::vector<segment> &segs,
+                     std::vector<ff_job> &jobs) {
+  segs.assign(count, segment());
+  jobs.assign(count, ff_job());
+  double step = static_cast<double>(duration) / count;
+
+  for (size_t i = 0; i < count; i++) {
+    segs[i].start = i * step;
+    segs[i].length = i + 1 < count ? step : 0;
+    segs[i].path = dir + "/" + format_episode(i + 1, count) + ".mkv";
+
+    if (!make_segment_job(ctx, target, opts, segs[i], jobs[i])) {
+      return false;
+    }
+    jobs[i].duration = static_cast<size_t>(
+        segs[i].length > 0 ? segs[i].length : duration - segs[i].start);
+  }
+  return true;
+}
+
+bool encode_chunked(job_context &ctx, const std::string &target,
+                    const std::string &output, const ffmpeg_opts &opts) {
+  size_t duration = 0;
+  if (!probe_duration(ctx, target, duration)) {
+    return false;
+  }
+
+  std::string dir = work_dir(ctx, output, ".chunks");
+  if (!make_directory(dir)) {
+    return false;
+  }
+
+  std::vector<segment> segs;
+  std::vector<ff_job> jobs;
+  size_t count = chunk_count(ctx.chunks, duration);
+  if (!make_chunk_jobs(ctx, target, opts, duration, count, dir, segs,
+                       jobs)) {
+    return false;
+  }
+
+  size_t parallel = ctx.max_jobs > 1 ? ctx.max_jobs : segs.size();
+  INFO("Encoding %s as %lu chunks of ~%lu seconds, %lu at a time",
+       target.c_str(), segs.size(), duration / segs.size(), parallel);
+
+  // the pieces are only read back by the join, so they aren't staged, and
+  // neither they nor the join go into the report by themselves
+  auto started = std::chrono::steady_clock::now();
+  job_context quiet(ctx);
+  quiet.report.reset();
+  job_context local(quiet);
+  local.outputs.reset();
+  ff_job title;
+  title.output = output;
+  if (!run_jobs(local, jobs, parallel)) {
+    ERROR("One or more chunks failed, leaving them in %s", dir.c_str());
+    record_title(ctx, jobs, title, duration, started);
+    return false;
+  }
+
+  bool joined = concat_segments(quiet, target, output, opts, segs, dir, title);
+  record_title(ctx, jobs, title, duration, started);
+  if (!joined) {
+    ERROR("Failed to join chunks, leaving them in %s", dir.c_str());
+    return false;
+  }
+
+  rm(dir);
+  return true;
+}
+
+bool encode_samples(job_context &ctx, const std::string &target,
+                    const std::string &output, const ffmpeg_opts &opts) {
+  size_t duration = 0;
+  if (!probe_duration(ctx, target, duration)) {
+    return false;
+  }
+
+  std::string dir = work_dir(ctx, output, ".samples");
+  if (!make_directory(dir)) {
+    return false;
+  }
+
+  // the middle of each of TEST_SAMPLES equal stretches, or the whole thing
+  // if it's too short to bother
+  size_t count = TEST_SAMPLES;
+  double length = TEST_SAMPLE_SECONDS;
+  if (duration <= count * length) {
+    count = 1;
+    length = 0;
+  }
+
+  std::vector<segment> segs(count);
+  std::vector<ff_job> jobs(count);
+  for (size_t i = 0; i < count; i++) {
+    double middle = duration * (2 * i + 1) / (2.0 * count);
+    segs[i].start = length > 0 ? middle - length / 2 : 0;
+    segs[i].length = length;
+    segs[i].path = dir + "/" + format_episode(i + 1, count) + ".mkv";
+
+    if (!make_segment_job(ctx, target, opts, segs[i], jobs[i], true)) {
+      return false;
+    }
+    jobs[i].duration = length > 0 ? static_cast<size_t>(length) : duration;
+  }
+
+  INFO("Test encoding %lu samples of %s", count, target.c_str());
+
+  // the samples are only read back by the join, so they aren't staged, and
+  // neither they nor the join go into the report by themselves
+  auto started = std::chrono::steady_clock::now();
+  job_context quiet(ctx);
+  quiet.report.reset();
+  job_context local(quiet);
+  local.outputs.reset();
+  size_t parallel = ctx.max_jobs > 1 ? ctx.max_jobs : count;
+  size_t sampled = length > 0 ? static_cast<size_t>(count * length) : duration;
+  if (!run_jobs(local, jobs, parallel)) {
+    ERROR("One or more samples failed, leaving them in %s", dir.c_str());
+    ff_job title;
+    title.output = output;
+    record_title(ctx, jobs, title, sampled, started);
+    return false;
+  }
+
+  std::string list_path = dir + "/concat.txt";
+  if (!write_concat_list(list_path, segs)) {
+    return false;
+  }
+
+  std::vector<ff_job> join(1);
+  join[0].input = target;
+  join[0].output = output;
+  join[0].log_path = output + ".log";
+  join[0].args = {"-y", "-f", "concat", "-safe", "0", "-i", list_path,
+                  "-map", "0", "-c", "copy", output};
+
+  bool ok = run_jobs(quiet, join, 1);
+  unlink(list_path.c_str());
+  record_title(ctx, jobs, join[0], sampled, started);
+  if (!ok) {
+    ERROR("Failed to join samples, leaving them in %s", dir.c_str());
+    return false;
+  }
+
+  rm(dir);
+  return true;
+}
@@ -0,0 +1,359 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <unistd.h>
+
+#include "util.h"
+
+// the CRF search picks the CRF for a batch instead of asking for one. a few
+// short samples are taken from across the title (input-side seeks, like
+// chunks), encoded at a handful of candidate CRFs at once, and each
+// candidate is judged by either
+//
+//   ssim / psnr / vmaf: the mean score of its samples against the source
+//                       run through the same filters, or
+//   size:               how many MB a minute of its video comes to.
+//
+// quality only gets worse as the CRF goes up, so the candidates split the
+// range that's left and every round narrows it until the highest CRF that
+// still meets a quality target (or the lowest that fits a size) is found.
+
+#define CRF_SEARCH_SAMPLES 4
+#define CRF_SEARCH_SAMPLE_SECONDS 10
+#define CRF_SEARCH_MIN 10
+#define CRF_SEARCH_MAX 40
+
+bool parse_crf_target(const std::string &in, crf_target &out) {
+  size_t colon = in.find(':');
+  if (colon == std::string::npos) {
+    ERROR("Expected METRIC:VALUE, e.g. ssim:0.98, got \"%s\"", in.c_str());
+    return false;
+  }
+
+  out.metric = in.substr(0, colon);
+  char *end;
+  out.value = strtod(in.c_str() + colon + 1, &end);
+  if (*end != '\0' || out.value <= 0) {
+    ERROR("\"%s\" is not a usable target value", in.c_str() + colon + 1);
+    return false;
+  }
+  if (out.metric != "ssim" && out.metric != "psnr" && out.metric != "vmaf" &&
+      out.metric != "size") {
+    ERROR("Unknown CRF target metric \"%s\" (ssim, psnr, vmaf or size)",
+          out.metric.c_str());
+    return false;
+  }
+  return true;
+}
+
+// whether this ffmpeg was built with a given filter
+static bool have_filter(const job_context &ctx, const std::string &name) {
+  std::string cmd = "'";
+  for (char c : ctx.program) {
+    cmd += c == '\'' ? std::string("'\\''") : std::string(1, c);
+  }
+  cmd += "' -hide_banner -filters 2>/dev/null";
+
+  FILE *pipe = popen(cmd.c_str(), "r");
+  if (!pipe) {
+    return false;
+  }
+
+  bool found = false;
+  char line[512];
+  while (fgets(line, sizeof(line), pipe)) {
+    std::istringstream fields(line);
+    std::string flags, filter;
+    if (fields >> flags >> filter && filter == name) {
+      found = true;
+    }
+  }
+  pclose(pipe);
+  return found;
+}
+
+// the score a comparison filter logged last
+static bool read_score(const std::string &log_path, const std::string &metric,
+                       double &score) {
+  std::ifstream in(log_path);
+  std::string line;
+  const char *marker = metric == "ssim"   ? "All:"
+                       : metric == "psnr" ? "average:"
+                                          : "VMAF score:";
+  bool found = false;
+
+  while (std::getline(in, line)) {
+    size_t at = line.rfind(marker);
+    if (at == std::string::npos) {
+      continue;
+    }
+    std::string value = line.substr(at + strlen(marker));
+    // identical frames give a PSNR of inf
+    score = value.compare(0, 3, "inf") == 0 ? 100
+                                             : strtod(value.c_str(), nullptr);
+    found = true;
+  }
+  return found;
+}
+
+// compare an encoded sample with the same stretch of the source, after the
+// source has been through the same filters (crop, subs) as the encode
+static bool make_score_job(const std::string &input, const ffmpeg_opts &opts,
+                           const segment &seg, const std::string &metric,
+                           ff_job &job) {
+  double seek, trim;
+  segment_seek(opts, seg, seek, trim);
+
+  std::string graph;
+  if (!build_video_filter(input, opts, seek, trim, graph)) {
+    return false;
+  }
+  std::string filter = metric == "vmaf" ? "libvmaf" : metric;
+  // the encode goes first, the reference second
+  graph = graph.empty() ? "[1:v][0:v]" + filter
+                        : graph + ";[1:v][v]" + filter;
+
+  job.input = seg.path;
+  job.output = seg.path + ".score";
+  job.log_path = job.output + ".log";
+  job.args = {"-y"};
+  if (seek > 0) {
+    job.args.insert(job.args.end(), {"-ss", format_seconds(seek)});
+  }
+  job.args.insert(job.args.end(),
+                  {"-t", format_seconds(trim + seg.length), "-i", input, "-i",
+                   seg.path, "-filter_complex", graph, "-f", "null", "-"});
+  return true;
+}
+
+std::vector<long> crf_search_steps(long lo, long hi, size_t per_round) {
+  std::vector<long> steps;
+  for (size_t j = 1; j <= per_round; j++) {
+    long x = lo + (hi - lo) * static_cast<long>(j) /
+                      static_cast<long>(per_round + 1);
+    if (steps.empty() || steps.back() != x) {
+      steps.push_back(x);
+    }
+  }
+  return steps;
+}
+
+void narrow_crf_search(const std::vector<long> &steps,
+                       const std::vector<bool> &passed, long &lo, long &hi,
+                       long &best) {
+  for (size_t i = 0; i < steps.size(); i++) {
+    if (!passed[i]) {
+      hi = steps[i] - 1;
+      return;
+    }
+    best = steps[i];
+    lo = steps[i] + 1;
+  }
+}
+
+struct crf_result {
+  double value = 0; // mean score, or MB per minute
+  bool ok = false;
+};
+
+// encode every sample at every crf, and score them if need be
+static bool try_crfs(const job_context &ctx, const crf_target &target,
+                     const std::string &input, const ffmpeg_opts &opts,
+                     const std::vector<segment> &samples,
+                     const std::string &dir, const std::vector<size_t> &crfs,
+                     std::map<size_t, crf_result> &results) {
+  std::vector<segment> segs;
+  std::vector<ff_job> encodes;
+
+  for (size_t crf : crfs) {
+    ffmpeg_opts candidate = opts;
+    candidate.video.crf = crf;
+    for (size_t i = 0; i < samples.size(); i++) {
+      segment seg = samples[i];
+      seg.path = dir + "/crf" + std::to_string(crf) + "-" +
+                 std::to_string(i + 1) + ".mkv";
+      segs.push_back(seg);
+      encodes.push_back(ff_job());
+      if (!make_segment_job(ctx, input, candidate, seg, encodes.back())) {
+        return false;
+      }
+      encodes.back().duration = static_cast<size_t>(seg.length);
+    }
+  }
+
+  // the samples are thrown away, so they're kept out of the report and
+  // off the terminal
+  job_context local(ctx);
+  local.outputs.reset();
+  local.report.reset();
+  local.dashboard = true;
+  size_t parallel = ctx.max_jobs > 1 ? ctx.max_jobs : encodes.size();
+
+  if (!run_jobs(local, encodes, parallel)) {
+    ERROR("Failed to encode CRF search samples, see the logs in %s",
+          dir.c_str());
+    return false;
+  }
+
+  std::vector<ff_job> scores(segs.size());
+  if (target.metric != "size") {
+    for (size_t i = 0; i < segs.size(); i++) {
+      if (!make_score_job(input, opts, segs[i], target.metric, scores[i])) {
+        return false;
+      }
+    }
+    if (!run_jobs(local, scores, parallel)) {
+      ERROR("Failed to score CRF search samples, see the logs in %s",
+            dir.c_str());
+      return false;
+    }
+  }
+
+  for (size_t c = 0; c < crfs.size(); c++) {
+    double total = 0;
+    double seconds = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+      size_t k = c * samples.size() + i;
+      if (target.metric == "size") {
+        total += file_size(segs[k].path);
+        seconds += segs[k].length;
+        continue;
+      }
+      double score;
+      if (!read_score(scores[k].log_path, target.metric, score)) {
+        ERROR("No %s score in %s", target.metric.c_str(),
+              scores[k].log_path.c_str());
+        return false;
+      }
+      total += score;
+    }
+
+    crf_result &r = results[crfs[c]];
+    if (target.metric == "size") {
+      r.value = total / 1e6 / (seconds / 60);
+      r.ok = r.value <= target.value;
+      INFO("CRF %lu: %.1f MB/min", crfs[c], r.value);
+    } else {
+      r.value = total / samples.size();
+      r.ok = r.value >= target.value;
+      INFO("CRF %lu: %s %.4f", crfs[c], target.metric.c_str(), r.value);
+    }
+  }
+  return true;
+}
+
+bool search_crf(job_context &ctx, const std::string &path, ffmpeg_opts &opts) {
+  // a copy, so falling back to SSIM here doesn't change what later titles
+  // are searched by
+  crf_target target = ctx.crf_search;
+  if (!resolve_ffmpeg(ctx)) {
+    return false;
+  }
+  if (target.metric == "vmaf" && !have_filter(ctx, "libvmaf")) {
+    WARNING("This ffmpeg has no libvmaf, searching by SSIM instead. Pass "
+            "an ssim: target to choose the score yourself.");
+    target.metric = "ssim";
+    target.value = 0.98;
+  }
+
+  size_t duration = 0;
+  if (!probe_duration(ctx, path, duration)) {
+    return false;
+  }
+
+  std::vector<segment> samples(CRF_SEARCH_SAMPLES);
+  double length = CRF_SEARCH_SAMPLE_SECONDS;
+  if (duration <= samples.size() * length) {
+    samples.resize(1);
+    length = duration;
+  }
+  for (size_t i = 0; i < samples.size(); i++) {
+    double middle = duration * (2 * i + 1) / (2.0 * samples.size());
+    samples[i].start = middle > length / 2 ? middle - length / 2 : 0;
+    samples[i].length = length;
+  }
+
+  const char *tmp = getenv("TMPDIR");
+  std::string tmpl = std::string(tmp && *tmp ? tmp : "/tmp") +
+                     "/animachine-crf-XXXXXX";
+  std::vector<char> buf(tmpl.begin(), tmpl.end());
+  buf.push_back('\0');
+  if (!mkdtemp(buf.data())) {
+    ERROR("Failed to make a directory for CRF search samples");
+    return false;
+  }
+  std::string dir = buf.data();
+
+  // as many candidates a round as there are slots for their samples, which
+  // like any other samples run all at once without --jobs
+  size_t slots = ctx.max_jobs > 1 ? ctx.max_jobs : samples.size();
+  size_t per_round = std::max<size_t>(1, slots / samples.size());
+  INFO("Searching CRF %d-%d for %s %g, %lu candidates at a time",
+       CRF_SEARCH_MIN, CRF_SEARCH_MAX, target.metric.c_str(), target.value,
+       per_round);
+
+  // step x means CRF_SEARCH_MIN + x for a quality target and
+  // CRF_SEARCH_MAX - x for a size, so that either way a passing step means
+  // every smaller one passes too and we're after the largest
+  bool by_size = target.metric == "size";
+  auto crf_at = [&](long x) -> size_t {
+    return by_size ? CRF_SEARCH_MAX - x : CRF_SEARCH_MIN + x;
+  };
+
+  std::map<size_t, crf_result> results;
+  long lo = 0;
+  long hi = CRF_SEARCH_MAX - CRF_SEARCH_MIN;
+  long best = -1;
+
+  while (lo <= hi) {
+    std::vector<long> steps = crf_search_steps(lo, hi, per_round);
+    std::vector<size_t> crfs;
+    for (long x : steps) {
+      crfs.push_back(crf_at(x));
+    }
+    if (!try_crfs(ctx, target, path, opts, samples, dir, crfs, results)) {
+      return false;
+    }
+
+    std::vector<bool> passed;
+    for (long x : steps) {
+      passed.push_back(results[crf_at(x)].ok);
+    }
+    narrow_crf_search(steps, passed, lo, hi, best);
+  }
+
+  rm(dir);
+
+  if (best < 0) {
+    opts.video.crf = crf_at(0);
+    WARNING("No CRF in %d-%d meets the target, using %lu",
+            CRF_SEARCH_MIN, CRF_SEARCH_MAX, opts.video.crf);
+  } else {
+    opts.video.crf = crf_at(best);
+    INFO("Using CRF %lu", opts.video.crf);
+  }
+  return true;
+}
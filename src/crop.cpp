@@ -0,0 +1,251 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+#include "util.h"
+
+// --crop used to run cropdetect on every frame of every encode, only to
+// then crop to a fixed 4:3 anyway. instead, the first title is looked at
+// once before anything is encoded: a few frames from each of a handful of
+// spots across it go through cropdetect (input-side seeks, as many at
+// once as --jobs allows), and the smallest box holding everything any of
+// them found becomes a plain crop= for the whole batch. the answer is
+// remembered per file, the same way the probe cache remembers streams, so
+// a second run (or the batch after a test encode) doesn't look again.
+//
+//   animachine-crop-cache 1
+//   dev ino size mtime_s mtime_ns crop  (crop is w:h:x:y, or "none")
+#define CROP_CACHE_VERSION "animachine-crop-cache 1"
+
+#define CROP_SAMPLES 8
+#define CROP_SAMPLE_FRAMES 10
+
+static std::string crop_cache_path() {
+  std::string dir = default_cache_dir();
+  return dir.empty() ? "" : dir + "/crop-cache";
+}
+
+static std::string crop_cache_key(const file_key &key) {
+  return std::to_string(key.dev) + "\t" + std::to_string(key.ino) + "\t" +
+         std::to_string(key.size) + "\t" + std::to_string(key.mtime) + "\t" +
+         std::to_string(key.mtime_ns);
+}
+
+static bool lookup_crop(const std::string &path, const file_key &key,
+                        std::string &crop) {
+  std::ifstream in(path);
+  std::string line;
+  if (!std::getline(in, line) || line != CROP_CACHE_VERSION) {
+    return false;
+  }
+
+  std::string want = crop_cache_key(key) + "\t";
+  while (std::getline(in, line)) {
+    if (line.compare(0, want.size(), want) == 0) {
+      crop = line.substr(want.size());
+      return true;
+    }
+  }
+  return false;
+}
+
+// files that have gone away aren't worth pruning for a line each, so this
+// only ever replaces an entry for the same inode. the file is read again
+// under the lock, so entries other runs stored meanwhile are kept.
+static void store_crop(const std::string &path, const file_key &key,
+                       const std::string &crop) {
+  size_t slash = path.rfind('/');
+  if (slash != std::string::npos && !make_directory(path.substr(0, slash))) {
+    return;
+  }
+
+  file_lock held(path);
+  if (!held.held()) {
+    return;
+  }
+
+  std::vector<std::string> lines;
+  {
+    std::ifstream in(path);
+    std::string line;
+    if (std::getline(in, line) && line == CROP_CACHE_VERSION) {
+      std::string same = std::to_string(key.dev) + "\t" +
+                         std::to_string(key.ino) + "\t";
+      while (std::getline(in, line)) {
+        if (line.compare(0, same.size(), same) != 0) {
+          lines.push_back(line);
+        }
+      }
+    }
+  }
+  lines.push_back(crop_cache_key(key) + "\t" + crop);
+
+  bool ok = replace_file(path, [&](std::ostream &out) {
+    out << CROP_CACHE_VERSION << '\n';
+    for (auto &line : lines) {
+      out << line << '\n';
+    }
+    return static_cast<bool>(out);
+  });
+
+  if (!ok) {
+    WARNING("Failed to save crop cache \"%s\"", path.c_str());
+  }
+}
+
+// the box cropdetect settled on last in a log, false if it never did or
+// only saw black (which gives a negative size)
+static bool read_crop(const std::string &log_path, long &w, long &h,
+                      long &x, long &y) {
+  std::ifstream in(log_path);
+  std::string line;
+  bool found = false;
+
+  while (std::getline(in, line)) {
+    size_t at = line.rfind("crop=");
+    long cw, ch, cx, cy;
+    if (at != std::string::npos &&
+        sscanf(line.c_str() + at, "crop=%ld:%ld:%ld:%ld", &cw, &ch, &cx,
+               &cy) == 4) {
+      w = cw;
+      h = ch;
+      x = cx;
+      y = cy;
+      found = true;
+    }
+  }
+  return found && w > 0 && h > 0;
+}
+
+// the smallest box holding everything cropdetect found in any of the logs,
+// with everything even for 4:2:0. false if every one of them was black.
+bool union_crops(const std::vector<std::string> &log_paths, long &w, long &h,
+                 long &x, long &y) {
+  long left = LONG_MAX, top = LONG_MAX, right = 0, bottom = 0;
+  size_t seen = 0;
+  for (auto &path : log_paths) {
+    long cw = 0, ch = 0, cx = 0, cy = 0;
+    if (read_crop(path, cw, ch, cx, cy)) {
+      left = std::min(left, cx);
+      top = std::min(top, cy);
+      right = std::max(right, cx + cw);
+      bottom = std::max(bottom, cy + ch);
+      seen++;
+    }
+  }
+  if (seen == 0) {
+    return false;
+  }
+
+  x = left & ~1L;
+  y = top & ~1L;
+  w = (right - x) & ~1L;
+  h = (bottom - y) & ~1L;
+  return true;
+}
+
+bool detect_crop(job_context &ctx, const std::string &path, size_t width,
+                 size_t height, std::string &crop) {
+  crop.clear();
+
+  file_key key;
+  std::string cache = ctx.cache ? crop_cache_path() : "";
+  bool cacheable = !cache.empty() && stat_key(path, key);
+  std::string cached;
+  if (cacheable && lookup_crop(cache, key, cached)) {
+    DEBUG_INFO("Crop cache hit for %s: %s", path.c_str(), cached.c_str());
+    crop = cached == "none" ? "" : cached;
+    return true;
+  }
+
+  size_t duration = 0;
+  if (!resolve_ffmpeg(ctx) || !probe_duration(ctx, path, duration)) {
+    return false;
+  }
+
+  const char *tmp = getenv("TMPDIR");
+  std::string tmpl = std::string(tmp && *tmp ? tmp : "/tmp") +
+                     "/animachine-crop-XXXXXX";
+  std::vector<char> buf(tmpl.begin(), tmpl.end());
+  buf.push_back('\0');
+  if (!mkdtemp(buf.data())) {
+    ERROR("Failed to make a directory for crop detection");
+    return false;
+  }
+  std::string dir = buf.data();
+
+  std::vector<ff_job> jobs(CROP_SAMPLES);
+  for (size_t i = 0; i < jobs.size(); i++) {
+    double at = duration * (2 * i + 1) / (2.0 * jobs.size());
+    jobs[i].input = path;
+    jobs[i].output = dir + "/" + std::to_string(i + 1);
+    jobs[i].log_path = jobs[i].output + ".log";
+    // reset=0 keeps growing the box over every frame looked at
+    jobs[i].args = {"-y", "-ss", format_seconds(at), "-i", path,
+                    "-map", "0:v:0", "-frames:v",
+                    std::to_string(CROP_SAMPLE_FRAMES), "-vf",
+                    "cropdetect=limit=24:round=2:reset=0", "-f", "null", "-"};
+  }
+
+  INFO("Looking for black borders in %s", path.c_str());
+
+  // nothing worth keeping comes out of these
+  job_context local(ctx);
+  local.outputs.reset();
+  local.report.reset();
+  local.dashboard = true;
+  if (!run_jobs(local, jobs, ctx.max_jobs)) {
+    ERROR("Crop detection failed, see the logs in %s", dir.c_str());
+    return false;
+  }
+
+  // everything any sample had picture in
+  std::vector<std::string> logs;
+  for (auto &job : jobs) {
+    logs.push_back(job.log_path);
+  }
+  long w, h, left, top;
+  bool found = union_crops(logs, w, h, left, top);
+  rm(dir);
+
+  if (!found) {
+    WARNING("Every sample of %s was black, not cropping", path.c_str());
+    return true;
+  }
+
+  if (w >= static_cast<long>(width) && h >= static_cast<long>(height)) {
+    INFO("No black borders in %s", path.c_str());
+  } else {
+    crop = std::to_string(w) + ":" + std::to_string(h) + ":" +
+           std::to_string(left) + ":" + std::to_string(top);
+    INFO("Cropping %lux%lu to %ldx%ld at %ld,%ld", width, height, w, h, left,
+         top);
+  }
+
+  if (cacheable) {
+    store_crop(cache, key, crop.empty() ? "none" : crop);
+  }
+  return true;
+}
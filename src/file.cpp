@@ -19,9 +19,13 @@
 // SOFTWARE.
 
 #include "util.h"
+#include <cerrno>
 #include <cstring>
 #include <dirent.h>
 #include <algorithm>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <vector>
@@ -95,6 +99,11 @@ bool file_exists(const std::string &path) {
   return S_ISREG(path_stat.st_mode);
 }
 
+unsigned long long file_size(const std::string &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
 bool directory_exists(const std::string &path) {
   struct stat path_stat;
   if (stat(path.c_str(), &path_stat) != 0) {
@@ -187,6 +196,59 @@ bool rm(const std::string &path) {
   return true;
 }
 
+file_lock::file_lock(const std::string &path) {
+  fd = open((path + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    ERROR("Failed to open \"%s.lock\": %s", path.c_str(), strerror(errno));
+    return;
+  }
+  while (flock(fd, LOCK_EX) != 0) {
+    if (errno != EINTR) {
+      ERROR("Failed to lock \"%s\": %s", path.c_str(), strerror(errno));
+      close(fd);
+      fd = -1;
+      return;
+    }
+  }
+}
+
+file_lock::~file_lock() {
+  if (fd != -1) {
+    close(fd);
+  }
+}
+
+// write path whole through a temporary file next to it and a rename, so
+// nobody ever reads half of it. the temporary gets a name of its own, so
+// two runs saving the same file can't write into each other's.
+bool replace_file(const std::string &path,
+                  const std::function<bool(std::ostream &)> &write) {
+  std::string tmpl = path + ".XXXXXX";
+  std::vector<char> buf(tmpl.begin(), tmpl.end());
+  buf.push_back('\0');
+
+  int fd = mkstemp(buf.data());
+  if (fd == -1) {
+    ERROR("Failed to create a temporary file for \"%s\": %s", path.c_str(),
+          strerror(errno));
+    return false;
+  }
+  // mkstemp() makes it private, the file it replaces wasn't
+  fchmod(fd, 0644);
+  close(fd);
+
+  std::string tmp = buf.data();
+  std::ofstream out(tmp);
+  bool ok = out && write(out);
+  out.close();
+
+  if (!ok || !out || rename(tmp.c_str(), path.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
 bool ends_with(const std::string &filename, const std::string &extension) {
   if (filename.length() >= extension.length()) {
     return filename.compare(filename.length() - extension.length(),
@@ -195,7 +257,8 @@ bool ends_with(const std::string &filename, const std::string &extension) {
   return false;
 }
 
-bool build_file_list(std::vector<std::string> &list, std::string &target) {
+bool build_file_list(std::vector<std::string> &list, std::string &target,
+                     size_t entry_offset) {
   DIR *dir;
   struct dirent *entry;
 
@@ -220,11 +283,11 @@ bool build_file_list(std::vector<std::string> &list, std::string &target) {
   std::sort(list.begin(), list.end());
 
   // optionally offset into the directory listing
-  if(ENTRY_OFFSET > list.size())
+  if(entry_offset > list.size())
     { ERROR("entry_offset too large"); return false; }
-  while(ENTRY_OFFSET) {
+  while(entry_offset) {
     list.erase(list.begin());
-    ENTRY_OFFSET-=1;
+    entry_offset-=1;
   }
   
   return true;
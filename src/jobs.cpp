@@ -0,0 +1,609 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "util.h"
+
+extern char **environ;
+
+// how often the reaper wakes up to check on its children
+#define REAP_INTERVAL_MS 200
+
+// where children write their -progress stream
+#define PROGRESS_FD 3
+
+// how often a parallel batch prints where it's up to
+#define PROGRESS_REPORT_SECONDS 10
+
+// how often the status view is redrawn, however often ffmpeg reports
+#define DASHBOARD_REFRESH_MS 1000
+
+bool make_job(const job_context &ctx, const std::string &input,
+              const std::string &output, const ffmpeg_opts &opts, ff_job &job) {
+  job.input = input;
+  job.output = output;
+  job.log_path = output + ".log";
+
+  if (!build_ffmpeg_args(input, output, opts, job.args)) {
+    return false;
+  }
+
+  // --max-retries has always meant the total number of attempts
+  job.max_attempts = ctx.max_retries ? ctx.max_retries : 1;
+  job.ignore_pawe = ctx.ignore_pawe;
+  return true;
+}
+
+// move fd somewhere above the child's progress fd, close-on-exec, so the
+// dup2() onto PROGRESS_FD can't clobber it and no other child inherits it
+static int lift_fd(int fd) {
+  int lifted = fcntl(fd, F_DUPFD_CLOEXEC, PROGRESS_FD + 1);
+  close(fd);
+  return lifted;
+}
+
+// spawn a single ffmpeg child for this job. when forwarding, the child's
+// stdout/stderr come back to us through a pipe so we can echo them to the
+// terminal; otherwise they go straight into the job's log file.
+static bool spawn_job(const job_context &ctx, ff_job &job, bool forward,
+                      const cpu_slice *slice) {
+  auto begun = std::chrono::steady_clock::now();
+  int pipefd[2] = {-1, -1};
+  int progfd[2] = {-1, -1};
+
+  if (pipe(progfd) == -1 || (progfd[0] = lift_fd(progfd[0])) == -1 ||
+      (progfd[1] = lift_fd(progfd[1])) == -1) {
+    ERROR("progress pipe creation failed: %s", strerror(errno));
+    return false;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+
+  if (forward) {
+    if (pipe(pipefd) == -1) {
+      ERROR("pipe creation failed");
+      posix_spawn_file_actions_destroy(&actions);
+      close(progfd[0]);
+      close(progfd[1]);
+      return false;
+    }
+    // Child:   dup pipefd[1] → stdout/stderr, then close both pipe ends
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDERR_FILENO);
+    posix_spawn_file_actions_addclose(&actions, pipefd[0]);
+    posix_spawn_file_actions_addclose(&actions, pipefd[1]);
+  } else {
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO,
+                                     job.log_path.c_str(),
+                                     O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    posix_spawn_file_actions_adddup2(&actions, STDERR_FILENO, STDOUT_FILENO);
+  }
+
+  // last, since the output pipe may well have been given fd 3 and is
+  // closed in the child above
+  posix_spawn_file_actions_adddup2(&actions, progfd[1], PROGRESS_FD);
+
+  std::vector<std::string> args = {"-progress",
+                                   "pipe:" + std::to_string(PROGRESS_FD)};
+  args.insert(args.end(), job.args.begin(), job.args.end());
+  if (slice) {
+    apply_cpu_slice(args, *slice);
+  }
+
+  std::vector<char *> c_args;
+  c_args.push_back(const_cast<char *>(ctx.program.c_str()));
+  for (auto &arg : args) {
+    c_args.push_back(const_cast<char *>(arg.c_str()));
+  }
+  c_args.push_back(nullptr);
+
+#ifdef DEBUG
+  std::string cmdline;
+  for (size_t i = 0; i < c_args.size() - 1; i++) {
+    cmdline += std::string(c_args[i]) + " ";
+  }
+  log_line(cmdline);
+#endif // DEBUG
+
+  bool pinned = slice && pin_spawning_thread(*slice);
+
+  pid_t pid;
+  int rc = posix_spawn(&pid, ctx.program.c_str(), &actions, nullptr,
+                       c_args.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  job.usage.spawn += std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - begun)
+                         .count();
+
+  if (pinned) {
+    unpin_spawning_thread();
+  }
+
+  if (forward) {
+    close(pipefd[1]);
+  }
+  close(progfd[1]);
+
+  if (rc != 0) {
+    ERROR("posix_spawn failed: %s", strerror(rc));
+    if (forward) {
+      close(pipefd[0]);
+    }
+    close(progfd[0]);
+    return false;
+  }
+
+  // the log file we keep ourselves when the child's output comes to us
+  if (forward) {
+    job.log_file = open(job.log_path.c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (job.log_file == -1) {
+      WARNING("Can't write %s: %s", job.log_path.c_str(), strerror(errno));
+    }
+  }
+
+  job.pid = pid;
+  job.log_fd = forward ? pipefd[0] : -1;
+  job.progress_fd = progfd[0];
+  job.progress_buf.clear();
+  job.progress = job_progress();
+  job.started = std::chrono::steady_clock::now();
+  job.state = JobState::Running;
+  job.attempts++;
+
+  if (!forward) {
+    INFO("Started %s (pid %d, attempt %lu/%lu)", job.output.c_str(), pid,
+         job.attempts, job.max_attempts);
+  }
+  return true;
+}
+
+// pass whatever the child has written so far on to the terminal and its
+// log file. returns false once the child has closed its end of the pipe.
+static bool pump_job_log(ff_job &job) {
+  if (capture_child_output(job.log_fd, job.log_file)) {
+    return true;
+  }
+  close(job.log_fd);
+  job.log_fd = -1;
+  if (job.log_file != -1) {
+    close(job.log_file);
+    job.log_file = -1;
+  }
+  return false;
+}
+
+static void wait_for_activity(std::vector<ff_job> &jobs) {
+  std::vector<pollfd> fds;
+  std::vector<size_t> owners;
+
+  for (size_t i = 0; i < jobs.size(); i++) {
+    if (jobs[i].state != JobState::Running) {
+      continue;
+    }
+    if (jobs[i].log_fd != -1) {
+      pollfd p = {jobs[i].log_fd, POLLIN, 0};
+      fds.push_back(p);
+      owners.push_back(i);
+    }
+    if (jobs[i].progress_fd != -1) {
+      pollfd p = {jobs[i].progress_fd, POLLIN, 0};
+      fds.push_back(p);
+      owners.push_back(i);
+    }
+  }
+
+  if (poll(fds.data(), fds.size(), REAP_INTERVAL_MS) <= 0) {
+    return;
+  }
+
+  for (size_t i = 0; i < fds.size(); i++) {
+    if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+      continue;
+    }
+    ff_job &job = jobs[owners[i]];
+    if (fds[i].fd == job.log_fd) {
+      pump_job_log(job);
+    } else {
+      pump_progress(job);
+    }
+  }
+}
+
+// decide what a finished child means for its job. returns true if the job
+// has reached a final state, false if it should be attempted again.
+static bool finish_job(const job_context &ctx, ff_job &job, int status) {
+  // drain anything still sitting in the pipes
+  while (job.log_fd != -1 && pump_job_log(job)) {
+  }
+  while (job.progress_fd != -1 && pump_progress(job)) {
+  }
+
+  job.pid = -1;
+
+  if (WIFEXITED(status)) {
+    job.exit_code = WEXITSTATUS(status);
+    if (job.exit_code == 0 ||
+        (job.exit_code == 176 && (ctx.ignore_pawe || job.ignore_pawe))) {
+      INFO("ffmpeg exited with code %d for %s", job.exit_code,
+           job.output.c_str());
+      job.state = JobState::Done;
+      return true;
+    }
+    ERROR("ffmpeg returned %d for %s", job.exit_code, job.output.c_str());
+  } else if (WIFSIGNALED(status)) {
+    ERROR("ffmpeg killed by signal %d for %s", WTERMSIG(status),
+          job.output.c_str());
+  } else {
+    WARNING("ffmpeg terminated abnormally for %s", job.output.c_str());
+  }
+
+  if (job.attempts < job.max_attempts) {
+    WARNING("Retrying %s (%lu of %lu attempts used)", job.output.c_str(),
+            job.attempts, job.max_attempts);
+    job.state = JobState::Pending;
+    return false;
+  }
+
+  ERROR("max retries reached for %s", job.output.c_str());
+  job.state = JobState::Failed;
+  return true;
+}
+
+// hand jobs that are over (and delivered) to the feed and drop them, so a
+// queue that never ends doesn't grow forever. everything before next has
+// been started, so next moves back by however many of those went.
+static void retire_jobs(const job_context &ctx, std::vector<ff_job> &jobs,
+                        size_t &next, job_feed &feed) {
+  size_t kept = 0;
+  size_t before_next = 0;
+
+  for (size_t i = 0; i < jobs.size(); i++) {
+    if (jobs[i].state == JobState::Running ||
+        jobs[i].state == JobState::Pending ||
+        (ctx.outputs && ctx.outputs->pending(jobs[i].output))) {
+      if (kept != i) {
+        jobs[kept] = std::move(jobs[i]);
+      }
+      kept++;
+      continue;
+    }
+
+    feed.finished(jobs[i]);
+    if (ctx.report) {
+      ctx.report->record(jobs[i]);
+    }
+    if (i < next) {
+      before_next++;
+    }
+  }
+
+  if (kept == jobs.size()) {
+    return;
+  }
+  jobs.resize(kept);
+  next -= before_next;
+  if (ctx.report) {
+    ctx.report->write();
+  }
+}
+
+// point a job's arguments at a local stand in for its source or output.
+// burned in ASS subs are read by the subtitles filter straight from the
+// source, so that path is swapped inside the filter graph too.
+static void swap_path(ff_job &job, const std::string &from,
+                      const std::string &to) {
+  std::string in_filter = "subtitles=" + escape(from) + ":";
+  for (auto &arg : job.args) {
+    if (arg == from) {
+      arg = to;
+      continue;
+    }
+    size_t at = arg.find(in_filter);
+    if (at != std::string::npos) {
+      arg.replace(at, in_filter.size(), "subtitles=" + escape(to) + ":");
+    }
+  }
+}
+
+// run every job in the list with at most max_parallel ffmpeg children alive
+// at once. a failed job stops new ones from being started, but anything
+// already in flight is allowed to finish. if probes are given (indexed like
+// jobs), a job whose source fails its checks is skipped instead of started.
+// with a feed, the list is topped up from it as it goes, failures don't
+// stop anything, and run_jobs only returns once the feed has run dry.
+// with a stager (also indexed like jobs), sources that have been copied to
+// local scratch in time are read from there.
+bool run_jobs(const job_context &ctx, std::vector<ff_job> &jobs,
+              size_t max_parallel, probe_ahead *probes, job_feed *feed,
+              input_stager *stager) {
+  if (max_parallel == 0) {
+    max_parallel = 1;
+  }
+
+  // nothing asks questions while jobs run, so logging can go async
+  log_session logging;
+
+  // only one child can sensibly own the terminal. otherwise the children
+  // only write to their log files, and if we're on a terminal it gets a
+  // status view drawn from their progress instead. in the background, the
+  // terminal, the environment and the cores all belong to the run_jobs
+  // that's in front, so none of them are touched.
+  bool forward = max_parallel == 1 && !ctx.dashboard && !ctx.background;
+  bool dashboard = !forward && !ctx.background && isatty(STDOUT_FILENO);
+
+  if (ctx.background) {
+    DEBUG_INFO("Running up to %lu ffmpeg jobs in the background",
+               max_parallel);
+  } else if (forward) {
+    // Force colour in the child’s log output
+    if (setenv("AV_LOG_FORCE_COLOR", "1", 1) != 0) {
+      ERROR("setenv failed");
+      return false;
+    }
+    INFO("ffmpeg logs:");
+  } else {
+    unsetenv("AV_LOG_FORCE_COLOR");
+    INFO("Running up to %lu ffmpeg jobs at once, logs are written next to "
+         "each output",
+         max_parallel);
+  }
+
+  // give each worker slot its own share of cores and cache
+  std::vector<cpu_slice> slices;
+  cpu_topology topo;
+  if (max_parallel > 1 && !ctx.background && read_cpu_topology(topo) &&
+      partition_cpus(topo, max_parallel, slices)) {
+    INFO("Splitting %lu cores (%lu L3 domains, %lu sockets) between %lu "
+         "jobs",
+         topo.cores, topo.l3_domains, topo.sockets, max_parallel);
+  }
+
+  std::vector<bool> slot_busy(max_parallel, false);
+  size_t next = 0;
+  size_t running = 0;
+  bool failed = false;
+  bool skipped = false;
+  time_t last_report = time(nullptr);
+  time_t last_write = last_report;
+  std::chrono::steady_clock::time_point last_draw; // draw straight away
+
+  for (;;) {
+    if (feed) {
+      retire_jobs(ctx, jobs, next, *feed);
+      size_t busy = running + jobs.size() - next;
+      feed->refill(jobs, busy < max_parallel ? max_parallel - busy : 0);
+    }
+
+    while ((!failed || feed) && running < max_parallel &&
+           next < jobs.size() &&
+           !(ctx.outputs && ctx.outputs->backlogged())) {
+      if (probes) {
+        const probe_summary &probe = probes->get(next);
+        if (jobs[next].duration == 0) {
+          jobs[next].duration = probe.duration;
+        }
+        if (!probe.problem.empty()) {
+          ERROR("Skipping %s: %s", jobs[next].input.c_str(),
+                probe.problem.c_str());
+          jobs[next].state = JobState::Skipped;
+          skipped = true;
+          if (stager) {
+            stager->release(next);
+          }
+          next++;
+          continue;
+        }
+      }
+
+      if (stager) {
+        std::string staged = stager->take(next);
+        if (!staged.empty()) {
+          swap_path(jobs[next], jobs[next].input, staged);
+        }
+      }
+
+      // an encode seldom comes out bigger than its source
+      if (ctx.outputs && !jobs[next].unstaged) {
+        std::string local = ctx.outputs->local_path(
+            jobs[next].output, file_size(jobs[next].input));
+        swap_path(jobs[next], jobs[next].output, local);
+        // the log is written beside it on scratch too, and delivered with it
+        if (local != jobs[next].output) {
+          jobs[next].log_path = local + ".log";
+        }
+      }
+
+      size_t slot = std::find(slot_busy.begin(), slot_busy.end(), false) -
+                    slot_busy.begin();
+      jobs[next].slot = slot;
+      if (!spawn_job(ctx, jobs[next], forward,
+                     slices.empty() ? nullptr : &slices[slot])) {
+        jobs[next].state = JobState::Failed;
+        failed = true;
+        if (ctx.outputs) {
+          ctx.outputs->deliver(jobs[next].output, false);
+        }
+        next++;
+        break;
+      }
+      slot_busy[slot] = true;
+      running++;
+      next++;
+
+      // start looking at what comes after the jobs now in flight
+      if (probes) {
+        probes->advance(next);
+      }
+      if (stager) {
+        stager->advance(next);
+      }
+    }
+
+    if (running == 0) {
+      // everything's waiting on the transfers
+      if (ctx.outputs && ctx.outputs->backlogged() &&
+          ((!failed && next < jobs.size()) || feed)) {
+        ctx.outputs->wait_for_room();
+        continue;
+      }
+      if (feed && feed->idle()) {
+        continue;
+      }
+      break;
+    }
+
+    wait_for_activity(jobs);
+
+    // whatever has been probed since gives the ETA more to go on
+    if (probes) {
+      for (size_t i = next; i < jobs.size(); i++) {
+        if (jobs[i].duration == 0) {
+          jobs[i].duration = probes->duration(i);
+        }
+      }
+    }
+
+    bool finished_one = false;
+
+    for (auto &job : jobs) {
+      if (job.state != JobState::Running) {
+        continue;
+      }
+
+      // wait4 rather than waitpid, so we find out what the child cost
+      int status;
+      struct rusage ru;
+      pid_t r = wait4(job.pid, &status, WNOHANG, &ru);
+      if (r == 0 || (r == -1 && errno == EINTR)) {
+        continue;
+      }
+      if (r == -1) {
+        ERROR("waitpid failed for %s: %s", job.output.c_str(),
+              strerror(errno));
+        job.state = JobState::Failed;
+        slot_busy[job.slot] = false;
+        running--;
+        failed = true;
+        if (stager) {
+          stager->release(&job - jobs.data());
+        }
+        if (ctx.outputs) {
+          ctx.outputs->deliver(job.output, false);
+        }
+        continue;
+      }
+
+      add_rusage(job.usage, ru);
+      job.usage.wall += std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - job.started)
+                            .count();
+
+      if (!finish_job(ctx, job, status)) {
+        // retry in the same slot, without waiting for the queue
+        if (spawn_job(ctx, job, forward,
+                      slices.empty() ? nullptr : &slices[job.slot])) {
+          continue;
+        }
+        job.state = JobState::Failed;
+      }
+
+      slot_busy[job.slot] = false;
+      running--;
+      finished_one = true;
+      if (stager) {
+        stager->release(&job - jobs.data());
+      }
+      if (ctx.outputs) {
+        ctx.outputs->deliver(job.output, job.state == JobState::Done);
+      }
+      if (job.state == JobState::Failed) {
+        failed = true;
+      }
+    }
+
+    if (dashboard) {
+      auto t = std::chrono::steady_clock::now();
+      if (finished_one || t - last_draw >= std::chrono::milliseconds(
+                                               DASHBOARD_REFRESH_MS)) {
+        draw_dashboard(ctx, jobs);
+        last_draw = t;
+      }
+      continue;
+    }
+
+    if (ctx.background) {
+      continue;
+    }
+
+    // ffmpeg draws its own stats line when it owns the terminal, so then
+    // we only chime in between jobs
+    time_t now = time(nullptr);
+    if ((finished_one && jobs.size() > 1) ||
+        (!forward && now - last_report >= PROGRESS_REPORT_SECONDS)) {
+      report_progress(ctx, jobs, !forward && !finished_one);
+      last_report = last_write = now;
+    } else if (!ctx.progress_path.empty() && now != last_write) {
+      // keep the file fresh between terminal reports
+      batch_progress batch;
+      summarise_batch(jobs, batch);
+      write_progress_file(ctx.progress_path, jobs, batch);
+      last_write = now;
+    }
+  }
+
+  // the last outputs may still be on their way
+  if (ctx.outputs && !ctx.outputs->wait_all()) {
+    failed = true;
+  }
+  if (feed) {
+    retire_jobs(ctx, jobs, next, *feed);
+  }
+
+  if (dashboard) {
+    // the view goes, and one line saying how it ended takes its place
+    log_set_footer("");
+    report_progress(ctx, jobs, false);
+  } else if (!ctx.progress_path.empty()) {
+    batch_progress batch;
+    summarise_batch(jobs, batch);
+    write_progress_file(ctx.progress_path, jobs, batch);
+  }
+
+  if (ctx.report) {
+    for (auto &job : jobs) {
+      if (job.state != JobState::Pending) {
+        ctx.report->record(job);
+      }
+    }
+    ctx.report->write();
+  }
+
+  return !failed && !skipped;
+}
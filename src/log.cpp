@@ -0,0 +1,443 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util.h"
+
+// while jobs are running, INFO/WARNING/ERROR don't write to the terminal
+// themselves. each message is formatted straight into a slot of a bounded
+// lock-free queue (Vyukov's, so probe threads can log too) and a writer
+// thread drains whatever has piled up with a single write(). outside of a
+// log session, e.g. while the questions are being asked, messages go out
+// synchronously like they always did, so they can't land after a prompt.
+//
+// the writer can also keep a footer (the job dashboard) pinned below
+// everything else: each time it writes, it wipes the footer, writes the new
+// messages and draws the footer again underneath, all in the same write().
+//
+// a message that doesn't fit its slot is carried whole in a string hung off
+// the slot instead, so long command lines aren't cut (and don't lose the
+// colour reset at their end). a forwarded child's output and the writer take
+// turns on stdout, and a message never starts part way through a line the
+// child hasn't finished.
+
+#define LOG_SLOTS 1024
+#define LOG_SLOT_SIZE 512
+#define LOG_BATCH_SIZE (64 * 1024)
+#define LOG_IDLE_MS 50
+
+// most a single capture_child_output() call moves, and the bounce buffer
+// for when the kernel won't splice
+#define CAPTURE_CHUNK (64 * 1024)
+#define COPY_BUFFER_SIZE 8192
+
+namespace {
+
+struct log_slot {
+  std::atomic<size_t> seq;
+  size_t len;
+  std::string *overflow; // the whole message, if text couldn't hold it
+  char text[LOG_SLOT_SIZE];
+};
+
+class log_ring {
+public:
+  log_ring() : head(0), tail(0) {
+    for (size_t i = 0; i < LOG_SLOTS; i++) {
+      slots[i].seq.store(i, std::memory_order_relaxed);
+      slots[i].overflow = nullptr;
+    }
+  }
+
+  // claim the next slot for writing, spinning (politely) while the writer
+  // catches up. a full ring means the terminal is the bottleneck anyway.
+  log_slot *claim() {
+    size_t pos = head.load(std::memory_order_relaxed);
+    for (;;) {
+      log_slot &slot = slots[pos % LOG_SLOTS];
+      size_t seq = slot.seq.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (head.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed)) {
+          return &slot;
+        }
+      } else if (diff < 0) {
+        std::this_thread::yield();
+        pos = head.load(std::memory_order_relaxed);
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void publish(log_slot *slot) {
+    size_t pos = slot->seq.load(std::memory_order_relaxed);
+    slot->seq.store(pos + 1, std::memory_order_release);
+  }
+
+  // the writer is the only consumer
+  log_slot *peek() {
+    log_slot &slot = slots[tail % LOG_SLOTS];
+    size_t seq = slot.seq.load(std::memory_order_acquire);
+    return seq == tail + 1 ? &slot : nullptr;
+  }
+
+  void release(log_slot *slot) {
+    slot->seq.store(tail + LOG_SLOTS, std::memory_order_release);
+    tail++;
+    drained.store(tail, std::memory_order_release);
+  }
+
+  size_t claimed() const { return head.load(std::memory_order_acquire); }
+
+  std::atomic<size_t> drained{0};
+
+private:
+  log_slot slots[LOG_SLOTS];
+  std::atomic<size_t> head;
+  size_t tail;
+};
+
+log_ring ring;
+std::atomic<bool> running(false);
+std::atomic<bool> stopping(false);
+// callers between seeing `running` and publishing their slot
+std::atomic<size_t> producers(0);
+std::thread writer;
+std::mutex wake_m;
+std::condition_variable wake;
+
+// the footer as last handed to us, and whether the writer has drawn it yet
+std::mutex footer_m;
+std::string footer;
+bool footer_changed = false;
+
+// whoever is writing to stdout, and whether a child's output last stopped
+// part way through a line
+std::mutex stdout_m;
+bool child_mid_line = false;
+
+void write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+void writer_loop() {
+  std::vector<char> batch;
+  batch.reserve(LOG_BATCH_SIZE);
+
+  // what's on screen below the last message
+  std::string shown;
+  size_t shown_rows = 0;
+
+  for (;;) {
+    bool redraw;
+    {
+      std::lock_guard<std::mutex> lock(footer_m);
+      redraw = footer_changed;
+      if (redraw) {
+        shown = footer;
+        footer_changed = false;
+      }
+    }
+
+    // the cursor sits at the start of the line under the footer, so go up
+    // over it and clear to the end of the screen
+    if (shown_rows && (redraw || ring.peek())) {
+      char erase[32];
+      int n = snprintf(erase, sizeof(erase), "\r\033[%luA\033[J", shown_rows);
+      batch.insert(batch.end(), erase, erase + n);
+      shown_rows = 0;
+      redraw = true;
+    }
+
+    log_slot *slot;
+    while ((slot = ring.peek()) != nullptr &&
+           (batch.empty() || batch.size() + slot->len <= LOG_BATCH_SIZE)) {
+      if (slot->overflow) {
+        batch.insert(batch.end(), slot->overflow->begin(),
+                     slot->overflow->end());
+        delete slot->overflow;
+        slot->overflow = nullptr;
+      } else {
+        batch.insert(batch.end(), slot->text, slot->text + slot->len);
+      }
+      ring.release(slot);
+    }
+
+    if (redraw) {
+      batch.insert(batch.end(), shown.begin(), shown.end());
+      shown_rows = std::count(shown.begin(), shown.end(), '\n');
+    }
+
+    if (!batch.empty()) {
+      std::lock_guard<std::mutex> lock(stdout_m);
+      if (child_mid_line) {
+        write_all(STDOUT_FILENO, "\n", 1);
+        child_mid_line = false;
+      }
+      write_all(STDOUT_FILENO, batch.data(), batch.size());
+      batch.clear();
+      continue;
+    }
+
+    if (stopping.load(std::memory_order_acquire) &&
+        ring.drained.load() == ring.claimed()) {
+      return;
+    }
+
+    std::unique_lock<std::mutex> lock(wake_m);
+    wake.wait_for(lock, std::chrono::milliseconds(LOG_IDLE_MS));
+  }
+}
+
+} // namespace
+
+static void log_vprintf(const char *fmt, va_list args) {
+  // log_stop() waits for everyone who got past this check, so nothing is
+  // left in the ring once the writer has gone
+  producers.fetch_add(1);
+  if (!running.load()) {
+    producers.fetch_sub(1);
+    // the writer may still be finishing off what's in the ring
+    std::lock_guard<std::mutex> lock(stdout_m);
+    std::vprintf(fmt, args);
+    std::fflush(stdout);
+    return;
+  }
+
+  va_list again;
+  va_copy(again, args);
+
+  log_slot *slot = ring.claim();
+  slot->overflow = nullptr;
+  int n = vsnprintf(slot->text, LOG_SLOT_SIZE, fmt, args);
+  if (n < 0) {
+    n = 0;
+  }
+  if (static_cast<size_t>(n) >= LOG_SLOT_SIZE) {
+    std::vector<char> whole(n + 1);
+    vsnprintf(whole.data(), whole.size(), fmt, again);
+    slot->overflow = new std::string(whole.data(), n);
+  }
+  va_end(again);
+
+  slot->len = n;
+  ring.publish(slot);
+  producers.fetch_sub(1);
+  wake.notify_one();
+}
+
+void log_printf(const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  log_vprintf(fmt, args);
+  va_end(args);
+}
+
+void log_line(const std::string &line) { log_printf("%s\n", line.c_str()); }
+
+bool log_start() {
+  if (running.load()) {
+    return false;
+  }
+
+  // anything still buffered by stdio has to go out before the writer's
+  std::fflush(stdout);
+  std::cout.flush();
+
+  // an exit() mid session (say a job spec that can't answer a question)
+  // still gets its last words out, rather than tripping over the thread
+  static bool hooked = false;
+  if (!hooked) {
+    atexit(log_stop);
+    hooked = true;
+  }
+
+  stopping.store(false);
+  writer = std::thread(writer_loop);
+  running.store(true, std::memory_order_release);
+  return true;
+}
+
+void log_stop() {
+  if (!running.load()) {
+    return;
+  }
+
+  running.store(false);
+  while (producers.load() != 0) {
+    std::this_thread::yield();
+  }
+  stopping.store(true, std::memory_order_release);
+  wake.notify_one();
+  writer.join();
+
+  // whatever footer was last drawn stays on screen as it is
+  std::lock_guard<std::mutex> lock(footer_m);
+  footer.clear();
+  footer_changed = false;
+}
+
+// replace the footer, which should be whole lines that fit the terminal
+// (anything that wraps would throw off the redraw). an empty string takes
+// it away. it's only drawn while the writer is running.
+void log_set_footer(const std::string &text) {
+  if (!running.load(std::memory_order_acquire)) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(footer_m);
+    footer = text;
+    footer_changed = true;
+  }
+  wake.notify_one();
+}
+
+// move n bytes that are already sitting in the pipe `from` into `to`,
+// without them passing through userspace where the kernel allows it. ttys
+// and some filesystems can't be spliced to, in which case we fall back to
+// copying for good.
+static void drain_pipe(int from, int to, size_t n, bool &can_splice) {
+  char buf[COPY_BUFFER_SIZE];
+
+  while (n > 0) {
+#ifdef __linux__
+    if (can_splice) {
+      ssize_t m = splice(from, nullptr, to, nullptr, n, SPLICE_F_MOVE);
+      if (m > 0) {
+        n -= m;
+        continue;
+      }
+      if (m < 0 && errno == EINTR) {
+        continue;
+      }
+      can_splice = false;
+    }
+#endif
+    ssize_t m = read(from, buf, n < sizeof(buf) ? n : sizeof(buf));
+    if (m < 0 && errno == EINTR) {
+      continue;
+    }
+    if (m <= 0) {
+      return;
+    }
+    write_all(to, buf, m);
+    n -= m;
+  }
+}
+
+// a forwarded child's output, written to the terminal in turn with the
+// log writer
+static void write_child_output(const char *buf, size_t n) {
+  std::lock_guard<std::mutex> lock(stdout_m);
+  write_all(STDOUT_FILENO, buf, n);
+  child_mid_line = buf[n - 1] != '\n';
+}
+
+// forward what a child has written to its output pipe to both our stdout
+// and its log file. tee() duplicates the data into a scratch pipe without
+// consuming it, then the original is spliced into the log file and the
+// copy is read back for the terminal. returns false once the child has
+// closed its end.
+bool capture_child_output(int from, int log_file) {
+#ifdef __linux__
+  static int scratch[2] = {-1, -1};
+  static bool can_tee = true;
+  static bool file_splice = true;
+
+  if (can_tee && scratch[0] == -1 && pipe2(scratch, O_CLOEXEC) == -1) {
+    can_tee = false;
+  }
+
+  while (can_tee && log_file != -1) {
+    ssize_t n = tee(from, scratch[1], CAPTURE_CHUNK, SPLICE_F_NONBLOCK);
+    if (n > 0) {
+      drain_pipe(from, log_file, n, file_splice);
+      char buf[COPY_BUFFER_SIZE];
+      while (n > 0) {
+        size_t want = std::min(static_cast<size_t>(n), sizeof(buf));
+        ssize_t m = read(scratch[0], buf, want);
+        if (m < 0 && errno == EINTR) {
+          continue;
+        }
+        if (m <= 0) {
+          break;
+        }
+        write_child_output(buf, m);
+        n -= m;
+      }
+      return true;
+    }
+    if (n == 0) {
+      return false;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EAGAIN) {
+      return true;
+    }
+    DEBUG_INFO("tee() failed (%s), copying child output instead",
+               strerror(errno));
+    can_tee = false;
+  }
+#endif
+
+  char buf[COPY_BUFFER_SIZE];
+  ssize_t n = read(from, buf, sizeof(buf));
+  if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+    return true;
+  }
+  if (n <= 0) {
+    return false;
+  }
+  if (log_file != -1) {
+    write_all(log_file, buf, n);
+  }
+  write_child_output(buf, n);
+  return true;
+}
+
+void log_flush() {
+  while (running.load() && ring.drained.load() != ring.claimed()) {
+    wake.notify_one();
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
@@ -0,0 +1,360 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <unistd.h>
+
+#include "util.h"
+
+// the preset benchmark encodes the same synthetic clips with every x265
+// option set, encoder preset and CRF asked for, and keeps what each one
+// cost in a results file. print_preset_options() shows those numbers next
+// to the CRF ranges, so picking a preset isn't a guess about speed.
+//
+// the clips are lavfi's testsrc2 (moving shapes, a scrolling gradient and
+// a clock) with seeded temporal grain on top, so every run gets the same
+// frames. they're made once, near lossless, and kept with the results.
+//
+// results are tab separated, one encode per line:
+//
+//   height seconds crf preset fps cpu_per_min bytes x265_params
+//
+// a combination that's already in the file isn't encoded again, so a long
+// matrix can be stopped and picked up later.
+#define PRESET_RESULTS_VERSION "animachine-preset-bench 1"
+
+std::string default_preset_results() {
+  std::string dir = default_cache_dir();
+  return dir.empty() ? "" : dir + "/preset-bench";
+}
+
+bool load_preset_results(const std::string &path,
+                         std::vector<preset_result> &out) {
+  out.clear();
+
+  std::ifstream in(path);
+  if (!in) {
+    return false;
+  }
+
+  std::string line;
+  if (!std::getline(in, line) || line != PRESET_RESULTS_VERSION) {
+    WARNING("Ignoring preset results \"%s\" from another version",
+            path.c_str());
+    return false;
+  }
+
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    preset_result r;
+    if (fields >> r.height >> r.seconds >> r.crf >> r.preset >> r.fps >>
+        r.cpu_per_min >> r.bytes) {
+      fields.ignore(1);
+      std::getline(fields, r.params);
+      out.push_back(r);
+    }
+  }
+  return true;
+}
+
+static bool have_result(const std::vector<preset_result> &results,
+                        const preset_result &want) {
+  for (auto &r : results) {
+    if (r.height == want.height && r.seconds == want.seconds &&
+        r.crf == want.crf && r.preset == want.preset &&
+        r.params == want.params) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// results another run has saved since ours were loaded are kept, and end
+// up in ours too so they aren't encoded again
+bool save_preset_results(const std::string &path,
+                         std::vector<preset_result> &results) {
+  file_lock held(path);
+  if (!held.held()) {
+    return false;
+  }
+
+  std::vector<preset_result> on_disk;
+  load_preset_results(path, on_disk);
+  for (auto &r : on_disk) {
+    if (!have_result(results, r)) {
+      results.push_back(r);
+    }
+  }
+
+  bool ok = replace_file(path, [&](std::ostream &out) {
+    out << PRESET_RESULTS_VERSION << '\n' << std::fixed;
+    for (auto &r : results) {
+      out << r.height << '\t' << r.seconds << '\t' << r.crf << '\t'
+          << r.preset << '\t' << std::setprecision(3) << r.fps << '\t'
+          << r.cpu_per_min << '\t' << r.bytes << '\t' << r.params << '\n';
+    }
+    return static_cast<bool>(out);
+  });
+
+  if (!ok) {
+    ERROR("Failed to save preset results \"%s\"", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// run one job in the foreground without ffmpeg taking over the terminal
+static bool run_quietly(const job_context &ctx, ff_job &job) {
+  std::vector<ff_job> jobs(1, job);
+  job_context local(ctx);
+  local.outputs.reset();
+  bool ok = run_jobs(local, jobs, 1);
+  job = jobs[0];
+  return ok;
+}
+
+static bool make_clip(const job_context &ctx, size_t height,
+                      size_t seconds, const std::string &path) {
+  if (file_exists(path)) {
+    return true;
+  }
+
+  std::string size = std::to_string(height * 16 / 9) + "x" +
+                     std::to_string(height);
+  std::string duration = std::to_string(seconds);
+
+  ff_job job;
+  job.input = "testsrc2 " + size;
+  job.output = path + ".tmp.mkv";
+  job.log_path = path + ".log";
+  job.duration = seconds;
+  job.args = {"-y",
+              "-f",
+              "lavfi",
+              "-i",
+              "testsrc2=size=" + size + ":rate=24000/1001:duration=" +
+                  duration + ",noise=alls=12:allf=t+u:all_seed=1," +
+                  "format=yuv420p",
+              "-f",
+              "lavfi",
+              "-i",
+              "sine=frequency=440:sample_rate=48000:duration=" + duration,
+              "-c:v",
+              "libx264",
+              "-preset",
+              "ultrafast",
+              "-crf",
+              "8",
+              "-c:a",
+              "flac",
+              job.output};
+
+  INFO("Generating %lup test clip", height);
+  if (!run_quietly(ctx, job) || rename(job.output.c_str(), path.c_str())) {
+    ERROR("Failed to generate \"%s\", see %s", path.c_str(),
+          job.log_path.c_str());
+    unlink(job.output.c_str());
+    return false;
+  }
+  unlink(job.log_path.c_str());
+  return true;
+}
+
+bool run_preset_bench(const job_context &ctx, const preset_bench_opts &opts) {
+  if (opts.results.empty()) {
+    ERROR("Nowhere to keep preset results, set --bench-results");
+    return false;
+  }
+
+  size_t slash = opts.results.rfind('/');
+  std::string dir =
+      slash == std::string::npos ? "." : opts.results.substr(0, slash);
+  if (!make_directory(dir + "/clips")) {
+    return false;
+  }
+
+  job_context local(ctx);
+  if (!resolve_ffmpeg(local)) {
+    return false;
+  }
+  // one encode at a time, each has the whole machine to itself
+  local.dashboard = true;
+  local.crop = false;
+  local.max_retries = 0;
+  local.report.reset();
+  local.progress_path.clear();
+
+  std::vector<preset_result> results;
+  load_preset_results(opts.results, results);
+
+  const std::vector<std::string> &presets =
+      opts.enc_presets.empty() ? g_enc_presets : opts.enc_presets;
+  size_t total = opts.heights.size() * gpresets.size() * presets.size() *
+                 opts.crfs.size();
+  size_t count = 0;
+
+  for (size_t height : opts.heights) {
+    std::string clip = dir + "/clips/testsrc2-" + std::to_string(height) +
+                       "p-" + std::to_string(opts.seconds) + "s.mkv";
+    if (!make_clip(local, height, opts.seconds, clip)) {
+      return false;
+    }
+
+    for (size_t g = 0; g < gpresets.size(); g++) {
+      for (auto &preset : presets) {
+        for (size_t crf : opts.crfs) {
+          count++;
+
+          preset_result r;
+          r.height = height;
+          r.seconds = opts.seconds;
+          r.crf = crf;
+          r.preset = preset;
+          r.params = gpresets[g];
+          if (have_result(results, r)) {
+            continue;
+          }
+
+          ffmpeg_opts ff_opts = ffmpeg_opts();
+          ff_opts.audio.should_copy = true;
+          ff_opts.video.h265_opts = gpresets[g];
+          ff_opts.video.preset = preset;
+          ff_opts.video.crf = crf;
+
+          ff_job job;
+          std::string out = dir + "/clips/encode.mkv";
+          if (!make_job(local, clip, out, ff_opts, job)) {
+            return false;
+          }
+          job.duration = opts.seconds;
+
+          INFO("[%lu/%lu] %lup, option %lu, %s, crf %lu", count, total,
+               height, g + 1, preset.c_str(), crf);
+          if (!run_quietly(local, job)) {
+            ERROR("Encode failed, see %s", job.log_path.c_str());
+            return false;
+          }
+
+          size_t frames = job.progress.frame
+                              ? job.progress.frame
+                              : opts.seconds * 24000 / 1001;
+          r.fps = job.usage.wall > 0 ? frames / job.usage.wall : 0;
+          r.cpu_per_min =
+              (job.usage.user + job.usage.sys) * 60 / opts.seconds;
+          r.bytes = file_size(out);
+          unlink(out.c_str());
+          unlink(job.log_path.c_str());
+
+          INFO("%.2f fps, %.1f CPU-s per minute, %.2f Mb/s", r.fps,
+               r.cpu_per_min, r.bytes * 8 / 1e6 / opts.seconds);
+
+          // saved as we go, so an interrupted run loses one encode at most
+          results.push_back(r);
+          if (!save_preset_results(opts.results, results)) {
+            return false;
+          }
+        }
+      }
+    }
+  }
+
+  INFO("Preset results are in %s", opts.results.c_str());
+  return true;
+}
+
+// a table of what each x265 option set managed at the measured height
+// closest to the source's, averaged over every CRF tried. nothing is
+// printed if there are no results.
+void print_preset_results(const std::string &path, size_t height) {
+  std::vector<preset_result> results;
+  if (path.empty() || !load_preset_results(path, results) ||
+      results.empty()) {
+    return;
+  }
+
+  if (height == 0) {
+    height = 1080;
+  }
+  size_t nearest = results[0].height;
+  for (auto &r : results) {
+    long gap = static_cast<long>(r.height) - static_cast<long>(height);
+    long best = static_cast<long>(nearest) - static_cast<long>(height);
+    if (std::labs(gap) < std::labs(best)) {
+      nearest = r.height;
+    }
+  }
+
+  // only the encoder presets that were actually measured get a column
+  std::vector<std::string> presets;
+  for (auto &p : g_enc_presets) {
+    for (auto &r : results) {
+      if (r.height == nearest && r.preset == p) {
+        presets.push_back(p);
+        break;
+      }
+    }
+  }
+
+  std::ostringstream table;
+  table << std::fixed << std::setprecision(1);
+  table << "\033[1mMeasured fps at " << nearest
+        << "p, and the average cost of each option:\033[0m\n      ";
+  for (auto &p : presets) {
+    table << std::setw(10) << p;
+  }
+  table << "  CPU-s/min      Mb/s\n";
+
+  for (size_t g = 0; g < gpresets.size(); g++) {
+    double cpu = 0;
+    double mbps = 0;
+    size_t n = 0;
+    table << "    " << g + 1 << ".";
+
+    for (auto &p : presets) {
+      double fps = 0;
+      size_t cnt = 0;
+      for (auto &r : results) {
+        if (r.height != nearest || r.params != gpresets[g] || r.preset != p) {
+          continue;
+        }
+        fps += r.fps;
+        cpu += r.cpu_per_min;
+        mbps += r.bytes * 8 / 1e6 / r.seconds;
+        cnt++;
+        n++;
+      }
+      if (cnt) {
+        table << std::setw(10) << fps / cnt;
+      } else {
+        table << std::setw(10) << "-";
+      }
+    }
+
+    if (n) {
+      table << std::setw(11) << cpu / n << std::setw(10) << mbps / n;
+    }
+    table << "\n";
+  }
+
+  std::cout << table.str() << std::endl;
+}
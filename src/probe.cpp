@@ -0,0 +1,336 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <fcntl.h>
+#include <functional>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+// fast probe limits. MediaInfo is allowed to seek (matroska keeps its cues
+// and tags at the end), but it never gets more than FAST_PROBE_BUDGET bytes
+// in total, read FAST_PROBE_BLOCK at a time.
+#define FAST_PROBE_BLOCK (64 * 1024)
+#define FAST_PROBE_BUDGET (8 * 1024 * 1024)
+
+// feed MediaInfo from our own reads instead of letting it open the file, so
+// we decide how much of a 40GB remux on a network share actually gets read
+static bool open_bounded(job_context &ctx, const std::string &path,
+                         unsigned long long &bytes) {
+  bytes = 0;
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    ERROR("Failed to open \"%s\": %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ERROR("Failed to stat \"%s\": %s", path.c_str(), strerror(errno));
+    close(fd);
+    return false;
+  }
+  MediaInfo_int64u size = st.st_size;
+
+  ctx.mi.Option("ParseSpeed", "0");
+  ctx.mi.Open_Buffer_Init(size, 0);
+
+  std::vector<MediaInfo_int8u> buf(FAST_PROBE_BLOCK);
+  MediaInfo_int64u offset = 0;
+
+  while (bytes < FAST_PROBE_BUDGET && offset < size) {
+    ssize_t n = pread(fd, buf.data(), buf.size(), offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    bytes += n;
+
+    // bit 3 means MediaInfo has everything it wants
+    if (ctx.mi.Open_Buffer_Continue(buf.data(), n) & 0x08) {
+      break;
+    }
+
+    MediaInfo_int64u want = ctx.mi.Open_Buffer_Continue_GoTo_Get();
+    if (want != static_cast<MediaInfo_int64u>(-1)) {
+      offset = want;
+      ctx.mi.Open_Buffer_Init(size, offset);
+    } else {
+      offset += n;
+    }
+  }
+
+  close(fd);
+  ctx.mi.Open_Buffer_Finalize();
+  return true;
+}
+
+// open a file with this context's MediaInfo handle and fill in a record
+// for every stream in it
+bool probe_streams(job_context &ctx, const std::string &path, streams &inf) {
+  inf.clear();
+
+  file_key key;
+  bool cacheable = ctx.cache && stat_key(path, key);
+  if (cacheable && ctx.cache->lookup(key, inf, ctx.fast_probe)) {
+    DEBUG_INFO("Probe cache hit for %s", path.c_str());
+    return true;
+  }
+
+  auto started = std::chrono::steady_clock::now();
+  unsigned long long bytes = 0;
+
+  if (ctx.fast_probe) {
+    if (!open_bounded(ctx, path, bytes)) {
+      return false;
+    }
+  } else if (!ctx.mi.Open(path)) {
+    return false;
+  }
+
+  bool ok = get_streams(ctx, inf, false);
+  ctx.mi.Close();
+
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - started)
+                       .count();
+
+  if (ctx.fast_probe) {
+    INFO("Fast probe of %s read %llu KiB in %.3fs", path.c_str(),
+         bytes / 1024, elapsed);
+  } else {
+    DEBUG_INFO("Full probe of %s took %.3fs", path.c_str(), elapsed);
+  }
+
+  // a fast probe can miss fields a full parse would find, so its records
+  // are kept apart from full ones
+  if (ok && cacheable) {
+    ctx.cache->store(key, path, inf, ctx.fast_probe);
+  }
+  return ok;
+}
+
+// check a probed file against the options picked for the batch (which were
+// only ever checked against the first episode)
+void summarise_probe(const streams &inf, const ffmpeg_opts &opts,
+                     probe_summary &out) {
+  out.probed = true;
+  out.video_cnt = inf.video.size();
+  out.audio_cnt = inf.audio.size();
+  out.text_cnt = inf.text.size();
+
+  if (!inf.video.empty()) {
+    out.video_format = inf.video[0].format;
+    out.duration = inf.video[0].dr.duration;
+  }
+  for (auto &a : inf.audio) {
+    out.audio_formats.push_back(a.format);
+  }
+  for (auto &t : inf.text) {
+    out.text_formats.push_back(t.format);
+  }
+
+  if (out.video_cnt == 0) {
+    out.problem = "no video stream";
+  } else if (opts.audio.index >= out.audio_cnt) {
+    out.problem = "no audio stream " + std::to_string(opts.audio.index + 1) +
+                  " (file has " + std::to_string(out.audio_cnt) + ")";
+  } else if (opts.text.should_encode_subs) {
+    static const char *names[] = {"PGS", "ASS", "VobSub"};
+    const char *want = names[static_cast<int>(opts.text.codec)];
+
+    if (opts.text.index >= out.text_formats.size()) {
+      out.problem = "no text stream " + std::to_string(opts.text.index + 1) +
+                    " (file has " + std::to_string(out.text_cnt) + ")";
+    } else if (out.text_formats[opts.text.index] != want) {
+      out.problem = "text stream " + std::to_string(opts.text.index + 1) +
+                    " is " + out.text_formats[opts.text.index] + ", not " +
+                    want;
+    }
+  }
+}
+
+bool probe_file(job_context &ctx, const std::string &path,
+                const ffmpeg_opts &opts, probe_summary &out) {
+  out = probe_summary();
+  out.path = path;
+
+  streams inf;
+  if (!probe_streams(ctx, path, inf)) {
+    out.problem = "MediaInfo could not parse the file";
+    return false;
+  }
+
+  summarise_probe(inf, opts, out);
+  return out.problem.empty();
+}
+
+static void probe_worker(const job_context &ctx,
+                         const std::vector<std::string> &paths,
+                         std::atomic<size_t> &next,
+                         std::vector<file_probe> &out) {
+  job_context local(ctx);
+
+  for (size_t i = next++; i < paths.size(); i = next++) {
+    auto started = std::chrono::steady_clock::now();
+    out[i].path = paths[i];
+    out[i].ok = probe_streams(local, paths[i], out[i].inf);
+    out[i].seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - started)
+                         .count();
+    DEBUG_INFO("%s: %.3fs (%lu video, %lu audio, %lu text)", paths[i].c_str(),
+               out[i].seconds, out[i].inf.video.size(),
+               out[i].inf.audio.size(), out[i].inf.text.size());
+  }
+}
+
+// probe every file in paths with `threads` workers, each with a MediaInfo
+// handle of its own. out is indexed like paths. a file that can't be
+// parsed is reported and left with ok unset for the caller to skip; this
+// only fails if none of them could be.
+bool probe_library(const job_context &ctx,
+                   const std::vector<std::string> &paths, size_t threads,
+                   std::vector<file_probe> &out) {
+  std::vector<file_probe> results(paths.size());
+  out.swap(results);
+
+  if (threads == 0) {
+    threads = 1;
+  }
+  if (threads > paths.size()) {
+    threads = paths.size();
+  }
+
+  std::atomic<size_t> next(0);
+  auto started = std::chrono::steady_clock::now();
+
+  std::vector<std::thread> pool;
+  for (size_t t = 0; t < threads; t++) {
+    pool.push_back(std::thread(probe_worker, std::cref(ctx), std::cref(paths),
+                               std::ref(next), std::ref(out)));
+  }
+  for (auto &thread : pool) {
+    thread.join();
+  }
+
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - started)
+                       .count();
+  INFO("Probed %lu files in %.2fs with %lu threads", paths.size(), elapsed,
+       threads);
+
+  if (ctx.cache) {
+    ctx.cache->save();
+  }
+
+  size_t failed = 0;
+  for (auto &probe : out) {
+    if (!probe.ok) {
+      WARNING("Failed to probe %s, it will be skipped", probe.path.c_str());
+      failed++;
+    }
+  }
+  return failed < out.size() || out.empty();
+}
+
+probe_ahead::probe_ahead(const job_context &ctx, const ffmpeg_opts &opts,
+                         const std::vector<std::string> &paths, size_t depth)
+    : ctx(ctx), opts(opts), results(paths.size()),
+      ready(paths.size(), false), depth(depth ? depth : 1) {
+  for (size_t i = 0; i < paths.size(); i++) {
+    results[i].path = paths[i];
+  }
+  worker = std::thread(&probe_ahead::run, this);
+}
+
+probe_ahead::probe_ahead(const std::vector<probe_summary> &done)
+    : results(done), ready(done.size(), true), depth(1) {}
+
+probe_ahead::~probe_ahead() {
+  {
+    std::lock_guard<std::mutex> lock(m);
+    stop = true;
+  }
+  cv.notify_all();
+  if (worker.joinable()) {
+    worker.join();
+  }
+}
+
+void probe_ahead::advance(size_t index) {
+  {
+    std::lock_guard<std::mutex> lock(m);
+    if (index + depth > horizon) {
+      horizon = index + depth;
+    }
+  }
+  cv.notify_all();
+}
+
+const probe_summary &probe_ahead::get(size_t index) {
+  advance(index);
+
+  std::unique_lock<std::mutex> lock(m);
+  if (!ready[index]) {
+    DEBUG_INFO("Waiting on probe of %s", results[index].path.c_str());
+  }
+  cv.wait(lock, [&] { return ready[index]; });
+  return results[index];
+}
+
+size_t probe_ahead::duration(size_t index) {
+  std::lock_guard<std::mutex> lock(m);
+  return ready[index] ? results[index].duration : 0;
+}
+
+void probe_ahead::run() {
+  for (size_t i = 0; i < results.size(); i++) {
+    std::string path;
+    {
+      std::unique_lock<std::mutex> lock(m);
+      cv.wait(lock, [&] { return stop || i < horizon; });
+      if (stop) {
+        return;
+      }
+      path = results[i].path;
+    }
+
+    // the slow part happens without the lock held
+    probe_summary summary;
+    probe_file(ctx, path, opts, summary);
+    DEBUG_INFO("Probed %s: %lu video, %lu audio, %lu text, %lu seconds",
+               path.c_str(), summary.video_cnt, summary.audio_cnt,
+               summary.text_cnt, summary.duration);
+
+    {
+      std::lock_guard<std::mutex> lock(m);
+      results[i] = summary;
+      ready[i] = true;
+    }
+    cv.notify_all();
+  }
+}
@@ -0,0 +1,388 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "util.h"
+
+// every child gets `-progress pipe:3`, so ffmpeg writes blocks of key=value
+// lines to fd 3 about twice a second, each block ending in progress=continue
+// (or progress=end on the last one). that's much easier to follow than
+// scraping the stats line it draws on stderr.
+
+static void apply_progress_field(job_progress &p, const std::string &key,
+                                 const std::string &value) {
+  if (key == "frame") {
+    p.frame = strtoul(value.c_str(), nullptr, 10);
+  } else if (key == "fps") {
+    p.fps = strtod(value.c_str(), nullptr);
+  } else if (key == "speed") {
+    // "1.23x", or "N/A" before the first frame
+    p.speed = strtod(value.c_str(), nullptr);
+  } else if (key == "bitrate") {
+    p.bitrate = value;
+  } else if (key == "total_size") {
+    p.total_size = strtoull(value.c_str(), nullptr, 10);
+  } else if (key == "out_time_us" || key == "out_time_ms") {
+    // out_time_ms is also in microseconds, for historical reasons
+    long long us = strtoll(value.c_str(), nullptr, 10);
+    if (us > 0) {
+      p.out_time = us / 1e6;
+    }
+  } else if (key == "progress") {
+    p.updates++;
+    p.ended = value == "end";
+  }
+}
+
+bool pump_progress(ff_job &job) {
+  char buf[4096];
+  ssize_t n = read(job.progress_fd, buf, sizeof(buf));
+  if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+    return true;
+  }
+  if (n <= 0) {
+    close(job.progress_fd);
+    job.progress_fd = -1;
+    return false;
+  }
+
+  job.progress_buf.append(buf, n);
+
+  // only whole lines, the rest waits for the next read
+  size_t start = 0;
+  size_t nl;
+  while ((nl = job.progress_buf.find('\n', start)) != std::string::npos) {
+    size_t eq = job.progress_buf.find('=', start);
+    if (eq != std::string::npos && eq < nl) {
+      apply_progress_field(job.progress,
+                           job.progress_buf.substr(start, eq - start),
+                           job.progress_buf.substr(eq + 1, nl - eq - 1));
+    }
+    start = nl + 1;
+  }
+  job.progress_buf.erase(0, start);
+  return true;
+}
+
+// content seconds still to encode for a job, or -1 if we don't know
+static double remaining_seconds(const ff_job &job) {
+  if (job.duration == 0) {
+    return -1;
+  }
+  double left = job.duration - job.progress.out_time;
+  return left > 0 ? left : 0;
+}
+
+void summarise_batch(const std::vector<ff_job> &jobs, batch_progress &out) {
+  out = batch_progress();
+  out.total = jobs.size();
+
+  double known = 0;
+  size_t known_cnt = 0;
+  size_t unknown = 0;
+
+  for (auto &job : jobs) {
+    if (job.state == JobState::Done) {
+      out.done++;
+      continue;
+    }
+    if (job.state == JobState::Failed) {
+      out.failed++;
+      continue;
+    }
+    if (job.state == JobState::Skipped) {
+      out.skipped++;
+      continue;
+    }
+
+    if (job.state == JobState::Running) {
+      out.running++;
+      out.speed += job.progress.speed;
+      out.fps += job.progress.fps;
+    } else {
+      out.pending++;
+    }
+
+    double left = remaining_seconds(job);
+    if (left < 0) {
+      unknown++;
+    } else {
+      out.remaining += left;
+      known += job.duration;
+      known_cnt++;
+    }
+  }
+
+  // episodes we haven't probed yet are assumed to be as long as the
+  // average one we have
+  if (unknown && known_cnt) {
+    out.remaining += unknown * (known / known_cnt);
+  }
+
+  out.eta = out.speed > 0 && (unknown == 0 || known_cnt)
+                ? out.remaining / out.speed
+                : -1;
+}
+
+std::string format_clock(double seconds) {
+  if (seconds < 0) {
+    return "--:--:--";
+  }
+  size_t s = static_cast<size_t>(seconds + 0.5);
+  std::ostringstream oss;
+  oss << std::setfill('0') << std::setw(2) << s / 3600 << ":" << std::setw(2)
+      << (s / 60) % 60 << ":" << std::setw(2) << s % 60;
+  return oss.str();
+}
+
+const char *job_state_name(JobState state) {
+  switch (state) {
+  case JobState::Pending:
+    return "pending";
+  case JobState::Running:
+    return "running";
+  case JobState::Done:
+    return "done";
+  case JobState::Failed:
+    return "failed";
+  case JobState::Skipped:
+    return "skipped";
+  }
+  return "unknown";
+}
+
+std::string json_escape(const std::string &in) {
+  std::string out;
+  out.reserve(in.size() + 2);
+  for (char c : in) {
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        char hex[8];
+        snprintf(hex, sizeof(hex), "\\u%04x", c);
+        out += hex;
+      } else {
+        out += c;
+      }
+    }
+  }
+  return out;
+}
+
+// a JSON snapshot of the whole batch, replaced atomically so anything
+// polling it never sees half a file
+bool write_progress_file(const std::string &path,
+                         const std::vector<ff_job> &jobs,
+                         const batch_progress &batch) {
+  std::string tmp = path + ".tmp";
+  std::ofstream out(tmp);
+  if (!out) {
+    ERROR("Failed to write \"%s\"", tmp.c_str());
+    return false;
+  }
+
+  out << std::fixed << std::setprecision(3);
+  out << "{\n"
+      << "  \"updated\": " << time(nullptr) << ",\n"
+      << "  \"total\": " << batch.total << ",\n"
+      << "  \"done\": " << batch.done << ",\n"
+      << "  \"failed\": " << batch.failed << ",\n"
+      << "  \"skipped\": " << batch.skipped << ",\n"
+      << "  \"running\": " << batch.running << ",\n"
+      << "  \"pending\": " << batch.pending << ",\n"
+      << "  \"fps\": " << batch.fps << ",\n"
+      << "  \"speed\": " << batch.speed << ",\n"
+      << "  \"remaining_seconds\": " << batch.remaining << ",\n"
+      << "  \"eta_seconds\": " << batch.eta << ",\n"
+      << "  \"jobs\": [";
+
+  for (size_t i = 0; i < jobs.size(); i++) {
+    const ff_job &job = jobs[i];
+    out << (i ? "," : "") << "\n    {"
+        << "\"input\": \"" << json_escape(job.input) << "\", "
+        << "\"output\": \"" << json_escape(job.output) << "\", "
+        << "\"state\": \"" << job_state_name(job.state) << "\", "
+        << "\"attempts\": " << job.attempts << ", "
+        << "\"duration\": " << job.duration << ", "
+        << "\"out_time\": " << job.progress.out_time << ", "
+        << "\"frame\": " << job.progress.frame << ", "
+        << "\"fps\": " << job.progress.fps << ", "
+        << "\"speed\": " << job.progress.speed << ", "
+        << "\"bitrate\": \"" << json_escape(job.progress.bitrate) << "\"}";
+  }
+  out << "\n  ]\n}\n";
+
+  out.close();
+  if (!out || rename(tmp.c_str(), path.c_str()) != 0) {
+    ERROR("Failed to replace \"%s\"", path.c_str());
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+// print where the batch is up to, and refresh the progress file if asked
+// for one. with `detail` every running job gets its own line.
+void report_progress(const job_context &ctx, const std::vector<ff_job> &jobs,
+                     bool detail) {
+  batch_progress batch;
+  summarise_batch(jobs, batch);
+
+  if (!ctx.progress_path.empty()) {
+    write_progress_file(ctx.progress_path, jobs, batch);
+  }
+
+  INFO("%lu/%lu done, %lu running, %.1f fps, %.2fx, ETA %s", batch.done,
+       batch.total, batch.running, batch.fps, batch.speed,
+       format_clock(batch.eta).c_str());
+
+  if (!detail) {
+    return;
+  }
+
+  for (auto &job : jobs) {
+    if (job.state != JobState::Running) {
+      continue;
+    }
+    std::ostringstream line;
+    line << "    " << job.output << ": " << format_clock(job.progress.out_time)
+         << " / " << format_clock(job.duration ? job.duration : -1) << ", "
+         << std::fixed << std::setprecision(1) << job.progress.fps << " fps, "
+         << std::setprecision(2) << job.progress.speed << "x";
+    log_line(line.str());
+  }
+}
+
+#define DASHBOARD_NAME_WIDTH 32
+
+// the width of whatever stdout is attached to, or 80 if we can't tell
+static size_t terminal_width() {
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+    return ws.ws_col;
+  }
+  return 80;
+}
+
+// cut a line down to the terminal width, so it never wraps
+static std::string fit_line(const std::string &line, size_t width) {
+  if (line.size() < width) {
+    return line + "\n";
+  }
+  return line.substr(0, width ? width - 1 : 0) + "\n";
+}
+
+// the status view: a line for the batch, then one per running job with how
+// far it's got. plain text only, every line has to be exactly one row.
+std::string render_dashboard(const std::vector<ff_job> &jobs,
+                             const batch_progress &batch, size_t width) {
+  std::ostringstream head;
+  head << std::fixed << std::setprecision(1) << batch.done << "/"
+       << batch.total << " done";
+  if (batch.failed) {
+    head << ", " << batch.failed << " failed";
+  }
+  if (batch.skipped) {
+    head << ", " << batch.skipped << " skipped";
+  }
+  head << ", " << batch.running << " running | " << batch.fps << " fps | "
+       << std::setprecision(2) << batch.speed << "x | ETA "
+       << format_clock(batch.eta);
+
+  std::string out = fit_line(head.str(), width);
+
+  for (auto &job : jobs) {
+    if (job.state != JobState::Running) {
+      continue;
+    }
+
+    std::ostringstream stats;
+    if (job.progress.updates == 0) {
+      stats << "  starting";
+    } else {
+      double left = remaining_seconds(job);
+      stats << std::fixed << std::setprecision(0);
+      if (job.duration) {
+        stats << std::setw(4) << 100 * job.progress.out_time / job.duration
+              << "%";
+      } else {
+        stats << "   ?%";
+      }
+      stats << " " << format_clock(job.progress.out_time) << " "
+            << std::setw(6) << std::setprecision(1) << job.progress.fps
+            << " fps " << std::setw(5) << std::setprecision(2)
+            << job.progress.speed << "x ETA "
+            << format_clock(left >= 0 && job.progress.speed > 0
+                                ? left / job.progress.speed
+                                : -1);
+    }
+    if (job.attempts > 1) {
+      stats << " (try " << job.attempts << ")";
+    }
+
+    // the episode name gets a fixed column, narrower if the terminal is,
+    // cut from the front since the end of a file name is what tells
+    // episodes apart
+    std::string name = job.output.substr(job.output.rfind('/') + 1);
+    std::string tail = stats.str();
+    size_t room = width > tail.size() + 12 ? width - tail.size() - 4 : 8;
+    room = std::min<size_t>(room, DASHBOARD_NAME_WIDTH);
+    if (name.size() > room) {
+      name = "..." + name.substr(name.size() - (room - 3));
+    }
+    name.resize(room, ' ');
+
+    out += fit_line("  " + name + " " + tail, width);
+  }
+
+  return out;
+}
+
+// refresh the status view under the log, and the progress file with it
+void draw_dashboard(const job_context &ctx, const std::vector<ff_job> &jobs) {
+  batch_progress batch;
+  summarise_batch(jobs, batch);
+
+  if (!ctx.progress_path.empty()) {
+    write_progress_file(ctx.progress_path, jobs, batch);
+  }
+
+  log_set_footer(render_dashboard(jobs, batch, terminal_width()));
+}
@@ -0,0 +1,714 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "util.h"
+
+// the job queue lets one process work through many shows and seasons.
+// every run that's given --enqueue asks its questions as usual but, rather
+// than encoding, appends its episodes to the queue file along with the job
+// spec its answers went to, and a priority. `--drain` then runs them,
+// always starting whichever waiting episode has the highest priority, so
+// an urgent title goes ahead of everything that hasn't started yet and
+// nothing in flight is disturbed.
+//
+// the queue is a text file of tab separated records, like the probe cache:
+//
+//   E id priority crop ignore_pawe max_retries chunks crf_target spec
+//                           one per enqueued title or season, along with
+//                           the flags it was enqueued with (crf_target is
+//                           METRIC:VALUE, or none)
+//   J id state input output one per episode, id being its E record's
+//
+// episodes are pending, running, done, failed or skipped. every change
+// happens under an flock() on <queue>.lock and is written back whole
+// through a rename, so any number of processes can add to the queue while
+// it's being drained. only one drain runs at once (it holds <queue>.drain),
+// so episodes it finds marked running were left by one that died, and are
+// run again. queues from before the flags were kept are still read, and
+// their titles get the drain's own flags.
+#define JOB_QUEUE_VERSION "animachine-queue 2"
+#define JOB_QUEUE_VERSION_1 "animachine-queue 1"
+
+// how often a drain looks for new work while its slots are free
+#define QUEUE_CHECK_SECONDS 1
+
+struct queue_entry {
+  size_t id = 0;
+  long priority = 0;
+  std::string spec;
+  // the flags given with --enqueue, which the spec doesn't hold
+  bool crop = false;
+  bool ignore_pawe = false;
+  size_t max_retries = 0;
+  size_t chunks = 0;
+  crf_target crf_search;
+};
+
+struct queue_item {
+  size_t id = 0;
+  std::string state;
+  std::string input;
+  std::string output;
+};
+
+class job_queue {
+public:
+  explicit job_queue(const std::string &path) : path(path) {}
+
+  bool load();
+  bool save() const;
+  const queue_entry *entry(size_t id) const;
+
+  const std::string path;
+  std::vector<queue_entry> entries;
+  std::vector<queue_item> items;
+};
+
+bool job_queue::load() {
+  entries.clear();
+  items.clear();
+
+  std::ifstream in(path);
+  if (!in) {
+    // nothing has been queued yet
+    return true;
+  }
+
+  std::string line;
+  if (!std::getline(in, line) ||
+      (line != JOB_QUEUE_VERSION && line != JOB_QUEUE_VERSION_1)) {
+    ERROR("\"%s\" is not a job queue", path.c_str());
+    return false;
+  }
+
+  while (std::getline(in, line)) {
+    std::vector<std::string> f = cache_split(line);
+    if (f[0] == "E" && (f.size() == 4 || f.size() == 9)) {
+      queue_entry e;
+      e.id = strtoul(f[1].c_str(), nullptr, 10);
+      e.priority = strtol(f[2].c_str(), nullptr, 10);
+      e.spec = f.back();
+      if (f.size() == 9) {
+        e.crop = f[3] == "1";
+        e.ignore_pawe = f[4] == "1";
+        e.max_retries = strtoul(f[5].c_str(), nullptr, 10);
+        e.chunks = strtoul(f[6].c_str(), nullptr, 10);
+        if (f[7] != "none" && !parse_crf_target(f[7], e.crf_search)) {
+          e.crf_search = crf_target();
+        }
+      }
+      entries.push_back(e);
+    } else if (f[0] == "J" && f.size() == 5) {
+      queue_item item;
+      item.id = strtoul(f[1].c_str(), nullptr, 10);
+      item.state = f[2];
+      item.input = f[3];
+      item.output = f[4];
+      items.push_back(item);
+    } else if (!line.empty()) {
+      WARNING("Ignoring bad line in job queue \"%s\"", path.c_str());
+    }
+  }
+  return true;
+}
+
+bool job_queue::save() const {
+  bool ok = replace_file(path, [&](std::ostream &out) {
+    out << JOB_QUEUE_VERSION << '\n';
+    for (auto &e : entries) {
+      out << "E\t" << e.id << '\t' << e.priority << '\t' << e.crop << '\t'
+          << e.ignore_pawe << '\t' << e.max_retries << '\t' << e.chunks
+          << '\t';
+      if (e.crf_search.metric.empty()) {
+        out << "none";
+      } else {
+        out << e.crf_search.metric << ':' << e.crf_search.value;
+      }
+      out << '\t' << cache_escape(e.spec) << '\n';
+    }
+    for (auto &item : items) {
+      out << "J\t" << item.id << '\t' << item.state << '\t'
+          << cache_escape(item.input) << '\t' << cache_escape(item.output)
+          << '\n';
+    }
+    return static_cast<bool>(out);
+  });
+
+  if (!ok) {
+    ERROR("Failed to save job queue \"%s\"", path.c_str());
+  }
+  return ok;
+}
+
+const queue_entry *job_queue::entry(size_t id) const {
+  for (auto &e : entries) {
+    if (e.id == id) {
+      return &e;
+    }
+  }
+  return nullptr;
+}
+
+// the drain may well run from somewhere else
+static std::string absolute_path(const std::string &path) {
+  if (path.empty() || path[0] == '/') {
+    return path;
+  }
+  char cwd[4096];
+  if (!getcwd(cwd, sizeof(cwd))) {
+    return path;
+  }
+  return std::string(cwd) + "/" + path;
+}
+
+// where an enqueueing run records its answers if it wasn't given a spec
+std::string new_queue_spec(const std::string &queue) {
+  std::string dir = absolute_path(queue) + ".specs";
+  if (!make_directory(dir)) {
+    return "";
+  }
+  return dir + "/" + std::to_string(time(nullptr)) + "-" +
+         std::to_string(getpid()) + ".spec";
+}
+
+bool enqueue_jobs(const job_context &ctx, const std::string &queue,
+                  long priority, const std::vector<ff_job> &jobs) {
+  if (!ctx.spec) {
+    ERROR("Queued jobs need a job spec to take their options from");
+    return false;
+  }
+
+  file_lock lock(queue);
+  job_queue q(queue);
+  if (!lock.held() || !q.load()) {
+    return false;
+  }
+
+  queue_entry e;
+  for (auto &other : q.entries) {
+    e.id = std::max(e.id, other.id);
+  }
+  e.id++;
+  e.priority = priority;
+  e.spec = absolute_path(ctx.spec->path);
+  e.crop = ctx.crop;
+  e.ignore_pawe = ctx.ignore_pawe;
+  e.max_retries = ctx.max_retries;
+  e.chunks = ctx.chunks;
+  e.crf_search = ctx.crf_search;
+  q.entries.push_back(e);
+
+  for (auto &job : jobs) {
+    queue_item item;
+    item.id = e.id;
+    item.state = "pending";
+    item.input = absolute_path(job.input);
+    item.output = absolute_path(job.output);
+    q.items.push_back(item);
+  }
+
+  if (!q.save()) {
+    return false;
+  }
+  INFO("Queued %lu episodes as #%lu with priority %ld", jobs.size(), e.id,
+       priority);
+  return true;
+}
+
+bool print_queue(const std::string &queue) {
+  job_queue q(queue);
+  if (!q.load()) {
+    return false;
+  }
+
+  for (auto &e : q.entries) {
+    std::map<std::string, size_t> counts;
+    for (auto &item : q.items) {
+      if (item.id == e.id) {
+        counts[item.state]++;
+      }
+    }
+
+    std::string summary;
+    for (auto &c : counts) {
+      summary += (summary.empty() ? "" : ", ") + std::to_string(c.second) +
+                 " " + c.first;
+    }
+    INFO("#%lu priority %ld: %s (%s)", e.id, e.priority, summary.c_str(),
+         e.spec.c_str());
+  }
+  return true;
+}
+
+class queue_feed : public job_feed {
+public:
+  queue_feed(const job_context &ctx, const std::string &path)
+      : ctx(ctx), path(path) {}
+
+  bool start();
+
+  void refill(std::vector<ff_job> &jobs, size_t room) override;
+  void finished(const ff_job &job) override;
+  bool idle() override;
+
+private:
+  // a title being encoded in chunks, see start_chunks()
+  struct chunked_title {
+    size_t id = 0;
+    std::string input;
+    std::string dir;
+    ffmpeg_opts opts = ffmpeg_opts();
+    std::vector<segment> segs;
+    size_t left = 0; // pieces still to finish
+    bool failed = false;
+    bool ignore_pawe = false;
+  };
+
+  job_context context_for(const queue_entry &e) const;
+  void build(const queue_entry &e, const std::string &sample, size_t slots);
+  void collect();
+  bool waiting(const job_queue &q, const queue_item &item) const;
+  bool start_chunks(const job_context &local, const queue_item &item,
+                    const ffmpeg_opts &o, size_t duration, size_t count,
+                    std::vector<ff_job> &jobs);
+  bool set_state(job_queue &q, size_t id, const std::string &output,
+                 const std::string &state);
+
+  job_context ctx;
+  const std::string path;
+  // what each title was worked out to need, and which ones can't be done
+  std::map<size_t, ffmpeg_opts> opts;
+  std::set<size_t> broken;
+  std::map<size_t, queue_entry> entries; // every title seen, by id
+  // the title of every job handed out, by output. two titles can be
+  // queued with the same output, but only one of them runs at a time.
+  std::map<std::string, size_t> titles;
+  // chunked titles by output, the title each piece belongs to by the
+  // piece's output, and joins whose pieces are all done
+  std::map<std::string, chunked_title> chunked;
+  std::map<std::string, std::string> pieces;
+  std::vector<ff_job> joins;
+  options_builder builder;
+  size_t building = 0; // the title the builder has, 0 if none
+  time_t last_check = 0;
+  bool stalled = false; // refill looked but had nothing to do
+};
+
+bool queue_feed::start() {
+  file_lock lock(path);
+  job_queue q(path);
+  if (!lock.held() || !q.load()) {
+    return false;
+  }
+
+  size_t pending = 0;
+  for (auto &item : q.items) {
+    if (item.state == "running") {
+      WARNING("%s was left running, starting it again", item.input.c_str());
+      item.state = "pending";
+    }
+    if (item.state == "pending") {
+      pending++;
+    }
+  }
+  INFO("%lu episodes waiting in %s", pending, path.c_str());
+  return q.save();
+}
+
+// the drain's own settings, with the flags the title was enqueued with on
+// top
+job_context queue_feed::context_for(const queue_entry &e) const {
+  job_context local(ctx);
+  local.crop = ctx.crop || e.crop;
+  local.ignore_pawe = ctx.ignore_pawe || e.ignore_pawe;
+  if (e.max_retries) {
+    local.max_retries = e.max_retries;
+  }
+  if (e.chunks) {
+    local.chunks = e.chunks;
+  }
+  if (!e.crf_search.metric.empty()) {
+    local.crf_search = e.crf_search;
+  }
+  return local;
+}
+
+// have the builder work out a title's options from one of its episodes,
+// with the slots that are free now
+void queue_feed::build(const queue_entry &e, const std::string &sample,
+                       size_t slots) {
+  job_context local = context_for(e);
+  local.spec.reset(new job_spec(e.spec, false));
+  if (!local.spec->load()) {
+    broken.insert(e.id);
+    return;
+  }
+  // nobody is here to ask or to look at a test encode
+  local.spec->set("should_test", "no");
+  local.spec->unattended = true;
+
+  INFO("Working out options for #%lu from %s", e.id, sample.c_str());
+  if (builder.start(e.id, local, sample, slots)) {
+    building = e.id;
+  }
+}
+
+// pick up the title the builder has finished with, if it has
+void queue_feed::collect() {
+  ffmpeg_opts built = ffmpeg_opts();
+  bool failed;
+  if (!building || !builder.take(building, built, failed)) {
+    return;
+  }
+  // a spec that can't answer only costs its own title, the drain goes on
+  if (failed) {
+    ERROR("No options for title %lu from \"%s\", failing its episodes",
+          building, entries[building].spec.c_str());
+    broken.insert(building);
+  } else {
+    opts[building] = built;
+  }
+  building = 0;
+}
+
+// whether an episode is still to be handed out. ones whose title has gone
+// from the queue are never picked, so they're not waited for either.
+bool queue_feed::waiting(const job_queue &q, const queue_item &item) const {
+  return item.state == "pending" && q.entry(item.id) &&
+         !broken.count(item.id);
+}
+
+// hand out the pieces of a title that's to be encoded in chunks. they're
+// joined by a job of its own once they're all done, see finished().
+bool queue_feed::start_chunks(const job_context &local,
+                              const queue_item &item, const ffmpeg_opts &o,
+                              size_t duration, size_t count,
+                              std::vector<ff_job> &jobs) {
+  chunked_title t;
+  t.id = item.id;
+  t.input = item.input;
+  t.dir = work_dir(local, item.output, ".chunks");
+  t.opts = o;
+  t.ignore_pawe = local.ignore_pawe;
+
+  std::vector<ff_job> parts;
+  if (!make_directory(t.dir) ||
+      !make_chunk_jobs(local, item.input, o, duration, count, t.dir, t.segs,
+                       parts)) {
+    return false;
+  }
+
+  INFO("Encoding %s as %lu chunks", item.input.c_str(), parts.size());
+  for (auto &part : parts) {
+    pieces[part.output] = item.output;
+    jobs.push_back(part);
+  }
+  t.left = parts.size();
+  chunked[item.output] = t;
+  return true;
+}
+
+bool queue_feed::set_state(job_queue &q, size_t id,
+                           const std::string &output,
+                           const std::string &state) {
+  for (auto &item : q.items) {
+    if (item.id == id && item.output == output) {
+      item.state = state;
+      return true;
+    }
+  }
+  return false;
+}
+
+void queue_feed::refill(std::vector<ff_job> &jobs, size_t room) {
+  collect();
+  // the builder's jobs aren't in the list, but they take up slots all the
+  // same
+  size_t held = builder.held();
+  room = room > held ? room - held : 0;
+
+  // joins go first, everything they need is done
+  while (room && !joins.empty()) {
+    jobs.push_back(joins.front());
+    joins.erase(joins.begin());
+    room--;
+  }
+
+  time_t now = time(nullptr);
+  if (room == 0 || now - last_check < QUEUE_CHECK_SECONDS) {
+    return;
+  }
+  last_check = now;
+
+  // what goes next is picked under the queue's lock, but the slow parts
+  // (reading the spec, probing the sources) happen without it, so an
+  // --enqueue is never kept waiting on them
+  std::vector<queue_item> picked;
+  queue_entry to_build;
+  std::string sample;
+  size_t build_slots = 0;
+  {
+    file_lock lock(path);
+    job_queue q(path);
+    if (!lock.held() || !q.load()) {
+      return;
+    }
+
+    // highest priority first, then oldest title, then in episode order
+    std::vector<size_t> order;
+    for (size_t i = 0; i < q.items.size(); i++) {
+      if (q.items[i].state == "pending" && q.entry(q.items[i].id)) {
+        order.push_back(i);
+      }
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      const queue_entry *ea = q.entry(q.items[a].id);
+      const queue_entry *eb = q.entry(q.items[b].id);
+      if (ea->priority != eb->priority) {
+        return ea->priority > eb->priority;
+      }
+      return ea->id < eb->id;
+    });
+
+    bool changed = false;
+    std::set<std::string> outputs;
+    for (size_t i : order) {
+      if (room == picked.size()) {
+        break;
+      }
+      queue_item &item = q.items[i];
+      const queue_entry &e = *q.entry(item.id);
+      // two encodes can't write the same file at once
+      if (titles.count(item.output) || !outputs.insert(item.output).second) {
+        continue;
+      }
+
+      if (broken.count(e.id)) {
+        ERROR("Can't work out options for #%lu, giving up on %s", e.id,
+              item.input.c_str());
+        item.state = "failed";
+        changed = true;
+        continue;
+      }
+
+      // the first episode of a title waits for its options to be worked
+      // out, with every slot that's still free. the ones after it wait
+      // too, but other titles whose options are known can have any slots
+      // that come free in the meantime.
+      entries[e.id] = e;
+      if (!opts.count(e.id)) {
+        if (!building && sample.empty()) {
+          to_build = e;
+          sample = item.input;
+          build_slots = room - picked.size();
+          room = picked.size();
+        }
+        continue;
+      }
+      picked.push_back(item);
+    }
+
+    if (changed) {
+      q.save();
+    }
+    stalled = picked.empty() && sample.empty() && !changed;
+  }
+
+  if (!sample.empty()) {
+    build(to_build, sample, build_slots);
+  }
+
+  for (auto &item : picked) {
+    const ffmpeg_opts &o = opts[item.id];
+    job_context local = context_for(entries[item.id]);
+    probe_summary probe;
+    size_t slash = item.output.rfind('/');
+    ff_job job;
+
+    if (!probe_file(local, item.input, o, probe)) {
+      ERROR("Skipping %s: %s", item.input.c_str(), probe.problem.c_str());
+      item.state = "skipped";
+      continue;
+    }
+
+    size_t count =
+        local.chunks > 1 ? chunk_count(local.chunks, probe.duration) : 1;
+    if (slash != std::string::npos &&
+        !make_directory(item.output.substr(0, slash))) {
+      item.state = "failed";
+    } else if (count > 1) {
+      item.state = start_chunks(local, item, o, probe.duration, count, jobs)
+                       ? "running"
+                       : "failed";
+    } else if (make_job(local, item.input, item.output, o, job)) {
+      job.duration = probe.duration;
+      jobs.push_back(job);
+      item.state = "running";
+    } else {
+      item.state = "failed";
+    }
+    if (item.state == "running") {
+      titles[item.output] = item.id;
+    }
+  }
+
+  if (picked.empty()) {
+    return;
+  }
+
+  file_lock lock(path);
+  job_queue q(path);
+  if (!lock.held() || !q.load()) {
+    return;
+  }
+  for (auto &item : picked) {
+    set_state(q, item.id, item.output, item.state);
+  }
+  q.save();
+}
+
+void queue_feed::finished(const ff_job &job) {
+  std::string output = job.output;
+  const char *state = job.state == JobState::Done      ? "done"
+                      : job.state == JobState::Skipped ? "skipped"
+                                                       : "failed";
+
+  // a piece of a chunked title only counts once they're all in
+  auto piece = pieces.find(output);
+  if (piece != pieces.end()) {
+    output = piece->second;
+    pieces.erase(piece);
+    chunked_title &t = chunked[output];
+    t.failed = t.failed || job.state != JobState::Done;
+    if (--t.left) {
+      return;
+    }
+
+    ff_job join;
+    if (!t.failed &&
+        make_concat_job(t.input, output, t.opts, t.segs, t.dir, join)) {
+      join.ignore_pawe = t.ignore_pawe;
+      joins.push_back(join);
+      last_check = 0;
+      return;
+    }
+    ERROR("One or more chunks of %s failed, leaving them in %s",
+          output.c_str(), t.dir.c_str());
+    chunked.erase(output);
+    state = "failed";
+  } else {
+    auto t = chunked.find(output);
+    if (t != chunked.end()) {
+      if (job.state == JobState::Done) {
+        rm(t->second.dir);
+      } else {
+        ERROR("Failed to join chunks, leaving them in %s",
+              t->second.dir.c_str());
+      }
+      chunked.erase(t);
+    }
+  }
+
+  auto title = titles.find(output);
+  if (title == titles.end()) {
+    return;
+  }
+  size_t id = title->second;
+  titles.erase(title);
+
+  file_lock lock(path);
+  job_queue q(path);
+  if (!lock.held() || !q.load()) {
+    return;
+  }
+
+  if (set_state(q, id, output, state)) {
+    q.save();
+  }
+  // a slot has come free, so look for the next one straight away
+  last_check = 0;
+}
+
+bool queue_feed::idle() {
+  if (!joins.empty()) {
+    last_check = 0;
+    return true;
+  }
+
+  // everything waits on the title being worked out
+  if (building) {
+    builder.wait(QUEUE_CHECK_SECONDS * 1000);
+    last_check = 0;
+    return true;
+  }
+
+  // the last look found nothing it could start, so don't look again
+  // straight away
+  if (stalled) {
+    sleep(QUEUE_CHECK_SECONDS);
+  }
+
+  file_lock lock(path);
+  job_queue q(path);
+  if (!lock.held() || !q.load()) {
+    return false;
+  }
+  for (auto &item : q.items) {
+    if (waiting(q, item)) {
+      last_check = 0;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool drain_queue(const job_context &ctx, const std::string &queue) {
+  int fd = open((queue + ".drain").c_str(), O_RDWR | O_CREAT | O_CLOEXEC,
+                0644);
+  if (fd == -1 || flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    ERROR("\"%s\" is already being drained", queue.c_str());
+    if (fd != -1) {
+      close(fd);
+    }
+    return false;
+  }
+
+  job_context local(ctx);
+  bool ok = resolve_ffmpeg(local);
+  if (ok) {
+    queue_feed feed(local, queue);
+    std::vector<ff_job> jobs;
+    ok = feed.start() &&
+         run_jobs(local, jobs, local.max_jobs, nullptr, &feed);
+  }
+
+  close(fd);
+  return ok;
+}
@@ -0,0 +1,243 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <unistd.h>
+
+#include "util.h"
+
+// the run report is one record per finished job: what it cost (from the
+// child's rusage), what it produced, and the settings it was run with, so
+// runs with different presets can be lined up against each other. it's
+// rewritten after every batch, as JSON, or CSV if the path ends in .csv.
+// several runs can share a report: every record carries the id of the run
+// that wrote it, and a run only ever replaces its own, under a lock.
+
+void add_rusage(job_usage &usage, const struct rusage &ru) {
+  usage.user += ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+  usage.sys += ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+  // linux reports kilobytes, macOS bytes
+#ifdef __APPLE__
+  long rss_kb = ru.ru_maxrss / 1024;
+#else
+  long rss_kb = ru.ru_maxrss;
+#endif
+  usage.max_rss_kb = std::max(usage.max_rss_kb, rss_kb);
+
+  usage.nvcsw += ru.ru_nvcsw;
+  usage.nivcsw += ru.ru_nivcsw;
+  usage.inblock += ru.ru_inblock;
+  usage.oublock += ru.ru_oublock;
+}
+
+run_report::run_report(const std::string &path)
+    : path(path), run(std::to_string(time(nullptr)) + "-" +
+                      std::to_string(getpid())) {}
+
+// the value following flag in an ffmpeg argument list, if there is one
+static std::string arg_after(const std::vector<std::string> &args,
+                      const std::string &flag) {
+  auto it = std::find(args.begin(), args.end(), flag);
+  return it != args.end() && it + 1 != args.end() ? *(it + 1) : "";
+}
+
+void run_report::record(const ff_job &job) {
+  job_record rec;
+  rec.input = job.input;
+  rec.output = job.output;
+  rec.state = job_state_name(job.state);
+  rec.exit_code = job.exit_code;
+  rec.attempts = job.attempts;
+  rec.usage = job.usage;
+  rec.duration = job.duration;
+  rec.input_size = file_size(job.input);
+  rec.output_size = job.state == JobState::Done ? file_size(job.output) : 0;
+  if (rec.duration && rec.output_size) {
+    rec.kbps = rec.output_size * 8.0 / rec.duration / 1000;
+  }
+  rec.preset = arg_after(job.args, "-preset");
+  rec.crf = arg_after(job.args, "-crf");
+  rec.x265_params = arg_after(job.args, "-x265-params");
+
+  records.push_back(rec);
+}
+
+bool run_report::write_json(std::ostream &out,
+                            const std::vector<std::string> &others) const {
+  std::vector<std::string> bodies(others);
+  for (auto &r : records) {
+    std::ostringstream body;
+    body << std::fixed << std::setprecision(3)
+         << "      \"run\": \"" << run << "\",\n"
+         << "      \"input\": \"" << json_escape(r.input) << "\",\n"
+         << "      \"output\": \"" << json_escape(r.output) << "\",\n"
+         << "      \"state\": \"" << r.state << "\",\n"
+         << "      \"exit_code\": " << r.exit_code << ",\n"
+         << "      \"attempts\": " << r.attempts << ",\n"
+         << "      \"preset\": \"" << json_escape(r.preset) << "\",\n"
+         << "      \"crf\": \"" << json_escape(r.crf) << "\",\n"
+         << "      \"x265_params\": \"" << json_escape(r.x265_params) << "\",\n"
+         << "      \"wall_seconds\": " << r.usage.wall << ",\n"
+         << "      \"spawn_seconds\": " << r.usage.spawn << ",\n"
+         << "      \"user_seconds\": " << r.usage.user << ",\n"
+         << "      \"sys_seconds\": " << r.usage.sys << ",\n"
+         << "      \"max_rss_kb\": " << r.usage.max_rss_kb << ",\n"
+         << "      \"voluntary_switches\": " << r.usage.nvcsw << ",\n"
+         << "      \"involuntary_switches\": " << r.usage.nivcsw << ",\n"
+         << "      \"blocks_in\": " << r.usage.inblock << ",\n"
+         << "      \"blocks_out\": " << r.usage.oublock << ",\n"
+         << "      \"duration_seconds\": " << r.duration << ",\n"
+         << "      \"input_bytes\": " << r.input_size << ",\n"
+         << "      \"output_bytes\": " << r.output_size << ",\n"
+         << "      \"output_kbps\": " << r.kbps << "\n";
+    bodies.push_back(body.str());
+  }
+
+  out << "{\n  \"jobs\": [";
+  for (size_t i = 0; i < bodies.size(); i++) {
+    out << (i ? "," : "") << "\n    {\n" << bodies[i] << "    }";
+  }
+  out << "\n  ]\n}\n";
+  return static_cast<bool>(out);
+}
+
+static std::string csv_field(const std::string &in) {
+  if (in.find_first_of(",\"\n") == std::string::npos) {
+    return in;
+  }
+  std::string out = "\"";
+  for (char c : in) {
+    out += c == '"' ? std::string("\"\"") : std::string(1, c);
+  }
+  return out + "\"";
+}
+
+#define CSV_HEADER                                                             \
+  "run,input,output,state,exit_code,attempts,preset,crf,x265_params,"          \
+  "wall_seconds,spawn_seconds,user_seconds,sys_seconds,max_rss_kb,"            \
+  "voluntary_switches,involuntary_switches,blocks_in,blocks_out,"              \
+  "duration_seconds,input_bytes,output_bytes,output_kbps"
+
+bool run_report::write_csv(std::ostream &out,
+                           const std::vector<std::string> &others) const {
+  out << CSV_HEADER << '\n';
+  for (auto &line : others) {
+    out << line;
+  }
+  out << std::fixed << std::setprecision(3);
+
+  for (auto &r : records) {
+    out << run << ',' << csv_field(r.input) << ',' << csv_field(r.output)
+        << ',' << r.state << ',' << r.exit_code << ',' << r.attempts << ','
+        << csv_field(r.preset) << ',' << csv_field(r.crf) << ','
+        << csv_field(r.x265_params) << ',' << r.usage.wall << ','
+        << r.usage.spawn << ',' << r.usage.user << ',' << r.usage.sys << ','
+        << r.usage.max_rss_kb << ',' << r.usage.nvcsw << ','
+        << r.usage.nivcsw << ',' << r.usage.inblock << ','
+        << r.usage.oublock << ',' << r.duration << ',' << r.input_size
+        << ',' << r.output_size << ',' << r.kbps << '\n';
+  }
+  return static_cast<bool>(out);
+}
+
+// the records other runs have in the report, as they were written: the
+// lines inside each JSON object, or each CSV row (which may span lines if
+// a quoted field has a newline in it). anything this run wrote before is
+// left out, since it's about to be written again.
+bool run_report::read_others(bool csv, std::vector<std::string> &out) const {
+  std::ifstream in(path);
+  if (!in) {
+    return true;
+  }
+
+  std::string line;
+  if (csv) {
+    if (!std::getline(in, line) || line != CSV_HEADER) {
+      return false;
+    }
+    std::string row;
+    bool quoted = false;
+    while (std::getline(in, line)) {
+      row += line + "\n";
+      quoted ^= std::count(line.begin(), line.end(), '"') % 2 == 1;
+      if (quoted) {
+        continue;
+      }
+      if (row.compare(0, run.size() + 1, run + ",") != 0) {
+        out.push_back(row);
+      }
+      row.clear();
+    }
+    return true;
+  }
+
+  const std::string mine = "      \"run\": \"" + run + "\",";
+  std::string body;
+  bool inside = false;
+  bool ours = false;
+  while (std::getline(in, line)) {
+    if (line == "    {") {
+      inside = true;
+      ours = false;
+      body.clear();
+    } else if (inside && line.compare(0, 5, "    }") == 0) {
+      if (!ours) {
+        out.push_back(body);
+      }
+      inside = false;
+    } else if (inside) {
+      ours = ours || line == mine;
+      body += line + "\n";
+    }
+  }
+  return true;
+}
+
+bool run_report::write() const {
+  bool csv = path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+
+  file_lock lock(path);
+  if (!lock.held()) {
+    return false;
+  }
+
+  std::vector<std::string> others;
+  if (!read_others(csv, others)) {
+    WARNING("\"%s\" isn't a report this version writes, replacing it",
+            path.c_str());
+    others.clear();
+  }
+
+  bool ok = replace_file(path, [&](std::ostream &out) {
+    return csv ? write_csv(out, others) : write_json(out, others);
+  });
+  if (!ok) {
+    ERROR("Failed to write run report \"%s\"", path.c_str());
+    return false;
+  }
+
+  DEBUG_INFO("Wrote %lu records to %s", records.size(), path.c_str());
+  return true;
+}
@@ -0,0 +1,253 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <cstdio>
+#include <fstream>
+#include <unistd.h>
+
+#include "inquirer.h"
+#include "util.h"
+
+using namespace alx;
+
+// a job spec holds the answers to every question a run would ask, keyed by
+// question, so a run can go from start to finish without anyone at the
+// keyboard. it's plain text:
+//
+//   # comments and blank lines are ignored
+//   audio = 2
+//   should_copy = no
+//   crf = 20
+//
+// choices can be given as the option itself or by number, so a recorded
+// stream label like "2. FLAC / jpn" still picks the second stream of a
+// file that labels it differently. --record-spec writes one of these from
+// the answers of an interactive session.
+
+static std::string trim(const std::string &in) {
+  size_t start = in.find_first_not_of(" \t\r");
+  if (start == std::string::npos) {
+    return "";
+  }
+  size_t end = in.find_last_not_of(" \t\r");
+  return in.substr(start, end - start + 1);
+}
+
+static void
+set_answer(std::vector<std::pair<std::string, std::string>> &answers,
+           const std::string &key, const std::string &value) {
+  for (auto &answer : answers) {
+    if (answer.first == key) {
+      answer.second = value;
+      return;
+    }
+  }
+  answers.push_back(std::make_pair(key, value));
+}
+
+job_spec::job_spec(const std::string &path, bool recording)
+    : path(path), recording(recording) {}
+
+bool job_spec::load() {
+  return read(answers);
+}
+
+bool job_spec::read(
+    std::vector<std::pair<std::string, std::string>> &out) const {
+  std::ifstream in(path);
+  if (!in) {
+    ERROR("Failed to open job spec \"%s\"", path.c_str());
+    return false;
+  }
+
+  std::string line;
+  size_t lineno = 0;
+  while (std::getline(in, line)) {
+    lineno++;
+    line = trim(line);
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+
+    size_t eq = line.find('=');
+    if (eq == std::string::npos) {
+      ERROR("%s:%lu: expected key = value", path.c_str(), lineno);
+      return false;
+    }
+    set_answer(out, trim(line.substr(0, eq)), trim(line.substr(eq + 1)));
+  }
+
+  DEBUG_INFO("Loaded %lu answers from %s", out.size(), path.c_str());
+  return true;
+}
+
+bool job_spec::lookup(const std::string &key, std::string &value) const {
+  for (auto &answer : answers) {
+    if (answer.first == key) {
+      value = answer.second;
+      return true;
+    }
+  }
+  return false;
+}
+
+void job_spec::set(const std::string &key, const std::string &value) {
+  set_answer(answers, key, value);
+}
+
+// written out whole after every answer, so a session that's abandoned
+// half way still leaves a usable start. answers another session has saved
+// to the same spec are kept, ours win where both have one.
+bool job_spec::save() const {
+  file_lock held(path);
+  if (!held.held()) {
+    return false;
+  }
+
+  std::vector<std::pair<std::string, std::string>> merged(answers);
+  std::vector<std::pair<std::string, std::string>> on_disk;
+  if (file_exists(path) && read(on_disk)) {
+    for (auto &answer : on_disk) {
+      std::string ours;
+      if (!lookup(answer.first, ours)) {
+        merged.push_back(answer);
+      }
+    }
+  }
+
+  bool ok = replace_file(path, [&](std::ostream &out) {
+    out << "# animachine job spec, replay with --spec " << path << "\n";
+    for (auto &answer : merged) {
+      out << answer.first << " = " << answer.second << "\n";
+    }
+    return static_cast<bool>(out);
+  });
+
+  if (!ok) {
+    ERROR("Failed to save job spec \"%s\"", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// the answer the spec has for key, if any. a spec that can't answer
+// fails the title when there's nobody to ask instead, and the watch and
+// queue feeds carry on with the rest.
+static bool replay_answer(const job_context &ctx, const std::string &key,
+                          std::string &value, bool &failed) {
+  failed = false;
+  if (!ctx.spec || ctx.spec->recording) {
+    return false;
+  }
+  if (ctx.spec->lookup(key, value)) {
+    DEBUG_INFO("%s = %s (from job spec)", key.c_str(), value.c_str());
+    return true;
+  }
+  if (ctx.spec->unattended || !isatty(STDIN_FILENO)) {
+    ERROR("Job spec \"%s\" has no answer for \"%s\"",
+          ctx.spec->path.c_str(), key.c_str());
+    failed = true;
+    return false;
+  }
+  WARNING("Job spec has no answer for \"%s\", asking instead", key.c_str());
+  return false;
+}
+
+// a bad answer in a spec can't be asked again, so it fails the title
+static bool bad_answer(const job_context &ctx, const std::string &key,
+                       const std::string &value, const char *why) {
+  ERROR("Job spec \"%s\": \"%s\" is not a valid answer for \"%s\" (%s)",
+        ctx.spec->path.c_str(), value.c_str(), key.c_str(), why);
+  return false;
+}
+
+static bool remember(const job_context &ctx, const std::string &key,
+                     const String &value, String &answer) {
+  if (ctx.spec && ctx.spec->recording) {
+    ctx.spec->set(key, value);
+    ctx.spec->save();
+  }
+  answer = value;
+  return true;
+}
+
+bool ask_yes_no(const job_context &ctx, const std::string &key,
+                const std::string &prompt, String &answer) {
+  std::string value;
+  bool failed;
+  if (replay_answer(ctx, key, value, failed)) {
+    if (value != "yes" && value != "no") {
+      return bad_answer(ctx, key, value, "expected yes or no");
+    }
+    answer = value;
+    return true;
+  }
+  if (failed) {
+    return false;
+  }
+  return remember(ctx, key, Question{key, prompt, Type::yesNo}.ask(), answer);
+}
+
+bool ask_number(const job_context &ctx, const std::string &key,
+                const std::string &prompt, size_t min, size_t max,
+                String &answer) {
+  std::string value;
+  bool failed;
+  if (replay_answer(ctx, key, value, failed)) {
+    size_t n;
+    if (value.empty() ||
+        value.find_first_not_of("0123456789") != std::string::npos ||
+        !cast_to_size(value, n) || n < min || n > max) {
+      return bad_answer(ctx, key, value, "number out of range");
+    }
+    answer = value;
+    return true;
+  }
+  if (failed) {
+    return false;
+  }
+  return remember(ctx, key, Question{key, prompt, Type::integer}.ask(),
+                  answer);
+}
+
+bool ask_choice(const job_context &ctx, const std::string &key,
+                const std::string &prompt,
+                const std::vector<std::string> &options, String &answer) {
+  std::string value;
+  bool failed;
+  if (replay_answer(ctx, key, value, failed)) {
+    for (auto &option : options) {
+      if (option == value) {
+        answer = option;
+        return true;
+      }
+    }
+    size_t n = strtoul(value.c_str(), nullptr, 10);
+    if (n == 0 || n > options.size()) {
+      return bad_answer(ctx, key, value, "not one of the options");
+    }
+    answer = options[n - 1];
+    return true;
+  }
+  if (failed) {
+    return false;
+  }
+  return remember(ctx, key, Question{key, prompt, options}.ask(), answer);
+}
@@ -0,0 +1,504 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <cerrno>
+#include <chrono>
+#include <fcntl.h>
+#include <functional>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include "util.h"
+
+// input staging: while one episode encodes, the next few are copied from
+// wherever they live (usually a NAS) to local scratch, in big sequential
+// reads, so that a hiccup on the network holds up the copy rather than the
+// encoder. an episode whose copy isn't finished by the time its encode
+// starts just reads the original, and the copy is dropped; a staged copy
+// is deleted as soon as its encode is over.
+//
+// output staging is the same thing the other way round: ffmpeg writes to
+// local scratch (muxing, and the moov rewrite at the end of an mp4, are
+// full of small writes and seeks that crawl over a share) and a transfer
+// thread moves finished outputs to where they belong while the next
+// episode encodes. a delivery is copied next to its destination under a
+// hidden name and renamed into place, so a half written file is never
+// seen under the real one. an encode holds its source's size of the
+// budget from the moment it starts, since that's about the most its output
+// will need on scratch; if what's held and what's waiting to be delivered
+// come to more than the budget, no new encodes are started until they
+// catch up.
+
+// read size for staging, big enough that the share streams
+#define STAGE_BLOCK (8 * 1024 * 1024)
+
+input_stager::input_stager(const std::string &scratch,
+                           unsigned long long budget,
+                           const std::vector<std::string> &paths,
+                           size_t depth)
+    : dir(scratch + "/animachine-" + std::to_string(getpid())),
+      budget(budget), paths(paths), staged(paths.size()),
+      sizes(paths.size(), 0), states(paths.size(), stage_state::Waiting),
+      depth(depth ? depth : 1) {
+  if (!make_directory(dir)) {
+    WARNING("Can't stage sources in %s, reading them in place", dir.c_str());
+    states.assign(paths.size(), stage_state::Gone);
+    return;
+  }
+  INFO("Staging up to %lu sources (%.1f GiB) ahead in %s", this->depth,
+       budget / (1024.0 * 1024 * 1024), dir.c_str());
+  worker = std::thread(&input_stager::run, this);
+}
+
+input_stager::~input_stager() {
+  {
+    std::lock_guard<std::mutex> lock(m);
+    stop = true;
+  }
+  cv.notify_all();
+  if (worker.joinable()) {
+    worker.join();
+  }
+
+  for (size_t i = 0; i < staged.size(); i++) {
+    if (states[i] == stage_state::Ready) {
+      unlink(staged[i].c_str());
+    }
+  }
+  rmdir(dir.c_str());
+}
+
+void input_stager::advance(size_t index) {
+  {
+    std::lock_guard<std::mutex> lock(m);
+    if (index + depth > horizon) {
+      horizon = index + depth;
+    }
+  }
+  cv.notify_all();
+}
+
+std::string input_stager::take(size_t index) {
+  std::lock_guard<std::mutex> lock(m);
+  switch (states[index]) {
+  case stage_state::Ready:
+    DEBUG_INFO("Reading %s from %s", paths[index].c_str(),
+               staged[index].c_str());
+    return staged[index];
+  case stage_state::Waiting:
+  case stage_state::Copying:
+    // too late to help, and it would only compete with the encode
+    DEBUG_INFO("%s wasn't staged in time", paths[index].c_str());
+    states[index] = stage_state::Abandoned;
+    break;
+  default:
+    break;
+  }
+  return "";
+}
+
+void input_stager::release(size_t index) {
+  {
+    std::lock_guard<std::mutex> lock(m);
+    if (states[index] == stage_state::Ready) {
+      unlink(staged[index].c_str());
+      held -= sizes[index];
+      states[index] = stage_state::Gone;
+    } else if (states[index] == stage_state::Waiting ||
+               states[index] == stage_state::Copying) {
+      // skipped before it was ever taken
+      states[index] = stage_state::Abandoned;
+    }
+  }
+  cv.notify_all();
+}
+
+// copy in to out in big blocks until the end, an error, or stop() says so
+static bool copy_blocks(int in, int out, const std::string &from,
+                        const std::string &to,
+                        const std::function<bool()> &stop) {
+  std::vector<char> buf(STAGE_BLOCK);
+
+  for (;;) {
+    if (stop && stop()) {
+      return false;
+    }
+
+    ssize_t n = read(in, buf.data(), buf.size());
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      WARNING("Failed to read \"%s\": %s", from.c_str(), strerror(errno));
+      return false;
+    }
+    if (n == 0) {
+      return true;
+    }
+
+    for (ssize_t done = 0; done < n;) {
+      ssize_t w = write(out, buf.data() + done, n - done);
+      if (w < 0 && errno == EINTR) {
+        continue;
+      }
+      if (w <= 0) {
+        WARNING("Failed to write \"%s\": %s", to.c_str(), strerror(errno));
+        return false;
+      }
+      done += w;
+    }
+  }
+}
+
+bool input_stager::copy(size_t index, const std::string &to) {
+  int in = open(paths[index].c_str(), O_RDONLY | O_CLOEXEC);
+  if (in == -1) {
+    WARNING("Failed to open \"%s\" for staging: %s", paths[index].c_str(),
+            strerror(errno));
+    return false;
+  }
+  int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out == -1) {
+    WARNING("Failed to create \"%s\": %s", to.c_str(), strerror(errno));
+    close(in);
+    return false;
+  }
+
+  // read the whole thing front to back, as far ahead as the kernel likes
+#ifdef __linux__
+  posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+#elif defined(__APPLE__)
+  fcntl(in, F_RDAHEAD, 1);
+#endif
+
+  bool ok = copy_blocks(in, out, paths[index], to, [&] {
+    std::lock_guard<std::mutex> lock(m);
+    return stop || states[index] != stage_state::Copying;
+  });
+
+  // nothing will read the original through our cache again
+#ifdef __linux__
+  posix_fadvise(in, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+  close(in);
+  if (close(out) != 0) {
+    ok = false;
+  }
+  return ok;
+}
+
+void input_stager::run() {
+  for (size_t i = 0; i < paths.size(); i++) {
+    std::string to;
+    {
+      std::unique_lock<std::mutex> lock(m);
+      cv.wait(lock, [&] { return stop || i < horizon; });
+      if (stop) {
+        return;
+      }
+      if (states[i] != stage_state::Waiting) {
+        continue;
+      }
+
+      sizes[i] = file_size(paths[i]);
+      struct statvfs vfs;
+      if (sizes[i] == 0 || sizes[i] > budget ||
+          (statvfs(dir.c_str(), &vfs) == 0 &&
+           static_cast<unsigned long long>(vfs.f_bavail) * vfs.f_frsize <
+               sizes[i])) {
+        DEBUG_INFO("Not staging %s, it doesn't fit", paths[i].c_str());
+        states[i] = stage_state::Gone;
+        continue;
+      }
+
+      // wait for earlier copies to be let go of
+      cv.wait(lock, [&] {
+        return stop || states[i] != stage_state::Waiting ||
+               held + sizes[i] <= budget;
+      });
+      if (stop) {
+        return;
+      }
+      if (states[i] != stage_state::Waiting) {
+        continue;
+      }
+
+      held += sizes[i];
+      states[i] = stage_state::Copying;
+      std::string name = paths[i].substr(paths[i].rfind('/') + 1);
+      to = staged[i] = dir + "/" + std::to_string(i) + "-" + name;
+    }
+
+    // the slow part happens without the lock held. how long it took is
+    // only reported by debug builds
+#ifdef DEBUG
+    auto started = std::chrono::steady_clock::now();
+#endif
+    bool ok = copy(i, to);
+#ifdef DEBUG
+    double elapsed = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - started)
+                         .count();
+#endif
+
+    {
+      std::lock_guard<std::mutex> lock(m);
+      if (ok && states[i] == stage_state::Copying) {
+        states[i] = stage_state::Ready;
+        DEBUG_INFO("Staged %s, %.1f MiB/s", paths[i].c_str(),
+                   sizes[i] / (1024.0 * 1024) / (elapsed > 0 ? elapsed : 1));
+      } else {
+        unlink(to.c_str());
+        held -= sizes[i];
+        states[i] = stage_state::Gone;
+      }
+    }
+    cv.notify_all();
+  }
+}
+
+output_stager::output_stager(const std::string &scratch,
+                             unsigned long long budget)
+    : dir(scratch + "/animachine-" + std::to_string(getpid()) + "-out"),
+      budget(budget) {
+  if (!make_directory(dir)) {
+    WARNING("Can't stage outputs in %s, writing them in place", dir.c_str());
+    dir.clear();
+    return;
+  }
+  INFO("Writing outputs to %s first, with up to %.1f GiB waiting to be "
+       "moved",
+       dir.c_str(), budget / (1024.0 * 1024 * 1024));
+  worker = std::thread(&output_stager::run, this);
+}
+
+output_stager::~output_stager() {
+  {
+    std::lock_guard<std::mutex> lock(m);
+    stop = true;
+  }
+  cv.notify_all();
+  // the worker finishes what's queued first
+  if (worker.joinable()) {
+    worker.join();
+  }
+
+  for (auto &it : locals) {
+    unlink(it.second.c_str());
+    unlink((it.second + ".log").c_str());
+  }
+  if (!dir.empty()) {
+    rmdir(dir.c_str());
+  }
+}
+
+std::string output_stager::local_path(const std::string &output,
+                                      unsigned long long expected) {
+  std::lock_guard<std::mutex> lock(m);
+  if (dir.empty()) {
+    return output;
+  }
+  auto it = locals.find(output);
+  if (it != locals.end()) {
+    return it->second;
+  }
+  reserved[output] = expected;
+  reserved_bytes += expected;
+  std::string name = output.substr(output.rfind('/') + 1);
+  return locals[output] = dir + "/" + std::to_string(count++) + "-" + name;
+}
+
+std::string output_stager::scratch_path(const std::string &output) {
+  std::lock_guard<std::mutex> lock(m);
+  if (dir.empty()) {
+    return "";
+  }
+  std::string name = output.substr(output.rfind('/') + 1);
+  return dir + "/" + std::to_string(count++) + "-" + name;
+}
+
+void output_stager::deliver(const std::string &output, bool ok) {
+  std::string local;
+  {
+    std::lock_guard<std::mutex> lock(m);
+    auto it = locals.find(output);
+    if (it == locals.end()) {
+      return;
+    }
+    // what it really came to is counted from here on, if anything
+    reserved_bytes -= reserved[output];
+    reserved.erase(output);
+    if (ok) {
+      unsigned long long size = file_size(it->second);
+      sizes[output] = size;
+      queued_bytes += size;
+      queue.push_back(output);
+    } else {
+      unlink(it->second.c_str());
+      local = it->second;
+      locals.erase(it);
+    }
+  }
+  if (!ok) {
+    // a log is small, and it's wanted to see what went wrong
+    move_log(local, output);
+    return;
+  }
+  cv.notify_all();
+}
+
+bool output_stager::pending(const std::string &output) {
+  std::lock_guard<std::mutex> lock(m);
+  return sizes.count(output) != 0;
+}
+
+// anything waiting or being written at all counts against a budget of 0.
+// one encode is always let through, however big its output is expected to
+// be, or nothing would ever start.
+bool output_stager::backlogged() {
+  std::lock_guard<std::mutex> lock(m);
+  return (!queue.empty() || !reserved.empty()) &&
+         queued_bytes + reserved_bytes >= budget;
+}
+
+// only called with nothing running, so there's nothing reserved either
+void output_stager::wait_for_room() {
+  std::unique_lock<std::mutex> lock(m);
+  if (!queue.empty() && queued_bytes >= budget) {
+    INFO("Waiting for outputs to be moved before starting more encodes");
+  }
+  cv.wait(lock, [&] { return queue.empty() || queued_bytes < budget; });
+}
+
+bool output_stager::wait_all() {
+  std::unique_lock<std::mutex> lock(m);
+  cv.wait(lock, [&] { return queue.empty(); });
+  bool ok = failures == 0;
+  failures = 0;
+  return ok;
+}
+
+// renamed if it's on the same filesystem, otherwise copied alongside the
+// destination and renamed over it
+bool output_stager::move(const std::string &from, const std::string &to) {
+  if (rename(from.c_str(), to.c_str()) == 0) {
+    return true;
+  }
+  if (errno != EXDEV) {
+    ERROR("Failed to move %s to %s: %s", from.c_str(), to.c_str(),
+          strerror(errno));
+    return false;
+  }
+
+  size_t slash = to.rfind('/');
+  std::string tmp = slash == std::string::npos
+                        ? "." + to + ".partial"
+                        : to.substr(0, slash + 1) + "." +
+                              to.substr(slash + 1) + ".partial";
+
+  int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in == -1) {
+    ERROR("Failed to open \"%s\": %s", from.c_str(), strerror(errno));
+    return false;
+  }
+  int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out == -1) {
+    ERROR("Failed to create \"%s\": %s", tmp.c_str(), strerror(errno));
+    close(in);
+    return false;
+  }
+
+#ifdef __linux__
+  posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  bool ok = copy_blocks(in, out, from, tmp, nullptr);
+  // it has to actually be there before it's given its real name
+  ok = ok && fsync(out) == 0;
+  close(in);
+  ok = close(out) == 0 && ok;
+
+  if (!ok || rename(tmp.c_str(), to.c_str()) != 0) {
+    ERROR("Failed to deliver %s", to.c_str());
+    unlink(tmp.c_str());
+    return false;
+  }
+  unlink(from.c_str());
+  return true;
+}
+
+// ffmpeg's log for an output staged at local goes beside the output, if
+// it wrote one
+void output_stager::move_log(const std::string &local,
+                             const std::string &output) {
+  std::string log = local + ".log";
+  if (access(log.c_str(), F_OK) == 0) {
+    move(log, output + ".log");
+  }
+}
+
+void output_stager::run() {
+  for (;;) {
+    std::string output;
+    std::string local;
+    {
+      std::unique_lock<std::mutex> lock(m);
+      cv.wait(lock, [&] { return stop || !queue.empty(); });
+      if (queue.empty()) {
+        return;
+      }
+      output = queue.front();
+      local = locals[output];
+    }
+
+    // the slow part happens without the lock held. how long it took is
+    // only reported by debug builds
+#ifdef DEBUG
+    auto started = std::chrono::steady_clock::now();
+#endif
+    bool ok = move(local, output);
+    if (ok) {
+      move_log(local, output);
+    }
+#ifdef DEBUG
+    double elapsed = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - started)
+                         .count();
+#endif
+
+    {
+      std::lock_guard<std::mutex> lock(m);
+      if (ok) {
+        DEBUG_INFO("Delivered %s, %.1f MiB/s", output.c_str(),
+                   sizes[output] / (1024.0 * 1024) /
+                       (elapsed > 0 ? elapsed : 1));
+      } else {
+        // left where it is, so it isn't lost
+        ERROR("Keeping %s in %s", output.c_str(), local.c_str());
+        failures++;
+      }
+      queued_bytes -= sizes[output];
+      sizes.erase(output);
+      locals.erase(output);
+      queue.pop_front();
+    }
+    cv.notify_all();
+  }
+}
@@ -20,24 +20,19 @@
 
 #include "util.h"
 
-bool populate_text_data(text_info &text, size_t index) {
-  char *endptr;
-  char *cstring;
-
-  String t_index = mi_get_string(Stream_Text, index, "Title");
-  String t_format = mi_get_string(Stream_Text, index, "Format");
-  String t_lang = mi_get_string(Stream_Text, index, "Language");
-  bool t_default = mi_get_string(Stream_Text, index, "Default") == "Yes" ? true : false;
+bool populate_text_data(const mi_fields &fields, text_info &text,
+                        size_t index) {
+  const String &t_index = fields[TF_TITLE];
+  const String &t_format = fields[TF_FORMAT];
+  const String &t_lang = fields[TF_LANGUAGE];
+  bool t_default = fields[TF_DEFAULT] == "Yes" ? true : false;
 
   text.index = index;
   text.info = !t_index.empty() ? t_index : "-";
   text.format = !t_format.empty() ? t_format : "-";
   text.lang = !t_lang.empty() ? t_lang : "-";
   text.is_default = t_default;
-  text.is_bluray =
-      mi_get_string(Stream_Text, index, "OriginalSourceMedium") == "Blu-ray"
-          ? 1
-          : 0;
+  text.is_bluray = fields[TF_SOURCE] == "Blu-ray" ? 1 : 0;
 
   return true;
 }
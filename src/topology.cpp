@@ -0,0 +1,308 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <dirent.h>
+#include <fstream>
+#include <map>
+#include <set>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "util.h"
+
+// libx265 sizes its worker pools per NUMA node and otherwise grabs every
+// core it can see. when several encodes share a box that means they all
+// fight over the same L3, so we carve the machine up ourselves: each
+// concurrent job gets a contiguous run of physical cores (SMT siblings kept
+// together), pinned via the spawning thread's affinity, with matching
+// pools=/frame-threads= values so x265 doesn't oversubscribe its slice.
+
+static bool read_sysfs_int(const std::string &path, int &value) {
+  std::ifstream in(path);
+  if (!in) {
+    return false;
+  }
+  in >> value;
+  return !in.fail();
+}
+
+static bool read_sysfs_string(const std::string &path, std::string &value) {
+  std::ifstream in(path);
+  if (!in) {
+    return false;
+  }
+  std::getline(in, value);
+  return true;
+}
+
+// parse the kernel's cpu list format, e.g. "0-3,8-11,16"
+static std::vector<int> parse_cpu_list(const std::string &list) {
+  std::vector<int> cpus;
+  std::istringstream in(list);
+  std::string range;
+
+  while (std::getline(in, range, ',')) {
+    if (range.empty()) {
+      continue;
+    }
+    size_t dash = range.find('-');
+    char *endptr = nullptr;
+    int first = strtol(range.c_str(), &endptr, 10);
+    int last = first;
+    if (dash != std::string::npos) {
+      last = strtol(range.c_str() + dash + 1, &endptr, 10);
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+
+  return cpus;
+}
+
+// the first cpu listed as sharing this cpu's last-level (L3) cache, or -1
+static int read_l3_domain(const std::string &cpu_dir) {
+  for (int index = 0;; index++) {
+    std::string cache_dir = cpu_dir + "/cache/index" + std::to_string(index);
+    int level = 0;
+    if (!read_sysfs_int(cache_dir + "/level", level)) {
+      return -1;
+    }
+    if (level != 3) {
+      continue;
+    }
+    std::string shared;
+    if (!read_sysfs_string(cache_dir + "/shared_cpu_list", shared)) {
+      return -1;
+    }
+    std::vector<int> cpus = parse_cpu_list(shared);
+    return cpus.empty() ? -1 : *std::min_element(cpus.begin(), cpus.end());
+  }
+}
+
+// cpuN has a nodeM symlink when the kernel knows about NUMA
+static int read_numa_node(const std::string &cpu_dir) {
+  DIR *dir = opendir(cpu_dir.c_str());
+  if (!dir) {
+    return -1;
+  }
+
+  int node = -1;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    if (!strncmp(entry->d_name, "node", 4) && isdigit(entry->d_name[4])) {
+      node = atoi(entry->d_name + 4);
+      break;
+    }
+  }
+
+  closedir(dir);
+  return node;
+}
+
+bool read_cpu_topology(cpu_topology &topo, const std::string &root) {
+  std::string online;
+  if (!read_sysfs_string(root + "/online", online)) {
+    DEBUG_INFO("No cpu topology available under %s", root.c_str());
+    return false;
+  }
+
+  topo = cpu_topology();
+  std::set<int> packages, nodes, domains;
+  std::set<std::pair<int, int>> cores;
+
+  for (int id : parse_cpu_list(online)) {
+    std::string cpu_dir = root + "/cpu" + std::to_string(id);
+    cpu_info cpu;
+    cpu.id = id;
+
+    if (!read_sysfs_int(cpu_dir + "/topology/physical_package_id",
+                        cpu.package) ||
+        !read_sysfs_int(cpu_dir + "/topology/core_id", cpu.core)) {
+      ERROR("Failed to read topology for cpu %d", id);
+      return false;
+    }
+
+    // fall back to one node per socket and one L3 per socket
+    cpu.node = read_numa_node(cpu_dir);
+    if (cpu.node < 0) {
+      cpu.node = cpu.package;
+    }
+    cpu.l3 = read_l3_domain(cpu_dir);
+    if (cpu.l3 < 0) {
+      cpu.l3 = -1 - cpu.package;
+    }
+
+    packages.insert(cpu.package);
+    nodes.insert(cpu.node);
+    domains.insert(cpu.l3);
+    cores.insert(std::make_pair(cpu.package, cpu.core));
+    topo.cpus.push_back(cpu);
+  }
+
+  if (topo.cpus.empty()) {
+    return false;
+  }
+
+  topo.sockets = packages.size();
+  topo.nodes = *nodes.rbegin() + 1;
+  topo.l3_domains = domains.size();
+  topo.cores = cores.size();
+
+  DEBUG_INFO("Topology: %lu sockets, %lu cores, %lu threads, %lu L3 domains",
+             topo.sockets, topo.cores, topo.cpus.size(), topo.l3_domains);
+  return true;
+}
+
+// roughly what x265 itself picks for a given number of worker threads
+static size_t frame_threads_for(size_t threads) {
+  if (threads >= 32)
+    return 5;
+  if (threads >= 16)
+    return 4;
+  if (threads >= 8)
+    return 3;
+  if (threads >= 4)
+    return 2;
+  return 1;
+}
+
+bool partition_cpus(const cpu_topology &topo, size_t count,
+                    std::vector<cpu_slice> &slices) {
+  slices.clear();
+  if (count == 0 || topo.cpus.empty()) {
+    return false;
+  }
+
+  // group SMT siblings into physical cores, ordered so that cores sharing
+  // a node and an L3 sit next to each other
+  std::map<std::vector<int>, std::vector<int>> by_core;
+  for (auto &cpu : topo.cpus) {
+    std::vector<int> key = {cpu.node, cpu.l3, cpu.package, cpu.core};
+    by_core[key].push_back(cpu.id);
+  }
+
+  if (by_core.size() < count) {
+    WARNING("Only %lu physical cores for %lu jobs, not partitioning",
+            by_core.size(), count);
+    return false;
+  }
+
+  std::vector<std::pair<int, std::vector<int>>> physical;
+  for (auto &core : by_core) {
+    physical.push_back(std::make_pair(core.first[0], core.second));
+  }
+
+  slices.resize(count);
+  size_t start = 0;
+  for (size_t i = 0; i < count; i++) {
+    // spread any remainder over the first few slices
+    size_t share = physical.size() / count + (i < physical.size() % count);
+    std::vector<size_t> per_node(topo.nodes, 0);
+
+    for (size_t c = start; c < start + share; c++) {
+      for (int id : physical[c].second) {
+        slices[i].cpus.push_back(id);
+        per_node[physical[c].first]++;
+      }
+    }
+    start += share;
+
+    std::string pools;
+    for (size_t node = 0; node < per_node.size(); node++) {
+      if (node) {
+        pools += ",";
+      }
+      pools += per_node[node] ? std::to_string(per_node[node]) : "-";
+    }
+
+    slices[i].x265_params =
+        "pools=" + pools + ":frame-threads=" +
+        std::to_string(frame_threads_for(slices[i].cpus.size()));
+
+    DEBUG_INFO("Slice %lu: %lu cpus, %s", i, slices[i].cpus.size(),
+               slices[i].x265_params.c_str());
+  }
+
+  return true;
+}
+
+// add a slice's pools/frame-threads to an ffmpeg argument list, unless the
+// user already picked their own thread layout
+void apply_cpu_slice(std::vector<std::string> &args, const cpu_slice &slice) {
+  auto it = std::find(args.begin(), args.end(), "-x265-params");
+  if (it != args.end() && it + 1 != args.end()) {
+    if ((it + 1)->find("pools=") != std::string::npos ||
+        (it + 1)->find("frame-threads=") != std::string::npos) {
+      return;
+    }
+    *(it + 1) += ":" + slice.x265_params;
+    return;
+  }
+
+  it = std::find(args.begin(), args.end(), "libx265");
+  if (it != args.end()) {
+    args.insert(it + 1, {"-x265-params", slice.x265_params});
+  }
+}
+
+// posix_spawn children inherit the calling thread's affinity, so we swap
+// ours for the slice's around the spawn and put it back afterwards
+#ifdef __linux__
+static thread_local cpu_set_t saved_affinity;
+static thread_local bool pinned = false;
+#endif
+
+bool pin_spawning_thread(const cpu_slice &slice) {
+#ifdef __linux__
+  if (sched_getaffinity(0, sizeof(saved_affinity), &saved_affinity) != 0) {
+    ERROR("sched_getaffinity failed: %s", strerror(errno));
+    return false;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int id : slice.cpus) {
+    CPU_SET(id, &set);
+  }
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+    ERROR("sched_setaffinity failed: %s", strerror(errno));
+    return false;
+  }
+  pinned = true;
+  return true;
+#else
+  return false;
+#endif
+}
+
+void unpin_spawning_thread() {
+#ifdef __linux__
+  if (pinned) {
+    sched_setaffinity(0, sizeof(saved_affinity), &saved_affinity);
+    pinned = false;
+  }
+#endif
+}
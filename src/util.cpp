@@ -19,34 +19,14 @@
 // SOFTWARE.
 
 #include <algorithm>
+#include <cerrno>
 #include <cstddef>
 #include <iomanip>
 #include <limits>
 #include <string>
-#include <sys/wait.h>
-#include <unistd.h>
-#include <spawn.h>
 
-#include "inquirer.h"
 #include "util.h"
 
-extern char **environ;
-
-MediaInfo gMi;
-
-// so this is very sketchy. often times I'll encounter
-// a blu-ray with wack dts and pts (decompression / presentation time stamp)
-// this seems to happen right at the end and ffmpeg still spits out a valid
-// video file, so we can just ignore it if the user specifies we should.
-// it is then at their descretion to determine if the output is suitable.
-
-bool FF_IGNORE_PAWE = 0;
-bool FF_CROP = 0;
-char MAX_RETRIES = 0;
-char ENTRY_OFFSET = 0;
-
-using namespace alx;
-
 const std::string g_art = R"(
 
 
@@ -83,18 +63,90 @@ const std::vector<std::string> g_enc_presets = {
     "ultrafast", "superfast", "veryfast", "faster",   "fast",
     "medium",    "slow",      "slower",   "veryslow", "placebo"};
 
-std::string g_program = "";
+String mi_get_string(job_context &ctx, stream_t kind, size_t index,
+                     const String &param) {
+  return ctx.mi.Get(kind, index, param, Info_Text);
+}
+
+String mi_get_measure(job_context &ctx, stream_t kind, size_t index,
+                      const String &param) {
+  return ctx.mi.Get(kind, index, param, Info_Measure_Text);
+}
 
-String mi_get_string(stream_t kind, size_t index, const String &param) {
-  return gMi.Get(kind, index, param, Info_Text);
+void mi_stream_count(job_context &ctx, stream_t type, size_t &value) {
+  value = ctx.mi.Count_Get(type);
 }
 
-String mi_get_measure(stream_t kind, size_t index, const String &param) {
-  return gMi.Get(kind, index, param, Info_Measure_Text);
+// every field the populate_*_data() functions need, for every stream, in one
+// Inform() call instead of a Get() per field. fields and streams are split
+// with the ASCII unit/record separators, which never show up in titles. the
+// order of each section must match the *Field enums in util.h.
+#define MI_FS "\x1f"
+#define MI_RS "\x1e"
+static const String MI_TEMPLATE =
+    "Video;V" MI_FS "%Format%" MI_FS "%Width%" MI_FS "%Height%" MI_FS
+    "%OriginalSourceMedium%" MI_FS "%Duration%" MI_FS "%BitRate%" MI_RS "\r\n"
+    "Audio;A" MI_FS "%Format%" MI_FS "%Language%" MI_FS "%Channel(s)%" MI_FS
+    "%OriginalSourceMedium%" MI_FS "%Duration%" MI_FS "%BitRate%" MI_RS "\r\n"
+    "Text;T" MI_FS "%Title%" MI_FS "%Format%" MI_FS "%Language%" MI_FS
+    "%Default%" MI_FS "%OriginalSourceMedium%" MI_RS "\r\n";
+
+bool mi_inform_streams(job_context &ctx, mi_records &out) {
+  ctx.mi.Option("Inform", MI_TEMPLATE);
+  String report = ctx.mi.Inform();
+  ctx.mi.Option("Inform", "");
+
+  return parse_inform_report(report, out);
 }
 
-void mi_stream_count(stream_t type, size_t &value) {
-  value = gMi.Count_Get(type);
+// split what MediaInfo made of MI_TEMPLATE back into per-stream records
+bool parse_inform_report(const String &report, mi_records &out) {
+  out.video.clear();
+  out.audio.clear();
+  out.text.clear();
+
+  size_t start = 0;
+  while (start < report.size()) {
+    size_t end = report.find(MI_RS, start);
+    if (end == String::npos) {
+      end = report.size();
+    }
+
+    mi_fields fields;
+    size_t pos = start;
+    for (;;) {
+      size_t sep = report.find(MI_FS, pos);
+      if (sep == String::npos || sep > end) {
+        fields.push_back(report.substr(pos, end - pos));
+        break;
+      }
+      fields.push_back(report.substr(pos, sep - pos));
+      pos = sep + 1;
+    }
+    start = end + 1;
+
+    // MediaInfo may put line breaks between sections
+    String &tag = fields[0];
+    tag.erase(0, tag.find_first_not_of("\r\n"));
+
+    if (tag == "V" && fields.size() == VF_COUNT + 1) {
+      fields.erase(fields.begin());
+      out.video.push_back(fields);
+    } else if (tag == "A" && fields.size() == AF_COUNT + 1) {
+      fields.erase(fields.begin());
+      out.audio.push_back(fields);
+    } else if (tag == "T" && fields.size() == TF_COUNT + 1) {
+      fields.erase(fields.begin());
+      out.text.push_back(fields);
+    } else if (!tag.empty() || fields.size() > 1) {
+      ERROR("Unexpected MediaInfo record with %lu fields", fields.size());
+      return false;
+    }
+  }
+
+  DEBUG_INFO("Inform gave %lu video, %lu audio, %lu text records",
+             out.video.size(), out.audio.size(), out.text.size());
+  return true;
 }
 
 void print_rainbow_ascii(const std::string &text) {
@@ -148,107 +200,47 @@ bool cast_to_size(const String &str, size_t &dest) {
   return true;
 }
 
-// this could be done better, if I rethink the structures this can
-// easily be templated
-void *retrieve_stream_x(streams *inf, size_t index, String type) {
-  if (type == "audio") {
-    audio_info *curr = inf->audio.ptr;
-    size_t curr_i = 0;
-    while (curr && curr_i < index) {
-      curr = curr->next;
-      curr_i++;
-    }
-    if (!curr) {
-      ERROR("Tried to index past end of audio");
-      return nullptr;
-    }
-    return (void *)curr;
-  }
-  if (type == "text") {
-    text_info *curr = inf->text.ptr;
-    size_t curr_i = 0;
-    while (curr && curr_i < index) {
-      curr = curr->next;
-      curr_i++;
-    }
-    if (!curr) {
-      ERROR("Tried to index past end of text");
-      return nullptr;
-    }
-    return (void *)curr;
+bool get_streams(job_context &ctx, struct streams &streams, bool verbose) {
+  mi_records records;
+  if (!mi_inform_streams(ctx, records)) {
+    return false;
   }
-  ERROR("\"%s\" is not a valid type", type.c_str());
-  return nullptr;
-}
 
-bool get_streams(struct streams &streams) {
-
-  struct video_info *video_head = NULL;
-  struct audio_info *audio_head = NULL;
-  struct text_info *text_head = NULL;
+  return populate_streams(records, streams, verbose);
+}
 
+bool populate_streams(const mi_records &records, struct streams &streams,
+                      bool verbose) {
   bool set = true;
 
-  INFO("Parsing video information");
-  video_info *tail_v = video_head;
-  for (size_t i = 0; i < streams.video.cnt; i++) {
-    if (tail_v == NULL) {
-      if (!insert_new_item(video_head)) {
-        return false;
-      }
-      tail_v = video_head;
-    } else {
-      if (!insert_new_item(tail_v->next)) {
-        return false;
-      }
-      tail_v->next->prev = tail_v;
-      tail_v = tail_v->next;
-    }
-    set = populate_video_data(*tail_v, i);
-    stream_print(*tail_v);
-  }
+  streams.clear();
 
-  INFO("Parsing audio information");
-  audio_info *tail_a = audio_head;
-  for (size_t i = 0; i < streams.audio.cnt; i++) {
-    if (tail_a == NULL) {
-      if (!insert_new_item(audio_head)) {
-        return false;
-      }
-      tail_a = audio_head;
-    } else {
-      if (!insert_new_item(tail_a->next)) {
-        return false;
-      }
-      tail_a->next->prev = tail_a;
-      tail_a = tail_a->next;
-    }
-    set = populate_audio_data(*tail_a, i);
-    stream_print(*tail_a);
+  if (verbose)
+    INFO("Parsing video information");
+  streams.video.resize(records.video.size());
+  for (size_t i = 0; i < streams.video.size(); i++) {
+    set = populate_video_data(records.video[i], streams.video[i]) && set;
+    if (verbose)
+      stream_print(streams.video[i]);
   }
 
-  INFO("Parsing text information");
-  text_info *tail_t = text_head;
-  for (size_t i = 0; i < streams.text.cnt; i++) {
-    if (tail_t == NULL) {
-      if (!insert_new_item(text_head)) {
-        return false;
-      }
-      tail_t = text_head;
-    } else {
-      if (!insert_new_item(tail_t->next)) {
-        return false;
-      }
-      tail_t->next->prev = tail_t;
-      tail_t = tail_t->next;
-    }
-    set = populate_text_data(*tail_t, i);
-    stream_print(*tail_t);
+  if (verbose)
+    INFO("Parsing audio information");
+  streams.audio.resize(records.audio.size());
+  for (size_t i = 0; i < streams.audio.size(); i++) {
+    set = populate_audio_data(records.audio[i], streams.audio[i], i) && set;
+    if (verbose)
+      stream_print(streams.audio[i]);
   }
 
-  streams.text.ptr = text_head;
-  streams.video.ptr = video_head;
-  streams.audio.ptr = audio_head;
+  if (verbose)
+    INFO("Parsing text information");
+  streams.text.resize(records.text.size());
+  for (size_t i = 0; i < streams.text.size(); i++) {
+    set = populate_text_data(records.text[i], streams.text[i], i) && set;
+    if (verbose)
+      stream_print(streams.text[i]);
+  }
 
   if (!set) {
     ERROR("Failed to populate one or more streams");
@@ -275,6 +267,48 @@ char get_from_argv(int option_index, char** argv){
   return result;
 }
 
+// the count following the option at index, e.g. --jobs 8. it has to be a
+// plain decimal between 1 and max, anything else is refused rather than
+// truncated or wrapped.
+bool size_from_argv(int index, char **argv, size_t max, size_t &out) {
+  const char *arg = argv[index + 1];
+  char *endptr;
+  errno = 0;
+  unsigned long long num = strtoull(arg, &endptr, 10);
+
+  if (endptr == arg || *arg == '-' || *arg == '+') {
+    ERROR("%s: \"%s\" is not a number", argv[index], arg);
+  } else if (*endptr != '\0') {
+    ERROR("%s: extra characters at the end of \"%s\"", argv[index], arg);
+  } else if (errno == ERANGE || num == 0 || num > max) {
+    ERROR("%s must be between 1 and %lu", argv[index], max);
+  } else {
+    out = static_cast<size_t>(num);
+    return true;
+  }
+  return false;
+}
+
+// the same for a signed value, e.g. --priority -5
+bool long_from_argv(int index, char **argv, long &out) {
+  const char *arg = argv[index + 1];
+  char *endptr;
+  errno = 0;
+  long num = strtol(arg, &endptr, 10);
+
+  if (endptr == arg) {
+    ERROR("%s: \"%s\" is not a number", argv[index], arg);
+  } else if (*endptr != '\0') {
+    ERROR("%s: extra characters at the end of \"%s\"", argv[index], arg);
+  } else if (errno == ERANGE) {
+    ERROR("%s: \"%s\" is out of range", argv[index], arg);
+  } else {
+    out = num;
+    return true;
+  }
+  return false;
+}
+
 bool get_answer_index(String &a, std::vector<String> &arr, size_t &index) {
   auto it = std::find(arr.begin(), arr.end(), a);
 
@@ -290,7 +324,7 @@ bool get_answer_index(String &a, std::vector<String> &arr, size_t &index) {
 
 // TODO: make this more elegant
 // TODO: allow rdoq selection
-void print_preset_options() {
+void print_preset_options(const job_context &ctx, size_t height) {
 
   const std::string bs = "\033[1m";
   const std::string brs = "\033[0m";
@@ -321,44 +355,57 @@ void print_preset_options() {
             << brs << std::endl;
   std::cout << "    7. " << gpresets[6] << " [crf = 14]" << std::endl
             << std::endl;
+
+  print_preset_results(ctx.preset_results, height);
 }
 
-bool build_options(ffmpeg_opts &ff_opts) {
+bool build_options(job_context &ctx, const std::string &path,
+                   ffmpeg_opts &ff_opts) {
 
-  audio_info *this_audio = nullptr;
-  text_info *this_text = nullptr;
   struct streams inf; // allocate with defaults
   String answer;
   char *endptr;
 
-  mi_stream_count(Stream_Video, inf.video.cnt);
-  mi_stream_count(Stream_Audio, inf.audio.cnt);
-  mi_stream_count(Stream_Text, inf.text.cnt);
+  if (!probe_streams(ctx, path, inf)) {
+    ERROR("Failed to get streams");
+    return false;
+  }
 
-  DEBUG_INFO("%s", mi_get_string(Stream_Text, 0, "CodecID/Info").c_str());
+  if (inf.video.empty()) {
+    ERROR("File appears to have no video stream");
+    return false;
+  }
 
 #ifdef DEBUG
 
   DEBUG_INFO("Detected the following streams:\n");
-  std::cout << "  Video: " << inf.video.cnt << std::endl;
-  std::cout << "  Audio: " << inf.audio.cnt << std::endl;
-  std::cout << "  Text: " << inf.text.cnt << std::endl << std::endl;
+  std::cout << "  Video: " << inf.video.size() << std::endl;
+  std::cout << "  Audio: " << inf.audio.size() << std::endl;
+  std::cout << "  Text: " << inf.text.size() << std::endl << std::endl;
 #endif
-  if (!get_streams(inf)) {
-    ERROR("Failed to get streams");
-    return false;
-  };
+  for (auto &v : inf.video) {
+    stream_print(v);
+  }
+  for (auto &a : inf.audio) {
+    stream_print(a);
+  }
+  for (auto &t : inf.text) {
+    stream_print(t);
+  }
 
   DEBUG_INFO("Got streams");
   std::vector<std::string> audio_options =
-      extract_fields(inf.audio.ptr, inf.audio.cnt);
+      extract_fields(inf.audio);
 
   if (audio_options.empty()) {
     ERROR("Failed to get audio options");
     return false;
   }
 
-  answer = Question{"audio", "Which audio stream?", audio_options}.ask();
+  if (!ask_choice(ctx, "audio", "Which audio stream?", audio_options,
+                  answer)) {
+    return false;
+  }
 
   // get the audio track value
   size_t audio_track;
@@ -368,55 +415,59 @@ bool build_options(ffmpeg_opts &ff_opts) {
 
   INFO("Will use audio stream %lu", audio_track);
 
-  this_audio = reinterpret_cast<audio_info *>(
-      retrieve_stream_x(&inf, audio_track, "audio"));
-
-  if (!this_audio) {
+  if (audio_track >= inf.audio.size()) {
     ERROR("Failed to retrieve audio track at index %lu", audio_track);
     return false;
   }
+  const audio_info &this_audio = inf.audio[audio_track];
   ff_opts.audio.index = audio_track;
 
-  answer = Question{"should_copy", "Would you like to copy this audio track?",
-                    Type::yesNo}
-               .ask();
+  if (!ask_yes_no(ctx, "should_copy",
+                  "Would you like to copy this audio track?", answer)) {
+    return false;
+  }
 
   if (answer == "yes") {
     ff_opts.audio.should_copy = true;
   }
 
   if (!ff_opts.audio.should_copy) {
-    answer = Question{"audio_codec", "Which codec should we use?",
-                      std::vector<std::string>{"libopus", "aac"}}
-                 .ask();
+    if (!ask_choice(ctx, "audio_codec", "Which codec should we use?",
+                    std::vector<std::string>{"libopus", "aac"}, answer)) {
+      return false;
+    }
 
     ff_opts.audio.codec = answer;
   }
 
-  if (this_audio->channel_count > 2 && !ff_opts.audio.should_copy) {
+  if (this_audio.channel_count > 2 && !ff_opts.audio.should_copy) {
     INFO("Detected audio has more than two channels");
-    answer = Question{"should_downmix",
-                      "The audio stream has more than two channels, would you "
-                      "like to downmix?",
-                      Type::yesNo}
-                 .ask();
+    if (!ask_yes_no(ctx, "should_downmix",
+                    "The audio stream has more than two channels, would "
+                    "you like to downmix?",
+                    answer)) {
+      return false;
+    }
 
     if (answer == "yes")
       ff_opts.audio.should_downsample = true;
   }
 
-  if (inf.text.cnt != 0) {
-    std::vector<std::string> text_options =
-        extract_fields(inf.text.ptr, inf.text.cnt);
+  if (!inf.text.empty()) {
+    std::vector<std::string> text_options = extract_fields(inf.text);
 
-    answer =
-        Question{"use_text", "Would you like to encode subtitles?", Type::yesNo}
-            .ask();
+    if (!ask_yes_no(ctx, "use_text", "Would you like to encode subtitles?",
+                    answer)) {
+      return false;
+    }
 
     if (answer == "yes") {
       ff_opts.text.should_encode_subs = true;
 
-      answer = Question{"text", "Which text stream?", text_options}.ask();
+      if (!ask_choice(ctx, "text", "Which text stream?", text_options,
+                      answer)) {
+        return false;
+      }
 
       // get text track value;
       size_t text_track;
@@ -428,35 +479,35 @@ bool build_options(ffmpeg_opts &ff_opts) {
 
       ff_opts.text.index = text_track;
 
-      this_text = reinterpret_cast<text_info *>(
-          retrieve_stream_x(&inf, text_track, "text"));
-
-      if (!this_text) {
+      if (text_track >= inf.text.size()) {
         ERROR("Failed to retrieve text track at index %lu", text_track);
         return false;
       }
-      if (this_text->format == "PGS") {
+      const text_info &this_text = inf.text[text_track];
+
+      if (this_text.format == "PGS") {
         ff_opts.text.codec = TextCodec::PGS;
-      } else if (this_text->format == "ASS") {
+      } else if (this_text.format == "ASS") {
         ff_opts.text.codec = TextCodec::ASS;
-      } else if (this_text->format == "VobSub") {
+      } else if (this_text.format == "VobSub") {
         ff_opts.text.codec = TextCodec::VobSub;
       } else {
-        ERROR("Currently unsupported codec \"%s\"", this_text->format.c_str());
+        ERROR("Currently unsupported codec \"%s\"", this_text.format.c_str());
         return false;
       }
     }
   }
 
-  if (inf.video.ptr->is_bluray) {
+  if (inf.video[0].is_bluray) {
     INFO("This might be a bluray track. It can be harder to determine\n"
          "    which sub track is right to use, so it may be worth\n"
          "    doing a test run.");
   }
 
-  answer = Question{"should_use_opts", "Would you like to specify x265 opts?",
-                    Type::yesNo}
-               .ask();
+  if (!ask_yes_no(ctx, "should_use_opts",
+                  "Would you like to specify x265 opts?", answer)) {
+    return false;
+  }
 
   DEBUG_INFO("User gave answer: %s", answer.c_str());
   if (answer == "yes") {
@@ -464,12 +515,11 @@ bool build_options(ffmpeg_opts &ff_opts) {
 
     do {
       INFO("Here are the available options for x265-opts:");
-      print_preset_options();
+      print_preset_options(ctx, inf.video[0].ds.height);
 
-      if (!cast_to_size(
-              (Question{"opts", "Please choose an option [1-7]", Type::integer}
-                   .ask()),
-              opt)) {
+      if (!ask_number(ctx, "opts", "Please choose an option [1-7]", 1, 7,
+                      answer) ||
+          !cast_to_size(answer, opt)) {
         return false;
       };
 
@@ -480,37 +530,51 @@ bool build_options(ffmpeg_opts &ff_opts) {
     ff_opts.video.h265_opts = gpresets[opt - 1];
   }
 
+  // with a target, the CRF is searched for once the preset is known
   size_t crf = 52;
-  do {
-    if (!cast_to_size(
-            Question{"crf", "Please enter a crf value: [0-51]", Type::integer}
-                .ask(),
-            crf)) {
+  while (ctx.crf_search.metric.empty() && crf > 51) {
+    if (!ask_number(ctx, "crf", "Please enter a crf value: [0-51]", 0, 51,
+                    answer) ||
+        !cast_to_size(answer, crf)) {
       return false;
     }
     if (crf > 51) {
       WARNING("Please enter a valid CRF value.");
     }
-  } while (crf > 51);
+  }
 
   ff_opts.video.crf = crf;
 
-  if (inf.video.ptr->dr.duration > 300) {
-    answer = Question{"should_test",
-                      "Would you like to perform a 60 second test encode?",
-                      Type::yesNo}
-                 .ask();
+  if (inf.video[0].dr.duration > 300) {
+    if (!ask_yes_no(ctx, "should_test",
+                    "Would you like to perform a 60 second test encode? "
+                    "(sampled from across the title)",
+                    answer)) {
+      return false;
+    }
     if (answer == "yes") {
       ff_opts.should_test = true;
     }
   } // seconds
 
-  answer =
-      Question{"preset", "Please choose an encoding preset:", g_enc_presets}
-          .ask();
+  if (!ask_choice(ctx, "preset", "Please choose an encoding preset:",
+                  g_enc_presets, answer)) {
+    return false;
+  }
 
   ff_opts.video.preset = answer;
 
+  // the crop has to be known before any samples are taken
+  ff_opts.video.crop.clear();
+  if (ctx.crop && !detect_crop(ctx, path, inf.video[0].ds.width,
+                               inf.video[0].ds.height, ff_opts.video.crop)) {
+    return false;
+  }
+
+  if (!ctx.crf_search.metric.empty() && !search_crf(ctx, path, ff_opts)) {
+    return false;
+  }
+
   inf.clear();
 
   return true;
@@ -526,126 +590,63 @@ std::string format_episode(int curr, int ep_max) {
   return formatted.str();
 }
 
-bool process_spawn_ffmpeg(std::vector<char*>& c_args)
-{
-    // Force colour in the child’s log output
-    if (setenv("AV_LOG_FORCE_COLOR", "1", 1) != 0) {
-        ERROR("setenv failed");
-        return false;
-    }
-
-    int pipefd[2];
-    if (pipe(pipefd) == -1) {
-        ERROR("pipe creation failed");
-        return false;
-    }
-
-    posix_spawn_file_actions_t actions;
-    posix_spawn_file_actions_init(&actions);
-
-    // Child:   dup pipefd[1] → stdout/stderr, then close both pipe ends
-    posix_spawn_file_actions_adddup2 (&actions, pipefd[1], STDOUT_FILENO);
-    posix_spawn_file_actions_adddup2 (&actions, pipefd[1], STDERR_FILENO);
-    posix_spawn_file_actions_addclose(&actions, pipefd[0]);
-    posix_spawn_file_actions_addclose(&actions, pipefd[1]);
-
-    pid_t pid;
-    int rc = posix_spawn(&pid,
-                         g_program.c_str(),
-                         &actions,
-                         nullptr,
-                         c_args.data(),   
-                         environ);        
-    posix_spawn_file_actions_destroy(&actions);
-    close(pipefd[1]);
-
-    if (rc != 0) {
-        ERROR("posix_spawn failed: %s", strerror(rc));
-        close(pipefd[0]);
-        return false;
-    }
-
-    INFO("ffmpeg logs:");
-    char buf[256];
-    ssize_t n;
-    while ((n = read(pipefd[0], buf, sizeof(buf) - 1)) > 0) {
-        buf[n] = '\0';
-        std::cout << buf;
-    }
-    close(pipefd[0]);
-
-    int status;
-    waitpid(pid, &status, 0);
-
-    if (WIFEXITED(status)) {
-        int code = WEXITSTATUS(status);
-        if (code == 176 && FF_IGNORE_PAWE) return true;
-        if (code != 0) {
-            ERROR("ffmpeg returned %d", code);
-            return false;
-        }
-        INFO("ffmpeg exited with code: %d", code);
-        return true;
-    }
-    if (WIFSIGNALED(status)) {
-        ERROR("ffmpeg killed by signal %d", WTERMSIG(status));
-        return false;
+// split a comma separated argument, dropping empty entries
+std::vector<std::string> split_list(const std::string &in) {
+  std::vector<std::string> out;
+  std::istringstream items(in);
+  std::string item;
+  while (std::getline(items, item, ',')) {
+    if (!item.empty()) {
+      out.push_back(item);
     }
-    WARNING("ffmpeg terminated abnormally");
-    return false;
+  }
+  return out;
 }
 
-bool prep_and_call_ffmpeg(std::string &target, std::string &output,
-                          ffmpeg_opts &opts) {
-
-  std::vector<std::string> args = {};
-
-  if (g_program.empty()) {
-    g_program = which("ffmpeg");
-    if (g_program.empty()) {
+bool resolve_ffmpeg(job_context &ctx) {
+  if (ctx.program.empty()) {
+    ctx.program = which("ffmpeg");
+    if (ctx.program.empty()) {
       ERROR("Could not find ffmpeg on PATH");
       return false;
     }
   }
+  return true;
+}
 
-  if (FF_CROP && !opts.text.should_encode_subs) {
-    args.insert(args.end(), {"-filter_complex", 
-                             "[0:v]cropdetect=limit=24:round=2:reset=10,crop=w=ih*4/3:h=ih:x=(iw-ih*4/3)/2:y=0[v]",
-                             "-map", "[v]"});
-  }
+// assemble the -filter_complex graph that burns in subs and/or crops. seek
+// is where the input was opened with an input-side -ss, and trim is how much
+// decoded pre-roll gets thrown away once the subs have been drawn. graph is
+// left empty when the video can be mapped straight through.
+bool build_video_filter(const std::string &target, const ffmpeg_opts &opts,
+                        double seek, double trim, std::string &graph) {
+  std::string inputs = "[0:v]";
+  std::vector<std::string> chain;
+
+  graph.clear();
 
   if (opts.text.should_encode_subs) {
-    std::string filter;
-    args.insert(args.end(), {"-filter_complex"});
     switch (opts.text.codec) {
     case TextCodec::ASS:
-      filter = std::string("[0:v]subtitles=")
-                                    .append(escape(target))
-                                    .append(":si=")
-                                    .append(std::to_string(opts.text.index));
-                                    
-      if(FF_CROP) {
-        filter.append("[subs]");
-        filter.append(";[subs]cropdetect=limit=24:round=2:reset=10,crop=w=ih*4/3:h=ih:x=(iw-ih*4/3)/2:y=0,format=yuv420p[out]");
-        args.insert(args.end(), {filter, "-map", "[out]"});
-      } else {
-        filter.append("[v]");
-        args.insert(args.end(), {filter, "-map", "[v]"});
+      // the subtitles filter reads the file by itself and knows nothing
+      // about our seek, so put frames back on the source timeline first
+      if (seek > 0) {
+        chain.push_back("setpts=PTS+" + format_seconds(seek) + "/TB");
+      }
+      chain.push_back(std::string("subtitles=")
+                          .append(escape(target))
+                          .append(":si=")
+                          .append(std::to_string(opts.text.index)));
+      if (seek > 0) {
+        chain.push_back("setpts=PTS-STARTPTS");
       }
       break;
     case TextCodec::PGS:
     case TextCodec::VobSub:
-      filter = std::string("[0:v][0:s:")
-                                    .append(std::to_string(opts.text.index));
-      // dynamic crop detection inline! resolution agnostic!
-      if (FF_CROP) {
-        filter.append("]overlay[subs]");
-        filter.append(";[subs]cropdetect=limit=24:round=2:reset=10,crop=w=ih*4/3:h=ih:x=(iw-ih*4/3)/2:y=0,format=yuv420p[out]");
-        args.insert(args.end(), {filter, "-map", "[out]"});
-      } else {
-        filter.append("]overlay[v]");
-        args.insert(args.end(), {filter, "-map", "[v]"});
-      }
+      inputs = std::string("[0:v][0:s:")
+                   .append(std::to_string(opts.text.index))
+                   .append("]");
+      chain.push_back("overlay");
       break;
     default:
       ERROR("Unexpected subtitle type, bailing out.");
@@ -653,10 +654,33 @@ bool prep_and_call_ffmpeg(std::string &target, std::string &output,
     }
   }
 
-  if (opts.should_test) {
-    args.insert(args.end(), {"-t", "60", "-ss", "00:05:00"});
+  if (trim > 0) {
+    chain.push_back("trim=start=" + format_seconds(trim));
+    chain.push_back("setpts=PTS-STARTPTS");
+  }
+
+  // worked out up front, see crop.cpp
+  if (!opts.video.crop.empty()) {
+    chain.push_back("crop=" + opts.video.crop);
+    if (opts.text.should_encode_subs) {
+      chain.push_back("format=yuv420p");
+    }
+  }
+
+  if (chain.empty()) {
+    return true;
+  }
+
+  graph = inputs;
+  for (size_t i = 0; i < chain.size(); i++) {
+    graph += (i ? "," : "") + chain[i];
   }
+  graph += "[v]";
+  return true;
+}
 
+void append_codec_args(const ffmpeg_opts &opts,
+                       std::vector<std::string> &args, bool with_audio) {
   args.insert(args.end(), {"-c:v", "libx265"}); // we're only supporting HEVC
 
   if (!opts.video.h265_opts.empty()) {
@@ -666,8 +690,15 @@ bool prep_and_call_ffmpeg(std::string &target, std::string &output,
   args.insert(args.end(), {"-crf", std::to_string(opts.video.crf), "-preset",
                             opts.video.preset});
 
-  
+  if (with_audio) {
+    append_audio_args(opts, args);
+  }
+}
 
+// everything that decides what the audio comes out as, shared by whole
+// encodes, samples and the join of a chunked title
+void append_audio_args(const ffmpeg_opts &opts,
+                       std::vector<std::string> &args) {
   if (opts.audio.should_copy) {
     args.insert(args.end(), {"-c:a", "copy"});
   } else {
@@ -677,44 +708,61 @@ bool prep_and_call_ffmpeg(std::string &target, std::string &output,
   if (opts.audio.should_downsample) {
     args.insert(args.end(), {"-ac", "2"});
   }
+}
+
+bool build_ffmpeg_args(const std::string &target, const std::string &output,
+                       const ffmpeg_opts &opts,
+                       std::vector<std::string> &args) {
+
+  args = {"-y", "-i", target};
+
+  std::string graph;
+  if (!build_video_filter(target, opts, 0, 0, graph)) {
+    return false;
+  }
+
+  if (!graph.empty()) {
+    args.insert(args.end(), {"-filter_complex", graph, "-map", "[v]"});
+  }
+
+  append_codec_args(opts, args, true);
 
   args.insert(args.end(), {"-map", std::string("0:a:").append(
                                         std::to_string(opts.audio.index))});
 
-  if (!opts.text.should_encode_subs) {
+  if (graph.empty()) {
     args.insert(args.end(), {"-map", "0:v:0"});
   }
 
   args.insert(args.end(), {output});
 
-  // we need a c-style string for execv
-  std::vector<char *> c_args;
-  c_args.push_back(const_cast<char *>("-y"));
-  c_args.push_back(const_cast<char *>("-i"));
-  c_args.push_back(const_cast<char *>(target.c_str()));
+  return true;
+}
 
-  args.pop_back();
-  args.push_back(output);
+bool prep_and_call_ffmpeg(job_context &ctx, std::string &target,
+                          std::string &output, ffmpeg_opts &opts) {
 
-  for (auto &arg : args) {
-    c_args.push_back(const_cast<char *>(arg.c_str()));
+  if (!resolve_ffmpeg(ctx)) {
+    return false;
+  }
+
+  if (opts.should_test) {
+    return encode_samples(ctx, target, output, opts);
+  }
+  if (ctx.chunks > 1) {
+    return encode_chunked(ctx, target, output, opts);
+  }
+
+  std::vector<ff_job> jobs(1);
+  if (!make_job(ctx, target, output, opts, jobs[0])) {
+    return false;
+  }
+
+  size_t seconds = 0;
+  if (jobs[0].duration == 0 && probe_duration(ctx, target, seconds)) {
+    jobs[0].duration = seconds;
   }
-  c_args.push_back(nullptr);
-  c_args.insert(c_args.begin(), const_cast<char *>(g_program.c_str()));
 
   INFO("Now calling ffmpeg...");
-#ifdef DEBUG
-  for (int i = 0; i < c_args.size() - 1; i++) {
-    printf("%s ", c_args[i]);
-  }
-#endif // DEBUG
-  do {
-    if (process_spawn_ffmpeg(c_args))
-      return true;
-    ERROR("ffmpeg exited abnormally");
-    MAX_RETRIES -= 1;
-  } while(MAX_RETRIES);
-
-  ERROR("max retries reached");  
-  return false;
-}
\ No newline at end of file
+  return run_jobs(ctx, jobs, 1);
+}
@@ -22,21 +22,25 @@
 #define UTIL_H
 
 #include <MediaInfoDLL/MediaInfoDLL.h>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
 #include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <thread>
 #include <vector>
 
 using namespace MediaInfoDLL;
 
-extern bool FF_IGNORE_PAWE;
-extern bool FF_CROP;
-extern char MAX_RETRIES;
-extern char ENTRY_OFFSET;
-
-extern MediaInfo gMi;
 extern const std::string g_art;
 extern const std::vector<std::string> gpresets;
 extern const std::vector<std::string> g_enc_presets;
@@ -44,8 +48,6 @@ extern const std::vector<std::string> g_enc_presets;
 // structures
 
 struct text_info {
-  text_info *next = nullptr;
-  text_info *prev = nullptr;
   size_t index = 0;
   String format;
   String info;
@@ -58,8 +60,6 @@ struct text_info {
 };
 
 struct audio_info {
-  audio_info *next = nullptr;
-  audio_info *prev = nullptr;
   size_t index = 0;
   String format;
   struct bitrate {
@@ -81,8 +81,6 @@ struct audio_info {
 };
 
 struct video_info {
-  video_info *next = nullptr;
-  video_info *prev = nullptr;
   String format;
   struct bitrate {
     String bitrate_str;
@@ -106,68 +104,195 @@ struct video_info {
 
 enum class TextCodec { PGS, ASS, VobSub };
 
-struct streams {
-  struct video {
-    video_info *ptr = nullptr;
-    size_t cnt = 0;
-
-    video() : ptr(nullptr), cnt(0) {}
-    ~video() { clear(); }
-
-    void clear() {
-      while (ptr) {
-        video_info *next = ptr->next;
-        delete ptr;
-        ptr = next;
-      }
-    }
-  } video;
+// one stream's worth of MediaInfo fields, see mi_inform_streams()
+typedef std::vector<String> mi_fields;
+
+enum VideoField {
+  VF_FORMAT,
+  VF_WIDTH,
+  VF_HEIGHT,
+  VF_SOURCE, // OriginalSourceMedium
+  VF_DURATION,
+  VF_BITRATE,
+  VF_COUNT
+};
 
-  struct audio {
-    audio_info *ptr = nullptr;
-    audio_info *selected = nullptr;
-    size_t cnt = 0;
-
-    audio() : ptr(nullptr), selected(nullptr), cnt(0) {}
-    ~audio() { clear(); }
-
-    void clear() {
-      while (ptr) {
-        audio_info *next = ptr->next;
-        delete ptr;
-        ptr = next;
-      }
-      selected = nullptr;
-    }
-  } audio;
+enum AudioField {
+  AF_FORMAT,
+  AF_LANGUAGE,
+  AF_CHANNELS,
+  AF_SOURCE,
+  AF_DURATION,
+  AF_BITRATE,
+  AF_COUNT
+};
 
-  struct text {
-    text_info *ptr = nullptr;
-    audio_info *selected = nullptr;
-    size_t cnt = 0;
-
-    text() : ptr(nullptr), selected(nullptr), cnt(0) {}
-    ~text() { clear(); }
-
-    void clear() {
-      while (ptr) {
-        text_info *next = ptr->next;
-        delete ptr;
-        ptr = next;
-      }
-      selected = nullptr;
-    }
-  } text;
+enum TextField {
+  TF_TITLE,
+  TF_FORMAT,
+  TF_LANGUAGE,
+  TF_DEFAULT,
+  TF_SOURCE,
+  TF_COUNT
+};
+
+struct mi_records {
+  std::vector<mi_fields> video;
+  std::vector<mi_fields> audio;
+  std::vector<mi_fields> text;
+};
+
+// identifies one version of one file on disk
+struct file_key {
+  unsigned long long dev = 0;
+  unsigned long long ino = 0;
+  unsigned long long size = 0;
+  long long mtime = 0;
+  long mtime_ns = 0;
+};
+
+struct streams;
+
+// holds an flock() on <path>.lock while in scope, so that runs sharing a
+// file can read it, merge in what they have and write it back without
+// losing each other's changes
+class file_lock {
+public:
+  explicit file_lock(const std::string &path);
+  ~file_lock();
+  file_lock(const file_lock &) = delete;
+  file_lock &operator=(const file_lock &) = delete;
+
+  bool held() const { return fd != -1; }
+
+private:
+  int fd = -1;
+};
+
+// stream records from earlier runs, so unchanged files skip MediaInfo.
+// shared between threads; saved on destruction if anything changed.
+class probe_cache {
+public:
+  explicit probe_cache(const std::string &path);
+  ~probe_cache();
+
+  // a fast lookup will also take records from a fast probe
+  bool lookup(const file_key &key, streams &inf, bool fast = false);
+  void store(const file_key &key, const std::string &file,
+             const streams &inf, bool fast = false);
+  bool save();
+
+private:
+  struct entry {
+    file_key key;
+    std::string path;
+    bool fast = false;  // from a bounded read, see probe_streams()
+    bool fresh = false; // stored by this run rather than loaded
+    std::string record; // serialised V/A/T lines
+  };
+
+  void load();
+  bool read(std::map<std::string, entry> &into) const;
+
+  std::string path;
+  std::map<std::string, entry> entries; // "dev:ino" -> entry
+  bool dirty = false;
+  std::mutex m;
+};
+
+// MediaInfo handles can't be shared or copied, so copying one of these
+// just gives you a fresh, unopened handle
+struct mediainfo_handle : MediaInfo {
+  mediainfo_handle() = default;
+  mediainfo_handle(const mediainfo_handle &) : MediaInfo() {}
+  mediainfo_handle &operator=(const mediainfo_handle &) { return *this; }
+};
+
+// answers to the interactive questions, replayed from or recorded to a
+// file, see spec.cpp
+class job_spec {
+public:
+  job_spec(const std::string &path, bool recording);
+  bool load();
+  bool lookup(const std::string &key, std::string &value) const;
+  void set(const std::string &key, const std::string &value);
+  bool save() const;
+
+  const std::string path;
+  const bool recording;
+  // nobody is around to ask, so a missing answer ends the run even on a
+  // terminal (watch mode)
+  bool unattended = false;
+
+private:
+  bool read(std::vector<std::pair<std::string, std::string>> &out) const;
+
+  std::vector<std::pair<std::string, std::string>> answers; // in asked order
+};
+
+class run_report;
+class output_stager;
+
+// what --crf-target asks the CRF search for, see crf.cpp
+struct crf_target {
+  std::string metric; // ssim, psnr, vmaf or size, empty when not searching
+  double value = 0;   // the score to reach, or MB per minute not to exceed
+};
+
+// everything a single probe/encode needs that used to live in globals.
+// copying a context copies its settings, but the copy gets a MediaInfo
+// handle of its own so it can be handed to another thread.
+struct job_context {
+  mediainfo_handle mi;
+  std::string program;      // resolved ffmpeg path, empty until needed
+  size_t max_retries = 0;   // total attempts per job, 0 means just one
+  size_t entry_offset = 0;  // how many sorted entries to skip in batch mode
+  size_t max_jobs = 1;      // concurrent ffmpeg children in batch mode
+  size_t chunks = 0;        // split each title into this many parallel encodes
+  size_t probe_threads = 0; // probe the whole batch up front with this many
+  std::string progress_path; // JSON snapshot of the batch, if wanted
+  std::shared_ptr<run_report> report; // null unless --report was given
+  std::shared_ptr<probe_cache> cache; // null when --no-probe-cache
+
+  // so this is very sketchy. often times I'll encounter
+  // a blu-ray with wack dts and pts (decompression / presentation time stamp)
+  // this seems to happen right at the end and ffmpeg still spits out a valid
+  // video file, so we can just ignore it if the user specifies we should.
+  // it is then at their descretion to determine if the output is suitable.
+  bool ignore_pawe = false;
+  bool crop = false; // look for black borders once, then crop them off
+  bool fast_probe = false; // feed MediaInfo a bounded read window
+  bool dashboard = false;  // status view even when only one job runs
+  std::string preset_results; // measured presets, shown when picking one
+  std::shared_ptr<job_spec> spec; // null unless --spec or --record-spec
+  std::string stage_dir; // local scratch for upcoming sources, if any
+  unsigned long long stage_budget = 32ULL << 30; // bytes of it to fill
+  size_t stage_ahead = 0; // how many sources to stage, 0 means --jobs
+  std::shared_ptr<output_stager> outputs; // null unless --stage-output
+  crf_target crf_search; // pick the CRF by sampling instead of asking
+  // run_jobs is sharing the process with another one, see builder.cpp
+  bool background = false;
+};
+
+// a piece of the source encoded on its own, seeked on the input side
+struct segment {
+  double start = 0;  // seconds into the source
+  double length = 0; // seconds, 0 runs to the end of the source
+  std::string path;  // where the encoded piece is written
+};
+
+// every stream in one file, kept in MediaInfo's order so that stream N of
+// a kind is just video[N] / audio[N] / text[N]
+struct streams {
+  std::vector<video_info> video;
+  std::vector<audio_info> audio;
+  std::vector<text_info> text;
 
-  // substruct instances, call clear method instead of delete
   void clear() {
     video.clear();
     audio.clear();
     text.clear();
   }
-
-  streams() = default;
-  ~streams() { clear(); }
 };
 
 struct ffmpeg_opts {
@@ -183,6 +308,7 @@ struct ffmpeg_opts {
     String h265_opts;
     size_t crf;
     String preset;
+    String crop; // w:h:x:y from the crop pre-pass, empty for none
   } video;
   struct text {
     bool should_encode_subs;
@@ -191,22 +317,383 @@ struct ffmpeg_opts {
   } text;
 };
 
+struct cpu_info {
+  int id = 0;
+  int package = 0;
+  int core = 0;
+  int node = 0;
+  int l3 = 0; // lowest cpu id sharing this cpu's L3
+};
+
+struct cpu_topology {
+  std::vector<cpu_info> cpus; // online cpus only
+  size_t sockets = 0;
+  size_t nodes = 0;
+  size_t cores = 0;
+  size_t l3_domains = 0;
+};
+
+// the cores one concurrent job is allowed to use
+struct cpu_slice {
+  std::vector<int> cpus;
+  std::string x265_params; // pools=...:frame-threads=...
+};
+
+enum class JobState { Pending, Running, Done, Failed, Skipped };
+
+// what a quick look at a file told us, and whether it suits the batch
+struct probe_summary {
+  std::string path;
+  bool probed = false;
+  std::string problem; // empty if the file is fine to encode
+  size_t video_cnt = 0;
+  size_t audio_cnt = 0;
+  size_t text_cnt = 0;
+  size_t duration = 0; // seconds, from the first video stream
+  String video_format;
+  std::vector<String> audio_formats;
+  std::vector<String> text_formats;
+};
+
+// probes files on a background thread, staying `depth` entries ahead of
+// whoever is consuming the results, so checks are done by the time an
+// encode slot frees up
+class probe_ahead {
+public:
+  probe_ahead(const job_context &ctx, const ffmpeg_opts &opts,
+              const std::vector<std::string> &paths, size_t depth);
+  // everything was probed up front, just hand the results out
+  explicit probe_ahead(const std::vector<probe_summary> &done);
+  ~probe_ahead();
+
+  // let the prober work up to index + depth
+  void advance(size_t index);
+  // blocks until index has been probed, which it normally already has
+  const probe_summary &get(size_t index);
+  // seconds of content in index, or 0 if it hasn't been probed yet
+  size_t duration(size_t index);
+
+private:
+  void run();
+
+  job_context ctx;
+  ffmpeg_opts opts;
+  std::vector<probe_summary> results;
+  std::vector<bool> ready;
+  size_t depth;
+  size_t horizon = 0;
+  bool stop = false;
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::thread worker;
+};
+
+// copies upcoming sources to local scratch on a background thread, staying
+// `depth` entries ahead of the encodes and never holding more than `budget`
+// bytes, so a slow share only has to keep up on average. see stage.cpp.
+class input_stager {
+public:
+  input_stager(const std::string &dir, unsigned long long budget,
+               const std::vector<std::string> &paths, size_t depth);
+  ~input_stager();
+
+  // let the stager work up to index + depth
+  void advance(size_t index);
+  // the local copy of index if it's finished, otherwise "" and the source
+  // should be read where it is. never waits.
+  std::string take(size_t index);
+  // index is done with, its copy can go
+  void release(size_t index);
+
+private:
+  enum class stage_state { Waiting, Copying, Ready, Abandoned, Gone };
+
+  void run();
+  bool copy(size_t index, const std::string &to);
+
+  std::string dir;
+  unsigned long long budget;
+  unsigned long long held = 0; // bytes staged or being staged
+  std::vector<std::string> paths;
+  std::vector<std::string> staged;
+  std::vector<unsigned long long> sizes;
+  std::vector<stage_state> states;
+  size_t depth;
+  size_t horizon = 0;
+  bool stop = false;
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::thread worker;
+};
+
+// has ffmpeg write outputs to local scratch, then moves them to where they
+// belong on a background thread while the next encodes run. see stage.cpp.
+class output_stager {
+public:
+  output_stager(const std::string &scratch, unsigned long long budget);
+  // waits for everything handed over to be delivered
+  ~output_stager();
+
+  // where ffmpeg should write output instead. expected bytes of the budget
+  // are held for it from now until it's delivered, so encodes that are
+  // still running count against the budget too
+  std::string local_path(const std::string &output,
+                         unsigned long long expected);
+  // somewhere on local scratch to keep work in progress for output, like
+  // chunks waiting to be joined. empty if outputs are written in place.
+  std::string scratch_path(const std::string &output);
+  // output's encode is over: send it on its way, or throw it away
+  void deliver(const std::string &output, bool ok);
+  // whether output is still waiting for or in transfer
+  bool pending(const std::string &output);
+  // too much is waiting to be moved for another encode to start
+  bool backlogged();
+  void wait_for_room();
+  // wait for every delivery, false if any have failed since the last call
+  bool wait_all();
+
+private:
+  void run();
+  bool move(const std::string &from, const std::string &to);
+  void move_log(const std::string &local, const std::string &output);
+
+  std::string dir;
+  unsigned long long budget;
+  unsigned long long queued_bytes = 0;
+  unsigned long long reserved_bytes = 0; // held for encodes still running
+  size_t count = 0;
+  size_t failures = 0;
+  std::map<std::string, std::string> locals; // output -> scratch copy
+  std::map<std::string, unsigned long long> sizes; // of queued outputs
+  std::map<std::string, unsigned long long> reserved; // of running ones
+  std::deque<std::string> queue;
+  bool stop = false;
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::thread worker;
+};
+
+// works out one title's options at a time on a background thread, for the
+// feeds: the crop detection and CRF search that go into them run jobs of
+// their own, which mustn't happen inside a refill. see builder.cpp.
+class options_builder {
+public:
+  options_builder() {}
+  // waits for the title being worked on, if any
+  ~options_builder();
+
+  // start working out key's options from sample, with at most slots ffmpeg
+  // children of its own. false if another title hasn't been taken yet.
+  bool start(size_t key, const job_context &ctx, const std::string &sample,
+             size_t slots);
+  // slots the title being worked on has, which the feed leaves free
+  size_t held();
+  // true once key is done, with its options in opts, or failed set if it
+  // doesn't have any. false while it's being worked on, or wasn't asked for.
+  bool take(size_t key, ffmpeg_opts &opts, bool &failed);
+  // wait up to ms for the title being worked on to be done
+  void wait(int ms);
+
+private:
+  void run();
+
+  std::unique_ptr<job_context> ctx; // for the title being worked on
+  std::string sample;
+  size_t key = 0;
+  size_t slots = 0; // 0 unless a title is being worked on
+  bool done = false; // key is done, and hasn't been taken
+  bool ok = false;
+  ffmpeg_opts opts = ffmpeg_opts();
+  bool stop = false;
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::thread worker;
+};
+
+// every stream record for one file, from the whole-directory probe
+struct file_probe {
+  std::string path;
+  bool ok = false;
+  double seconds = 0; // wall time spent in MediaInfo
+  streams inf;
+};
+
+// the latest numbers from a child's -progress stream
+struct job_progress {
+  size_t frame = 0;
+  double fps = 0;
+  double speed = 0;    // content seconds encoded per wall second
+  double out_time = 0; // seconds of output written so far
+  unsigned long long total_size = 0;
+  std::string bitrate; // as ffmpeg prints it, e.g. "1234.5kbits/s"
+  size_t updates = 0;
+  bool ended = false;
+};
+
+// what a job's children cost, summed over every attempt
+struct job_usage {
+  double wall = 0;  // seconds
+  double spawn = 0; // of which we spent getting the child going
+  double user = 0;
+  double sys = 0;
+  long max_rss_kb = 0; // the largest of any attempt
+  long nvcsw = 0;      // voluntary context switches
+  long nivcsw = 0;     // involuntary context switches
+  long inblock = 0;    // block input operations
+  long oublock = 0;    // block output operations
+};
+
+// one ffmpeg invocation, tracked separately from every other job in a batch
+struct ff_job {
+  std::string input;
+  std::string output;
+  std::string log_path;
+  std::vector<std::string> args;
+  JobState state = JobState::Pending;
+  pid_t pid = -1;
+  int log_fd = -1;   // the child's output, when it comes through us
+  int log_file = -1; // where we copy that output
+  int exit_code = -1;
+  size_t attempts = 0;
+  size_t max_attempts = 1;
+  size_t slot = 0; // which worker slot (and cpu slice) the job runs in
+  size_t duration = 0; // seconds of content to encode, 0 if unknown
+  bool ignore_pawe = false; // as job_context's, for this job alone
+  bool unstaged = false;    // written in place even with --stage-output
+  int progress_fd = -1;
+  std::string progress_buf; // a partial line from the progress pipe
+  job_progress progress;
+  job_usage usage;
+  std::chrono::steady_clock::time_point started; // of the current attempt
+};
+
+// a finished job, as it goes into the run report
+struct job_record {
+  std::string input;
+  std::string output;
+  std::string state;
+  int exit_code = -1;
+  size_t attempts = 0;
+  job_usage usage;
+  size_t duration = 0;
+  unsigned long long input_size = 0;
+  unsigned long long output_size = 0;
+  double kbps = 0; // achieved output bitrate
+  std::string preset;
+  std::string crf;
+  std::string x265_params;
+};
+
+// every job finished this run, written out after each batch
+class run_report {
+public:
+  explicit run_report(const std::string &path);
+
+  void record(const ff_job &job);
+  bool write() const;
+
+private:
+  bool read_others(bool csv, std::vector<std::string> &out) const;
+  bool write_json(std::ostream &out,
+                  const std::vector<std::string> &others) const;
+  bool write_csv(std::ostream &out,
+                 const std::vector<std::string> &others) const;
+
+  std::string path;
+  std::string run; // tells this run's records from others' in a shared file
+  std::vector<job_record> records;
+};
+
+// the whole batch at a glance, worked out from every job's progress
+struct batch_progress {
+  size_t total = 0;
+  size_t done = 0;
+  size_t failed = 0;
+  size_t skipped = 0;
+  size_t running = 0;
+  size_t pending = 0;
+  double fps = 0;       // summed over running jobs
+  double speed = 0;     // summed over running jobs
+  double remaining = 0; // content seconds left to encode
+  double eta = -1;      // wall seconds, -1 if unknown
+};
+
+// one encode of the preset benchmark, see presets.cpp
+struct preset_result {
+  size_t height = 0;  // of the test clip
+  size_t seconds = 0; // length of the test clip
+  size_t crf = 0;
+  std::string preset;      // one of g_enc_presets
+  std::string params;      // one of gpresets
+  double fps = 0;          // frames over wall time
+  double cpu_per_min = 0;  // user + sys seconds per minute of content
+  unsigned long long bytes = 0;
+};
+
+struct preset_bench_opts {
+  std::string results;
+  std::vector<size_t> heights{720, 1080, 2160};
+  std::vector<std::string> enc_presets; // empty means all of them
+  std::vector<size_t> crfs{16, 20, 24};
+  size_t seconds = 10;
+};
+
+// a source of jobs that keeps run_jobs going after its list runs out, see
+// watch.cpp
+class job_feed {
+public:
+  virtual ~job_feed() {}
+  // append up to room jobs that are ready to start to the end of jobs.
+  // anything else waits for a later call, so what goes next can still be
+  // decided then.
+  virtual void refill(std::vector<ff_job> &jobs, size_t room) = 0;
+  // a job is over (done, failed or skipped) and leaves the list
+  virtual void finished(const ff_job &job) = 0;
+  // nothing is running: wait a little for work, false if none will come
+  virtual bool idle() = 0;
+};
+
+// logging, see log.cpp
+void log_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void log_line(const std::string &line);
+bool log_start();
+void log_stop();
+void log_flush();
+void log_set_footer(const std::string &text);
+bool capture_child_output(int from, int log_file);
+
+// runs the async logger for as long as it's in scope, unless someone
+// further up already started it
+struct log_session {
+  bool started;
+  log_session() : started(log_start()) {}
+  ~log_session() {
+    if (started) {
+      log_stop();
+    }
+  }
+};
+
 #define INFO(fmt, ...)                                                         \
-  std::printf("[\033[1m\033[34m+\033[0m] \033[1m" fmt "\n\033[0m",             \
-              ##__VA_ARGS__)
+  log_printf("[\033[1m\033[34m+\033[0m] \033[1m" fmt "\n\033[0m",              \
+             ##__VA_ARGS__)
 
 #define WARNING(fmt, ...)                                                      \
-  std::printf("[\033[1m\033[31m!\033[0m] \033[1m" fmt "\n\033[0m",             \
-              ##__VA_ARGS__)
+  log_printf("[\033[1m\033[31m!\033[0m] \033[1m" fmt "\n\033[0m",              \
+             ##__VA_ARGS__)
 
 #define ERROR(fmt, ...)                                                        \
-  std::printf("[\033[1m\033[31m-\033[0m] \033[1m%s: " fmt "\n\033[0m",         \
-              __func__, ##__VA_ARGS__)
+  log_printf("[\033[1m\033[31m-\033[0m] \033[1m%s: " fmt "\n\033[0m",          \
+             __func__, ##__VA_ARGS__)
 
 #ifdef DEBUG
 #define DEBUG_INFO(fmt, ...)                                                   \
-  std::printf("[\033[1m\033[34m>\033[0m] \033[1m%s: " fmt "\n\033[0m",         \
-              __func__, ##__VA_ARGS__)
+  log_printf("[\033[1m\033[34m>\033[0m] \033[1m%s: " fmt "\n\033[0m",          \
+             __func__, ##__VA_ARGS__)
 #else
 #define DEBUG_INFO(fmt, ...)                                                   \
   do {                                                                         \
@@ -214,62 +701,22 @@ struct ffmpeg_opts {
 #endif
 
 // generally useful stuff
-String mi_get_string(stream_t kind, size_t index, const String &param);
-String mi_get_measure(stream_t kind, size_t index, const String &param);
-void mi_stream_count(stream_t type, size_t *value);
+String mi_get_string(job_context &ctx, stream_t kind, size_t index,
+                     const String &param);
+String mi_get_measure(job_context &ctx, stream_t kind, size_t index,
+                      const String &param);
+void mi_stream_count(job_context &ctx, stream_t type, size_t &value);
+bool mi_inform_streams(job_context &ctx, mi_records &out);
+bool parse_inform_report(const String &report, mi_records &out);
 bool cast_to_size(const String &str, size_t &dest);
-bool build_options(ffmpeg_opts &opts);
+bool build_options(job_context &ctx, const std::string &path,
+                   ffmpeg_opts &opts);
 std::string which(const std::string &command);
 void print_rainbow_ascii(const std::string &text);
 void clear_tty();
-void print_preset_options();
-
-/*
--- visual --
-
-this was not necessary, however
-I wanted to have a go at implementing
-this structure.
-
-iter 0
-
-      TAIL/HEAD
-        next -> NULL
-NULL <- prev
-
-iter 1
-
-      TAIL(0)  HEAD(1)
-        next ->  next -> NULL
-NULL <- prev <-  prev
-
-iter 2
-
-      TAIL(0)    (1)   HEAD(2)
-        next ->  next -> next -> NULL
-NULL <- prev <-  prev <- prev
-
-...
-*/
+void print_preset_options(const job_context &ctx, size_t height);
 
 // templating
-template <typename item> bool insert_new_item(item *&head_ref) {
-  item *current_item = new item();
-  if (current_item == NULL) {
-    ERROR("Memory allocation failed.");
-    return 0;
-  }
-
-  current_item->next = head_ref; // null if head doesn't exist yet
-  current_item->prev = NULL;
-
-  if (head_ref != NULL) {
-    head_ref->prev = current_item;
-  }
-  head_ref = current_item;
-  return true;
-}
-
 template <typename item> bool handle_duration(String duration, item &ref) {
   if (duration.empty()) {
     ERROR("Duration string is empty.");
@@ -351,55 +798,190 @@ set_bitrate:
 }
 
 template <typename T>
-std::vector<std::string> extract_fields(T *head, size_t size) {
+std::vector<std::string> extract_fields(const std::vector<T> &items) {
   std::vector<std::string> fields;
+  fields.reserve(items.size());
 
-  if (head == nullptr) {
-    return fields;
-  }
-
-  if (size > 0) {
-    fields.reserve(size);
-  }
-
-  T *current = head;
-  size_t index = 1;
-
-  while (current != nullptr) {
-    if (current->format.empty()) {
+  for (size_t i = 0; i < items.size(); i++) {
+    const T &current = items[i];
+    if (current.format.empty()) {
       ERROR("Node data is invalid");
       break;
     }
 
-    fields.push_back(std::to_string(index) + ". " + current->format + " / " +
-                     current->lang +
-                     (!current->info.empty() ? " / " + current->info : ""));
-
-    current = current->next;
-    ++index;
+    fields.push_back(std::to_string(i + 1) + ". " + current.format + " / " +
+                     current.lang +
+                     (!current.info.empty() ? " / " + current.info : ""));
   }
 
   return fields;
 }
 
-bool populate_video_data(video_info &video, size_t index);
-bool populate_audio_data(audio_info &audio, size_t index);
-bool populate_text_data(text_info &text, size_t index);
-void *retrieve_stream_x(streams *inf, size_t index, String type);
+bool populate_video_data(const mi_fields &fields, video_info &video);
+bool populate_audio_data(const mi_fields &fields, audio_info &audio,
+                         size_t index);
+bool populate_text_data(const mi_fields &fields, text_info &text,
+                        size_t index);
+bool get_streams(job_context &ctx, struct streams &streams,
+                 bool verbose = true);
+bool populate_streams(const mi_records &records, struct streams &streams,
+                      bool verbose = true);
 bool fileExists(const char *path);
 std::string format_episode(int curr, int ep_max);
-bool prep_and_call_ffmpeg(std::string &target, std::string &output,
-                          ffmpeg_opts &opts);
+std::vector<std::string> split_list(const std::string &in);
+bool resolve_ffmpeg(job_context &ctx);
+bool build_ffmpeg_args(const std::string &target, const std::string &output,
+                       const ffmpeg_opts &opts,
+                       std::vector<std::string> &args);
+bool build_video_filter(const std::string &target, const ffmpeg_opts &opts,
+                        double seek, double trim, std::string &graph);
+void append_codec_args(const ffmpeg_opts &opts,
+                       std::vector<std::string> &args, bool with_audio);
+void append_audio_args(const ffmpeg_opts &opts,
+                       std::vector<std::string> &args);
+bool prep_and_call_ffmpeg(job_context &ctx, std::string &target,
+                          std::string &output, ffmpeg_opts &opts);
 char get_from_argv(int index, char** argv);
+bool size_from_argv(int index, char **argv, size_t max, size_t &out);
+bool long_from_argv(int index, char **argv, long &out);
 
 // file stuff
-bool build_file_list(std::vector<std::string> &list, std::string &target);
+bool build_file_list(std::vector<std::string> &list, std::string &target,
+                     size_t entry_offset);
+bool ends_with(const std::string &filename, const std::string &extension);
 bool directory_exists(const std::string &path);
 bool directories_exist(const std::vector<std::string> &dirs);
 bool file_exists(const std::string &path);
+unsigned long long file_size(const std::string &path);
 bool make_directory(const std::string &path);
 std::string escape(const std::string &input);
 bool rm(const std::string &path);
+bool replace_file(const std::string &path,
+                  const std::function<bool(std::ostream &)> &write);
+
+// job stuff
+bool make_job(const job_context &ctx, const std::string &input,
+              const std::string &output, const ffmpeg_opts &opts, ff_job &job);
+void add_rusage(job_usage &usage, const struct rusage &ru);
+bool pump_progress(ff_job &job);
+void summarise_batch(const std::vector<ff_job> &jobs, batch_progress &out);
+std::string format_clock(double seconds);
+const char *job_state_name(JobState state);
+std::string json_escape(const std::string &in);
+bool write_progress_file(const std::string &path,
+                         const std::vector<ff_job> &jobs,
+                         const batch_progress &batch);
+void report_progress(const job_context &ctx, const std::vector<ff_job> &jobs,
+                     bool detail);
+std::string render_dashboard(const std::vector<ff_job> &jobs,
+                             const batch_progress &batch, size_t width);
+void draw_dashboard(const job_context &ctx, const std::vector<ff_job> &jobs);
+bool run_jobs(const job_context &ctx, std::vector<ff_job> &jobs,
+              size_t max_parallel, probe_ahead *probes = nullptr,
+              job_feed *feed = nullptr, input_stager *stager = nullptr);
+
+// probe stuff
+bool probe_streams(job_context &ctx, const std::string &path, streams &inf);
+
+// cache stuff
+bool stat_key(const std::string &path, file_key &key);
+std::string default_cache_dir();
+std::string cache_escape(const std::string &in);
+std::vector<std::string> cache_split(const std::string &line);
+void summarise_probe(const streams &inf, const ffmpeg_opts &opts,
+                     probe_summary &out);
+bool probe_file(job_context &ctx, const std::string &path,
+                const ffmpeg_opts &opts, probe_summary &out);
+bool probe_library(const job_context &ctx,
+                   const std::vector<std::string> &paths, size_t threads,
+                   std::vector<file_probe> &out);
+
+// chunk stuff
+std::string format_seconds(double seconds);
+bool probe_duration(job_context &ctx, const std::string &path,
+                    size_t &seconds);
+void segment_seek(const ffmpeg_opts &opts, const segment &seg, double &seek,
+                  double &trim);
+bool make_segment_job(const job_context &ctx, const std::string &input,
+                      const ffmpeg_opts &opts, const segment &seg,
+                      ff_job &job, bool with_audio = false);
+bool write_concat_list(const std::string &path,
+                       const std::vector<segment> &segs);
+std::string work_dir(const job_context &ctx, const std::string &output,
+                     const char *suffix);
+bool make_concat_job(const std::string &target, const std::string &output,
+                     const ffmpeg_opts &opts,
+                     const std::vector<segment> &segs, const std::string &dir,
+                     ff_job &job);
+bool concat_segments(const job_context &ctx, const std::string &target,
+                     const std::string &output, const ffmpeg_opts &opts,
+                     const std::vector<segment> &segs,
+                     const std::string &dir, ff_job &job);
+size_t chunk_count(size_t chunks, size_t duration);
+bool make_chunk_jobs(const job_context &ctx, const std::string &target,
+                     const ffmpeg_opts &opts, size_t duration, size_t count,
+                     const std::string &dir, std::vector<segment> &segs,
+                     std::vector<ff_job> &jobs);
+bool encode_chunked(job_context &ctx, const std::string &target,
+                    const std::string &output, const ffmpeg_opts &opts);
+bool encode_samples(job_context &ctx, const std::string &target,
+                    const std::string &output, const ffmpeg_opts &opts);
+
+// crop stuff
+bool detect_crop(job_context &ctx, const std::string &path, size_t width,
+                 size_t height, std::string &crop);
+bool union_crops(const std::vector<std::string> &log_paths, long &w, long &h,
+                 long &x, long &y);
+
+// crf search stuff
+bool parse_crf_target(const std::string &in, crf_target &out);
+// the candidates one round tries between steps lo and hi, and what's left
+// of the range once it knows which of them passed
+std::vector<long> crf_search_steps(long lo, long hi, size_t per_round);
+void narrow_crf_search(const std::vector<long> &steps,
+                       const std::vector<bool> &passed, long &lo, long &hi,
+                       long &best);
+bool search_crf(job_context &ctx, const std::string &path, ffmpeg_opts &opts);
+
+// job spec stuff, these ask the user unless a spec has the answer. false
+// if the spec has no answer and nobody can be asked, or a bad one.
+bool ask_yes_no(const job_context &ctx, const std::string &key,
+                const std::string &prompt, String &answer);
+bool ask_number(const job_context &ctx, const std::string &key,
+                const std::string &prompt, size_t min, size_t max,
+                String &answer);
+bool ask_choice(const job_context &ctx, const std::string &key,
+                const std::string &prompt,
+                const std::vector<std::string> &options, String &answer);
+
+// watch folder stuff
+bool watch_folders(const job_context &ctx,
+                   const std::vector<std::string> &specs);
+
+// job queue stuff
+std::string new_queue_spec(const std::string &queue);
+bool enqueue_jobs(const job_context &ctx, const std::string &queue,
+                  long priority, const std::vector<ff_job> &jobs);
+bool print_queue(const std::string &queue);
+bool drain_queue(const job_context &ctx, const std::string &queue);
+
+// preset benchmark stuff
+std::string default_preset_results();
+bool load_preset_results(const std::string &path,
+                         std::vector<preset_result> &out);
+bool save_preset_results(const std::string &path,
+                         std::vector<preset_result> &results);
+bool run_preset_bench(const job_context &ctx, const preset_bench_opts &opts);
+void print_preset_results(const std::string &path, size_t height);
+
+// topology stuff
+bool read_cpu_topology(cpu_topology &topo,
+                       const std::string &root = "/sys/devices/system/cpu");
+bool partition_cpus(const cpu_topology &topo, size_t count,
+                    std::vector<cpu_slice> &slices);
+void apply_cpu_slice(std::vector<std::string> &args, const cpu_slice &slice);
+bool pin_spawning_thread(const cpu_slice &slice);
+void unpin_spawning_thread();
 
 // this prints information on a particular stream. see text/audio/video.cpp
 // for more
@@ -20,30 +20,22 @@
 
 #include "util.h"
 
-bool populate_video_data(video_info &video, size_t index) {
-  char *endptr;
-  char *cstring;
-
-  String t_format = mi_get_string(Stream_Video, index, "Format");
+bool populate_video_data(const mi_fields &fields, video_info &video) {
+  const String &t_format = fields[VF_FORMAT];
 
   video.format = !t_format.empty() ? t_format : "-";
 
-  if (!cast_to_size(mi_get_string(Stream_Video, index, "Width"),
-                    video.ds.width)) {
+  if (!cast_to_size(fields[VF_WIDTH], video.ds.width)) {
     return false;
   }
-  if (!cast_to_size(mi_get_string(Stream_Video, index, "Height"),
-                    video.ds.height)) {
+  if (!cast_to_size(fields[VF_HEIGHT], video.ds.height)) {
     return false;
   }
 
-  video.is_bluray =
-      mi_get_string(Stream_Video, index, "OriginalSourceMedium") == "Blu-ray"
-          ? 1
-          : 0;
+  video.is_bluray = fields[VF_SOURCE] == "Blu-ray" ? 1 : 0;
 
-  handle_duration(mi_get_string(Stream_Video, index, "Duration"), video);
-  handle_bitrate(mi_get_string(Stream_Video, index, "BitRate"), video);
+  handle_duration(fields[VF_DURATION], video);
+  handle_bitrate(fields[VF_BITRATE], video);
   return true;
 }
 
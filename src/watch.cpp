@@ -0,0 +1,398 @@
+// Copyright (c) 2024 Elizabeth Watson
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <dirent.h>
+#include <map>
+#include <poll.h>
+#include <set>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "util.h"
+
+// watch mode is a daemon: it keeps an eye on intake directories and feeds
+// every new source into the encode queue as soon as it has finished
+// landing. each directory is described by a job spec (see spec.cpp) that
+// answers the usual questions and also says where things go:
+//
+//   watch_dir = /srv/intake/show-s2
+//   output_dir = /srv/library/show/Season 02
+//   settle_seconds = 30   # optional, how long a file must sit unchanged
+//
+// the first file that settles in a directory is used to work out the
+// options, like the first episode of a batch; every file after it is
+// checked against them. outputs are named after their source, written as
+// <name>.partial.mp4 and renamed once the encode has succeeded, so a
+// source whose output exists has been done.
+
+#define DEFAULT_SETTLE_SECONDS 30
+// how often sources waiting to settle are looked at again
+#define SETTLE_CHECK_SECONDS 1
+// how long an idle queue waits on inotify before checking again
+#define WATCH_IDLE_MS 1000
+
+#ifdef __linux__
+
+struct watched_dir {
+  std::string source;
+  std::string output;
+  std::shared_ptr<job_spec> spec;
+  time_t settle = DEFAULT_SETTLE_SECONDS;
+  ffmpeg_opts opts = ffmpeg_opts();
+  bool have_opts = false;
+};
+
+static bool is_source(const std::string &name) {
+  return ends_with(name, ".mkv") || ends_with(name, ".VOB");
+}
+
+static std::string output_stem(const watched_dir &dir,
+                               const std::string &name) {
+  size_t dot = name.rfind('.');
+  return dir.output + "/" +
+         (dot == std::string::npos ? name : name.substr(0, dot));
+}
+
+class folder_feed : public job_feed {
+public:
+  folder_feed(const job_context &ctx) : ctx(ctx) {}
+  ~folder_feed() {
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+
+  bool add(const std::string &spec_path);
+  bool start();
+
+  void refill(std::vector<ff_job> &jobs, size_t room) override;
+  void finished(const ff_job &job) override;
+  bool idle() override;
+
+private:
+  void drain_events();
+  void consider(size_t dir, const std::string &name);
+  void collect();
+  bool queue(size_t dir, const std::string &path, std::vector<ff_job> &jobs);
+
+  job_context ctx;
+  int fd = -1;
+  std::vector<watched_dir> dirs;
+  std::map<int, size_t> by_wd;
+  // sources waiting to settle, by path
+  std::map<std::string, size_t> waiting;
+  // sources queued or running, and ones that failed, which aren't tried
+  // again until the daemon is restarted
+  std::set<std::string> taken;
+  // partial output -> where it goes once it's done
+  std::map<std::string, std::string> partials;
+  options_builder builder;
+  std::string building; // the source the builder has, if any
+  size_t building_dir = 0;
+  time_t last_check = 0;
+};
+
+bool folder_feed::add(const std::string &spec_path) {
+  watched_dir dir;
+  dir.spec.reset(new job_spec(spec_path, false));
+  if (!dir.spec->load()) {
+    return false;
+  }
+
+  std::string settle;
+  if (!dir.spec->lookup("watch_dir", dir.source) ||
+      !dir.spec->lookup("output_dir", dir.output)) {
+    ERROR("Job spec \"%s\" needs watch_dir and output_dir",
+          spec_path.c_str());
+    return false;
+  }
+  // there's no one to look at a test encode
+  dir.spec->set("should_test", "no");
+  dir.spec->unattended = true;
+
+  if (dir.spec->lookup("settle_seconds", settle)) {
+    size_t seconds;
+    if (settle.empty() ||
+        settle.find_first_not_of("0123456789") != std::string::npos ||
+        !cast_to_size(settle, seconds)) {
+      ERROR("Job spec \"%s\": settle_seconds must be a number of seconds, "
+            "not \"%s\"",
+            spec_path.c_str(), settle.c_str());
+      return false;
+    }
+    dir.settle = static_cast<time_t>(seconds);
+  }
+
+  if (!directory_exists(dir.source)) {
+    ERROR("\"%s\" is not a directory", dir.source.c_str());
+    return false;
+  }
+  if (!make_directory(dir.output)) {
+    return false;
+  }
+
+  dirs.push_back(dir);
+  return true;
+}
+
+bool folder_feed::start() {
+  fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd == -1) {
+    ERROR("inotify_init1 failed: %s", strerror(errno));
+    return false;
+  }
+
+  for (size_t i = 0; i < dirs.size(); i++) {
+    // IN_MODIFY isn't asked for: a file being written would wake us for
+    // every block, and settling is decided by its mtime anyway
+    int wd = inotify_add_watch(fd, dirs[i].source.c_str(),
+                               IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd == -1) {
+      ERROR("Can't watch \"%s\": %s", dirs[i].source.c_str(),
+            strerror(errno));
+      return false;
+    }
+    by_wd[wd] = i;
+
+    // whatever landed while we weren't looking
+    DIR *d = opendir(dirs[i].source.c_str());
+    if (!d) {
+      ERROR("opendir failed for \"%s\"", dirs[i].source.c_str());
+      return false;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != nullptr) {
+      consider(i, entry->d_name);
+    }
+    closedir(d);
+
+    INFO("Watching %s -> %s", dirs[i].source.c_str(),
+         dirs[i].output.c_str());
+  }
+  return true;
+}
+
+// a source is worth waiting on unless it's been done, or is already
+// queued or given up on
+void folder_feed::consider(size_t dir, const std::string &name) {
+  if (!is_source(name)) {
+    return;
+  }
+  std::string path = dirs[dir].source + "/" + name;
+  if (taken.count(path) || waiting.count(path) ||
+      file_exists(output_stem(dirs[dir], name) + ".mp4")) {
+    return;
+  }
+  DEBUG_INFO("Waiting for %s to settle", path.c_str());
+  waiting[path] = dir;
+}
+
+void folder_feed::drain_events() {
+  alignas(struct inotify_event) char buf[16384];
+
+  for (;;) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0) {
+      return;
+    }
+    for (char *p = buf; p < buf + n;) {
+      struct inotify_event *ev = reinterpret_cast<struct inotify_event *>(p);
+      p += sizeof(struct inotify_event) + ev->len;
+      if (ev->mask & IN_Q_OVERFLOW) {
+        WARNING("Missed some inotify events, rescan on restart");
+      }
+      auto it = by_wd.find(ev->wd);
+      if (it != by_wd.end() && ev->len && !(ev->mask & IN_ISDIR)) {
+        consider(it->second, ev->name);
+      }
+    }
+  }
+}
+
+// pick up the directory the builder has finished with, if it has. a
+// source whose options can't be worked out is given up on, and the next
+// one to settle in its directory gets a go.
+void folder_feed::collect() {
+  if (building.empty()) {
+    return;
+  }
+  ffmpeg_opts built = ffmpeg_opts();
+  bool failed;
+  if (!builder.take(building_dir, built, failed)) {
+    return;
+  }
+
+  // whatever the spec was missing, or got wrong, only costs this source
+  if (failed) {
+    WARNING("No options for %s from \"%s\", giving up on it until "
+            "restarted",
+            building.c_str(), dirs[building_dir].spec->path.c_str());
+    taken.insert(building);
+    waiting.erase(building);
+  } else {
+    dirs[building_dir].opts = built;
+    dirs[building_dir].have_opts = true;
+  }
+  building.clear();
+}
+
+bool folder_feed::queue(size_t index, const std::string &path,
+                        std::vector<ff_job> &jobs) {
+  watched_dir &dir = dirs[index];
+  job_context local(ctx);
+  local.spec = dir.spec;
+
+  probe_summary probe;
+  if (!probe_file(local, path, dir.opts, probe)) {
+    ERROR("Skipping %s: %s", path.c_str(), probe.problem.c_str());
+    return false;
+  }
+
+  std::string name = path.substr(path.rfind('/') + 1);
+  std::string stem = output_stem(dir, name);
+  std::string partial = stem + ".partial.mp4";
+
+  ff_job job;
+  if (!make_job(local, path, partial, dir.opts, job)) {
+    return false;
+  }
+  job.duration = probe.duration;
+  jobs.push_back(job);
+
+  partials[partial] = stem + ".mp4";
+  INFO("Queued %s", path.c_str());
+  return true;
+}
+
+void folder_feed::refill(std::vector<ff_job> &jobs, size_t room) {
+  drain_events();
+  collect();
+  // the builder's jobs aren't in the list, but they take up slots all the
+  // same
+  size_t held = builder.held();
+  room = room > held ? room - held : 0;
+
+  time_t now = time(nullptr);
+  if (room == 0 || now - last_check < SETTLE_CHECK_SECONDS) {
+    return;
+  }
+  last_check = now;
+
+  // the map is ordered, so a season lands in the queue in episode order
+  for (auto it = waiting.begin(); it != waiting.end() && room;) {
+    struct stat st;
+    if (stat(it->first.c_str(), &st) != 0) {
+      // gone again, e.g. a rename to its final name
+      it = waiting.erase(it);
+      continue;
+    }
+    if (now - st.st_mtime < dirs[it->second].settle) {
+      ++it;
+      continue;
+    }
+
+    // the first source to settle decides the options for its directory,
+    // worked out with every slot that's free now. the rest of that
+    // directory waits for them.
+    watched_dir &dir = dirs[it->second];
+    if (!dir.have_opts) {
+      if (building.empty()) {
+        job_context local(ctx);
+        local.spec = dir.spec;
+        INFO("Working out options for %s from %s", dir.source.c_str(),
+             it->first.c_str());
+        if (builder.start(it->second, local, it->first, room)) {
+          building = it->first;
+          building_dir = it->second;
+          room = 0;
+        }
+      }
+      ++it;
+      continue;
+    }
+
+    taken.insert(it->first);
+    if (queue(it->second, it->first, jobs)) {
+      room--;
+    }
+    it = waiting.erase(it);
+  }
+}
+
+void folder_feed::finished(const ff_job &job) {
+  auto it = partials.find(job.output);
+  if (it == partials.end()) {
+    return;
+  }
+
+  if (job.state == JobState::Done) {
+    if (rename(job.output.c_str(), it->second.c_str()) != 0) {
+      ERROR("Failed to rename %s to %s: %s", job.output.c_str(),
+            it->second.c_str(), strerror(errno));
+    } else {
+      INFO("Finished %s", it->second.c_str());
+    }
+  } else {
+    WARNING("Giving up on %s until restarted", job.input.c_str());
+    unlink(job.output.c_str());
+  }
+  partials.erase(it);
+}
+
+bool folder_feed::idle() {
+  // sources still settling need looking at again even if nothing happens
+  pollfd p = {fd, POLLIN, 0};
+  poll(&p, 1, WATCH_IDLE_MS);
+  return true;
+}
+
+bool watch_folders(const job_context &ctx,
+                   const std::vector<std::string> &specs) {
+  folder_feed feed(ctx);
+  for (auto &spec : specs) {
+    if (!feed.add(spec)) {
+      return false;
+    }
+  }
+
+  job_context local(ctx);
+  if (!resolve_ffmpeg(local) || !feed.start()) {
+    return false;
+  }
+
+  std::vector<ff_job> jobs;
+  return run_jobs(local, jobs, local.max_jobs, nullptr, &feed);
+}
+
+#else
+
+bool watch_folders(const job_context &ctx,
+                   const std::vector<std::string> &specs) {
+  ERROR("Watch mode needs inotify, which this platform doesn't have");
+  return false;
+}
+
+#endif // __linux__